@@ -0,0 +1,174 @@
+/*
+ * board.c - Interface boards the daemon drives and the busses they bring
+ *
+ * Every board gets its own SPI thread, so a slow or failing link on one
+ * never holds up the others. The daemon only deals in daemon wide bus
+ * numbers, each board's thread turns them into its own.
+ */
+
+#include <stdint.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <poll.h>
+#include "board.h"
+
+void board_set_init(board_set_t *set) {
+    memset(set, 0, sizeof *set);
+}
+
+/*
+ * Adds a board on an SPI device, not opened yet
+ */
+board_t *board_add(board_set_t *set, const char *device) {
+    board_t *board;
+    
+    if(set->nboards == BOARD_MAX) return NULL;
+    
+    board = &set->boards[set->nboards];
+    memset(board, 0, sizeof *board);
+    board->index = set->nboards;
+    spi_dev_init(&board->dev, device);
+    set->nboards ++;
+    
+    return board;
+}
+
+/*
+ * Brings the link up, finds out how many busses the board has and gets its
+ * thread ready. Boards have to be opened in the order they were added so
+ * their busses are numbered in that order
+ */
+int board_open(board_set_t *set, board_t *board, int priority) {
+    j1850_status_t status;
+    j1850_heartbeat_t heartbeat;
+    
+    if(spi_open(&board->dev) < 0) return -1;
+    spi_tune_link(&board->dev);
+    
+    if(j1850_get_status(&board->dev, &status) < 0) {
+        printf("%s: Error getting status\n", board->dev.device);
+        return -1;
+    }
+    
+    board->bus_base = set->nbusses;
+    board->nbusses = status.nbusses;
+    set->nbusses += status.nbusses;
+    if(board->nbusses) printf("%s: busses %i to %i\n", board->dev.device, board->bus_base, board->bus_base + board->nbusses - 1);
+    
+    if(io_init(&board->io, &board->dev, priority) < 0) return -1;
+    board->io.bus_base = board->bus_base;
+    
+    //Clears the board's reset flags, so its thread only hears about resets from here on
+    if(j1850_heartbeat(&board->dev, 0, &heartbeat) < 0) {
+        printf("%s: Error getting heartbeat\n", board->dev.device);
+        return -1;
+    }
+    if(heartbeat.reset_flags & J1850_RESET_WATCHDOG) printf("%s: board was last reset by its watchdog\n", board->dev.device);
+    board->io.board_resyncs = heartbeat.resyncs;
+    
+    return 0;
+}
+
+/*
+ * Hands every board over to its own thread, from here on everything goes
+ * through the rings
+ */
+int board_start(board_set_t *set) {
+    int i;
+    
+    for(i=0; i<set->nboards; i++) {
+        if(io_start(&set->boards[i].io) < 0) {
+            printf("%s: Error starting SPI thread\n", set->boards[i].dev.device);
+            return -1;
+        }
+    }
+    
+    return 0;
+}
+
+/*
+ * Stops every board's thread, lets them carry on with their own jobs straight
+ * away rather than after they time out, and closes them
+ */
+void board_stop(board_set_t *set) {
+    int i;
+    
+    for(i=0; i<set->nboards; i++) io_stop(&set->boards[i].io);
+    
+    for(i=0; i<set->nboards; i++) {
+        board_t *board = &set->boards[i];
+        if(board->io.handoff) j1850_set_handoff(&board->dev, 0);
+        io_free(&board->io);
+        spi_close(&board->dev);
+    }
+}
+
+board_t *board_for_bus(board_set_t *set, int bus) {
+    int i;
+    
+    for(i=0; i<set->nboards; i++) {
+        board_t *board = &set->boards[i];
+        if(bus >= board->bus_base && bus < board->bus_base + board->nbusses) return board;
+    }
+    
+    return NULL;
+}
+
+/*
+ * io_send() on whichever board has bus
+ */
+int board_send(board_set_t *set, int class, int bus, const uint8_t *data, int bytes, uint64_t origin) {
+    board_t *board = board_for_bus(set, bus);
+    
+    if(board == NULL) {
+        printf("No bus %i, dropping message\n", bus);
+        return -1;
+    }
+    
+    return io_send(&board->io, class, bus, data, bytes, origin);
+}
+
+/*
+ * io_send_tracked() on whichever board has bus, ids are per board so
+ * reports are told apart by bus and id together
+ */
+int board_send_tracked(board_set_t *set, int class, int bus, const uint8_t *data, int bytes, uint64_t origin, uint8_t retries, int timeout_ms) {
+    board_t *board = board_for_bus(set, bus);
+    
+    if(board == NULL) {
+        printf("No bus %i, dropping message\n", bus);
+        return -1;
+    }
+    
+    return io_send_tracked(&board->io, class, bus, data, bytes, origin, retries, timeout_ms);
+}
+
+/*
+ * Waits up to timeout_ms for any board's thread to hand over something,
+ * returns the number of frames waiting across all their rx rings
+ */
+int board_wait(board_set_t *set, int timeout_ms) {
+    struct pollfd pfds[BOARD_MAX];
+    uint64_t count;
+    int waiting = 0;
+    int i;
+    
+    for(i=0; i<set->nboards; i++) {
+        pfds[i].fd = set->boards[i].io.rx_event;
+        pfds[i].events = POLLIN;
+        waiting += j1850_ring_count(&set->boards[i].io.rx);
+    }
+    
+    if(waiting == 0) {
+        if(poll(pfds, set->nboards, timeout_ms) < 0) return -1;
+    }
+    
+    waiting = 0;
+    for(i=0; i<set->nboards; i++) {
+        if(read(pfds[i].fd, &count, sizeof count) < 0) count = 0;
+        waiting += j1850_ring_count(&set->boards[i].io.rx);
+    }
+    
+    return waiting;
+}
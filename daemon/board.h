@@ -0,0 +1,50 @@
+/*
+ * board.h - Interface boards the daemon drives and the busses they bring
+ */
+
+#ifndef __BOARD_H__
+#define __BOARD_H__
+
+#include "spi.h"
+#include "io.h"
+
+#define BOARD_MAX 8
+
+typedef struct board_t board_t;
+typedef struct board_set_t board_set_t;
+
+/*
+ * Everything about one board, its busses are numbered daemon wide from
+ * bus_base on in the order the boards were added
+ */
+struct board_t {
+    spi_dev_t dev;
+    io_thread_t io;
+    int index;
+    int bus_base;
+    int nbusses;
+    
+    //Steering wheel switches read by this board, pressed and last pressed
+    int sw_state;
+    int last_sw_state;
+    //Satellite receiver being emulated to the radio on this board's busses
+    int sat_state;
+};
+
+struct board_set_t {
+    board_t boards[BOARD_MAX];
+    int nboards;
+    int nbusses;
+};
+
+void board_set_init(board_set_t *set);
+board_t *board_add(board_set_t *set, const char *device);
+int board_open(board_set_t *set, board_t *board, int priority);
+int board_start(board_set_t *set);
+void board_stop(board_set_t *set);
+board_t *board_for_bus(board_set_t *set, int bus);
+int board_send(board_set_t *set, int class, int bus, const uint8_t *data, int bytes, uint64_t origin);
+int board_send_tracked(board_set_t *set, int class, int bus, const uint8_t *data, int bytes, uint64_t origin, uint8_t retries, int timeout_ms);
+int board_wait(board_set_t *set, int timeout_ms);
+
+#endif // __BOARD_H__
@@ -0,0 +1,216 @@
+/*
+ * display.c - Radio display text, transcoded and scrolled within a bus budget
+ *
+ * Each field keeps the last string it was given and what that rendered to,
+ * so the player being polled with the same track again costs nothing. Text
+ * wider than its field scrolls, one character a step, with the steps spaced
+ * out so the field never takes more of bus 1 than its budget.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "display.h"
+
+//Display text goes out 4 characters a frame, the field is the channel
+const seg_scheme_t disp_scheme = {{0xAB}, 1, 4, 0x20};
+
+static const disp_field_t field_defaults[DISP_FIELDS] = {
+    //No wider than DISP_WIDTH_MAX
+    {.field = 0x00, .width = 20, .budget = 40},
+    {.field = 0x01, .width = 18, .budget = 60},
+    {.field = 0x02, .width = 8, .budget = 20},
+    {.field = 0x04, .width = 36, .budget = 120},
+    {.field = 0x05, .width = 36, .budget = 80},
+};
+
+//What U+00C0 to U+00FF look like without their accents
+static const char latin1_fallback[] = "AAAAAAACEEEEIIIIDNOOOOOxOUUUUYTsaaaaaaaceeeeiiiidnooooo/ouuuuyty";
+
+void disp_init(disp_t *disp) {
+    memset(disp, 0, sizeof *disp);
+    memcpy(disp->fields, field_defaults, sizeof field_defaults);
+}
+
+/*
+ * Decodes one UTF-8 character, returns its length or 1 for anything malformed,
+ * which comes out as 0xFFFD
+ */
+static int utf8_decode(const uint8_t *s, uint32_t *cp) {
+    int len, i;
+    
+    if(s[0] < 0x80) {
+        *cp = s[0];
+        return 1;
+    }
+    else if((s[0] & 0xE0) == 0xC0) {
+        *cp = s[0] & 0x1F;
+        len = 2;
+    }
+    else if((s[0] & 0xF0) == 0xE0) {
+        *cp = s[0] & 0x0F;
+        len = 3;
+    }
+    else if((s[0] & 0xF8) == 0xF0) {
+        *cp = s[0] & 0x07;
+        len = 4;
+    }
+    else {
+        *cp = 0xFFFD;
+        return 1;
+    }
+    
+    for(i=1; i<len; i++) {
+        if((s[i] & 0xC0) != 0x80) {
+            *cp = 0xFFFD;
+            return 1;
+        }
+        *cp = (*cp << 6) | (s[i] & 0x3F);
+    }
+    
+    return len;
+}
+
+/*
+ * Renders UTF-8 into the radio's plain ASCII, accents come off and common
+ * typographic punctuation turns into its ASCII look alike. Returns the length
+ */
+int disp_transcode(const char *utf8, char *output, int size) {
+    const uint8_t *s = (const uint8_t *)utf8;
+    int len = 0;
+    
+    while(*s && len < size - 1) {
+        const char *sub;
+        char c[2] = {0, 0};
+        uint32_t cp;
+        
+        s += utf8_decode(s, &cp);
+        
+        if(cp >= 0x20 && cp < 0x7F) c[0] = cp;
+        else if(cp < 0x20 || cp == 0xA0) c[0] = ' ';
+        else if(cp >= 0xC0 && cp <= 0xFF) c[0] = latin1_fallback[cp - 0xC0];
+        else {
+            switch(cp) {
+                case 0x2018:
+                case 0x2019:
+                case 0x201A:
+                case 0x2032:
+                case 0xB4:
+                    c[0] = '\'';
+                    break;
+                case 0x201C:
+                case 0x201D:
+                case 0x201E:
+                    c[0] = '"';
+                    break;
+                case 0x2010:
+                case 0x2013:
+                case 0x2014:
+                case 0x2212:
+                    c[0] = '-';
+                    break;
+                case 0x2026:
+                    break;
+                default:
+                    c[0] = '?';
+                    break;
+            }
+        }
+        
+        sub = cp == 0x2026 ? "..." : c;
+        while(*sub && len < size - 1) output[len++] = *sub++;
+    }
+    
+    output[len] = '\0';
+    return len;
+}
+
+static disp_field_t *find_field(disp_t *disp, uint8_t field) {
+    int i;
+    
+    for(i=0; i<DISP_FIELDS; i++) {
+        if(disp->fields[i].field == field) return &disp->fields[i];
+    }
+    
+    return NULL;
+}
+
+/*
+ * Gives a field new text, only rendered again if it's changed
+ */
+int disp_set(disp_t *disp, uint8_t field, const char *text) {
+    disp_field_t *f = find_field(disp, field);
+    
+    if(f == NULL) return -1;
+    if(strncmp(f->source, text, sizeof f->source - 1) == 0) return 0;
+    
+    snprintf(f->source, sizeof f->source, "%s", text);
+    f->len = disp_transcode(text, f->text, DISP_TEXT_MAX);
+    //Empty still has to clear what's there
+    if(f->len == 0) {
+        f->text[0] = ' ';
+        f->len = 1;
+    }
+    if(f->len > f->width) {
+        memset(&f->text[f->len], ' ', DISP_MARQUEE_GAP);
+        memcpy(&f->text[f->len + DISP_MARQUEE_GAP], f->text, f->width);
+    }
+    f->offset = 0;
+    f->dirty = 1;
+    f->next = 0;
+    
+    return 0;
+}
+
+/*
+ * Nothing goes out while inactive, everything goes out again once active
+ */
+void disp_set_active(disp_t *disp, int active) {
+    int i;
+    
+    if(active && !disp->active) {
+        for(i=0; i<DISP_FIELDS; i++) {
+            disp->fields[i].dirty = 1;
+            disp->fields[i].next = 0;
+        }
+    }
+    disp->active = active;
+}
+
+/*
+ * Sends whatever's due, each field spacing its sends by what they cost it
+ */
+void disp_service(disp_t *disp, seg_t *seg) {
+    uint64_t now = j1850_now_us();
+    int frame_bytes = disp_scheme.header_bytes + 1 + disp_scheme.chunk + 1;
+    int i;
+    
+    if(!disp->active) return;
+    
+    for(i=0; i<DISP_FIELDS; i++) {
+        disp_field_t *f = &disp->fields[i];
+        int scroll = f->len > f->width;
+        int len = scroll ? f->width : f->len;
+        int frames;
+        uint64_t interval;
+        
+        if(f->len == 0 || (int64_t)(now - f->next) < 0) continue;
+        //Nothing new, just keep it on the radio now and then
+        if(!f->dirty && !scroll && now - f->sent < DISP_REFRESH_US) continue;
+        
+        if(seg_send(seg, IO_CLASS_BULK, DISP_BUS, &disp_scheme, f->field, (uint8_t *)&f->text[f->offset], len) < 0) continue;
+        f->dirty = 0;
+        f->sent = now;
+        
+        frames = (len + disp_scheme.chunk - 1) / disp_scheme.chunk;
+        if(frames == 0) frames = 1;
+        interval = (uint64_t)frames * frame_bytes * 1000000 / f->budget;
+        
+        if(scroll) {
+            if(interval < DISP_STEP_MIN_US) interval = DISP_STEP_MIN_US;
+            if(f->offset == 0) interval += DISP_MARQUEE_HOLD_US;
+            f->offset = (f->offset + 1) % (f->len + DISP_MARQUEE_GAP);
+        }
+        f->next = now + interval;
+    }
+}
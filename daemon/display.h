@@ -0,0 +1,58 @@
+/*
+ * display.h - Radio display text, transcoded and scrolled within a bus budget
+ */
+
+#ifndef __DISPLAY_H__
+#define __DISPLAY_H__
+
+#include <stdint.h>
+#include "segment.h"
+
+#define DISP_BUS 1
+#define DISP_FIELDS 5
+#define DISP_SOURCE_MAX 256
+#define DISP_TEXT_MAX 256
+#define DISP_WIDTH_MAX 36
+
+//Spaces between the end of scrolling text and it coming round again
+#define DISP_MARQUEE_GAP 3
+//Scrolling text holds still at the start this long before moving off
+#define DISP_MARQUEE_HOLD_US 2000000
+#define DISP_STEP_MIN_US 300000
+//Unchanged text goes out again this often so the radio keeps showing it
+#define DISP_REFRESH_US 1000000
+
+typedef struct disp_field_t disp_field_t;
+typedef struct disp_t disp_t;
+
+struct disp_field_t {
+    uint8_t field;
+    int width;
+    //What the bus can give this field, in bytes a second
+    int budget;
+    
+    char source[DISP_SOURCE_MAX];
+    //Scrolling text is followed by the gap and its own start again, so
+    //every step's window is already laid out at its offset
+    char text[DISP_TEXT_MAX + DISP_MARQUEE_GAP + DISP_WIDTH_MAX];
+    int len;
+    int offset;
+    int dirty;
+    uint64_t sent;
+    uint64_t next;
+};
+
+struct disp_t {
+    disp_field_t fields[DISP_FIELDS];
+    int active;
+};
+
+extern const seg_scheme_t disp_scheme;
+
+void disp_init(disp_t *disp);
+int disp_set(disp_t *disp, uint8_t field, const char *text);
+void disp_set_active(disp_t *disp, int active);
+void disp_service(disp_t *disp, seg_t *seg);
+int disp_transcode(const char *utf8, char *output, int size);
+
+#endif // __DISPLAY_H__
@@ -0,0 +1,229 @@
+/*
+ * fanout.c - Every bus frame in shared memory for any number of local readers
+ *
+ * Each board's SPI thread writes, claiming the next slot for each frame it
+ * receives or sends and copying it in. Writers never wait on anyone, readers
+ * that fall a whole ring behind find out from the slot sequence numbers and
+ * count what they lost. Readers map the memory read only, so nothing they do
+ * can touch the writers, and read frames in place. Waking sleeping readers is
+ * one futex call per pass of an SPI thread, not per frame.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include "fanout.h"
+
+//Slots start on their own cache line
+#define FANOUT_SLOTS_OFFSET ((sizeof(fanout_header_t) + 63) & ~63)
+
+static size_t fanout_size(uint32_t nslots) {
+    return FANOUT_SLOTS_OFFSET + (size_t)nslots * sizeof(fanout_slot_t);
+}
+
+/*
+ * Creates the shared memory afresh, readers of an old one stay with it
+ */
+int fanout_create(fanout_t *fanout, const char *name, uint32_t nslots) {
+    memset(fanout, 0, sizeof *fanout);
+    fanout->fd = -1;
+    
+    if(nslots == 0 || (nslots & (nslots - 1))) return -1;
+    
+    shm_unlink(name);
+    fanout->fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0644);
+    if(fanout->fd < 0) return -1;
+    
+    fanout->size = fanout_size(nslots);
+    if(ftruncate(fanout->fd, fanout->size) < 0) {
+        fanout_destroy(fanout, name);
+        return -1;
+    }
+    
+    fanout->header = mmap(NULL, fanout->size, PROT_READ | PROT_WRITE, MAP_SHARED, fanout->fd, 0);
+    if(fanout->header == MAP_FAILED) {
+        fanout->header = NULL;
+        fanout_destroy(fanout, name);
+        return -1;
+    }
+    //Touch every page now so publishing never faults
+    memset(fanout->header, 0, fanout->size);
+    fanout->slots = (fanout_slot_t *)((uint8_t *)fanout->header + FANOUT_SLOTS_OFFSET);
+    
+    fanout->header->version = FANOUT_VERSION;
+    fanout->header->frame_size = sizeof(j1850_frame_t);
+    fanout->header->nslots = nslots;
+    __atomic_store_n(&fanout->header->magic, FANOUT_MAGIC, __ATOMIC_RELEASE);
+    
+    return 0;
+}
+
+void fanout_destroy(fanout_t *fanout, const char *name) {
+    if(fanout->header) munmap(fanout->header, fanout->size);
+    fanout->header = NULL;
+    if(fanout->fd >= 0) {
+        close(fanout->fd);
+        shm_unlink(name);
+    }
+    fanout->fd = -1;
+}
+
+/*
+ * Copies frame into the next slot, readers see it once it's whole.
+ * Safe from any number of threads
+ */
+void fanout_publish(fanout_t *fanout, const j1850_frame_t *frame) {
+    uint32_t pos = __atomic_fetch_add(&fanout->header->head, 1, __ATOMIC_ACQ_REL);
+    fanout_slot_t *slot = &fanout->slots[pos & (fanout->header->nslots - 1)];
+    
+    __atomic_store_n(&slot->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(&slot->frame, frame, sizeof *frame);
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Wakes readers if anything was published since anyone last did
+ */
+void fanout_notify(fanout_t *fanout) {
+    uint32_t head = __atomic_load_n(&fanout->header->head, __ATOMIC_ACQUIRE);
+    
+    if(__atomic_exchange_n(&fanout->notified, head, __ATOMIC_ACQ_REL) == head) return;
+    syscall(SYS_futex, &fanout->header->head, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+/*
+ * Whether the slot at the reader's cursor has been written, head counts
+ * claimed slots so it can be a moment ahead of them
+ */
+static int slot_ready(const fanout_reader_t *reader) {
+    const fanout_slot_t *slot = &reader->slots[reader->cursor & reader->mask];
+    uint32_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+    
+    return seq != 0 && (int32_t)(seq - (reader->cursor + 1)) >= 0;
+}
+
+/*
+ * Attaches to the daemon's frames read only, starting from the next one published
+ */
+int fanout_open(fanout_reader_t *reader, const char *name) {
+    struct stat st;
+    
+    memset(reader, 0, sizeof *reader);
+    reader->fd = shm_open(name, O_RDONLY, 0);
+    if(reader->fd < 0) return -1;
+    
+    if(fstat(reader->fd, &st) < 0 || (size_t)st.st_size < FANOUT_SLOTS_OFFSET) {
+        fanout_close(reader);
+        return -1;
+    }
+    reader->size = st.st_size;
+    
+    reader->header = mmap(NULL, reader->size, PROT_READ, MAP_SHARED, reader->fd, 0);
+    if(reader->header == MAP_FAILED) {
+        reader->header = NULL;
+        fanout_close(reader);
+        return -1;
+    }
+    
+    if(__atomic_load_n(&reader->header->magic, __ATOMIC_ACQUIRE) != FANOUT_MAGIC ||
+            reader->header->version != FANOUT_VERSION ||
+            reader->header->frame_size != sizeof(j1850_frame_t) ||
+            fanout_size(reader->header->nslots) > reader->size) {
+        printf("Frame fanout is from a different build, not attaching\n");
+        fanout_close(reader);
+        return -1;
+    }
+    
+    reader->slots = (const fanout_slot_t *)((const uint8_t *)reader->header + FANOUT_SLOTS_OFFSET);
+    reader->mask = reader->header->nslots - 1;
+    reader->cursor = __atomic_load_n(&reader->header->head, __ATOMIC_ACQUIRE);
+    
+    return 0;
+}
+
+void fanout_close(fanout_reader_t *reader) {
+    if(reader->header) munmap((void *)reader->header, reader->size);
+    reader->header = NULL;
+    if(reader->fd >= 0) close(reader->fd);
+    reader->fd = -1;
+}
+
+/*
+ * The next frame in place in shared memory or NULL if there isn't one yet.
+ * Only good until fanout_pop() says it wasn't overwritten while looking at it
+ */
+const j1850_frame_t *fanout_peek(fanout_reader_t *reader) {
+    uint32_t nslots = reader->mask + 1;
+    
+    while(1) {
+        uint32_t head = __atomic_load_n(&reader->header->head, __ATOMIC_ACQUIRE);
+        const fanout_slot_t *slot;
+        
+        if(reader->cursor == head) return NULL;
+        
+        //Lapped, skip to the oldest frame still there
+        if(head - reader->cursor > nslots) {
+            reader->lost += head - reader->cursor - nslots;
+            reader->cursor = head - nslots;
+        }
+        
+        slot = &reader->slots[reader->cursor & reader->mask];
+        reader->seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        if(reader->seq == reader->cursor + 1) return &slot->frame;
+        
+        //Claimed but still being written, or still from the last time round
+        if(reader->seq == 0 || (int32_t)(reader->seq - (reader->cursor + 1)) < 0) return NULL;
+        
+        //Overwritten between reading head and the slot
+        reader->lost ++;
+        reader->cursor ++;
+    }
+}
+
+/*
+ * Moves past the peeked frame, -1 if it changed under the reader and
+ * whatever was made of it should be thrown away
+ */
+int fanout_pop(fanout_reader_t *reader) {
+    const fanout_slot_t *slot = &reader->slots[reader->cursor & reader->mask];
+    uint32_t seq;
+    
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    seq = __atomic_load_n(&slot->seq, __ATOMIC_RELAXED);
+    reader->cursor ++;
+    
+    if(seq != reader->seq) {
+        reader->lost ++;
+        return -1;
+    }
+    
+    return 0;
+}
+
+/*
+ * Sleeps until there's a frame to peek or timeout_ms is up, -1 for no timeout.
+ * Returns whether there is one
+ */
+int fanout_wait(fanout_reader_t *reader, int timeout_ms) {
+    struct timespec timeout = {timeout_ms / 1000, (timeout_ms % 1000) * 1000000L};
+    
+    if(__atomic_load_n(&reader->header->head, __ATOMIC_ACQUIRE) == reader->cursor) {
+        syscall(SYS_futex, &reader->header->head, FUTEX_WAIT, reader->cursor, timeout_ms < 0 ? NULL : &timeout, NULL, 0);
+    }
+    //A writer's partway through the next frame, it's only a copy away
+    else if(!slot_ready(reader)) sched_yield();
+    
+    return __atomic_load_n(&reader->header->head, __ATOMIC_ACQUIRE) != reader->cursor;
+}
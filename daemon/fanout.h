@@ -0,0 +1,77 @@
+/*
+ * fanout.h - Every bus frame in shared memory for any number of local readers
+ */
+
+#ifndef __FANOUT_H__
+#define __FANOUT_H__
+
+#include <stdint.h>
+#include "j1850.h"
+
+//Shows up as /dev/shm/j1850-frames
+#define FANOUT_NAME "/j1850-frames"
+#define FANOUT_SLOTS 4096
+#define FANOUT_MAGIC 0x4A313835
+#define FANOUT_VERSION 1
+
+typedef struct fanout_header_t fanout_header_t;
+typedef struct fanout_slot_t fanout_slot_t;
+typedef struct fanout_t fanout_t;
+typedef struct fanout_reader_t fanout_reader_t;
+
+/*
+ * Start of the shared memory, the slots follow. head counts every slot ever
+ * claimed and is what readers sleep on. Only 32 bit atomics are used, wider
+ * ones aren't lock free across processes on every Pi
+ */
+struct fanout_header_t {
+    uint32_t magic;
+    uint16_t version;
+    //Readers built against a different frame layout refuse to attach
+    uint16_t frame_size;
+    uint32_t nslots;
+    uint32_t head;
+};
+
+/*
+ * seq is the frame's position plus one once it's all there, 0 while it's
+ * being written. A reader checks it before and after looking at the frame
+ * to know the writer didn't lap it in between
+ */
+struct fanout_slot_t {
+    uint32_t seq;
+    j1850_frame_t frame;
+};
+
+struct fanout_t {
+    int fd;
+    fanout_header_t *header;
+    fanout_slot_t *slots;
+    size_t size;
+    uint32_t notified;
+};
+
+struct fanout_reader_t {
+    int fd;
+    const fanout_header_t *header;
+    const fanout_slot_t *slots;
+    size_t size;
+    uint32_t mask;
+    uint32_t cursor;
+    uint32_t seq;
+    //Frames the writer overwrote before this reader got to them
+    unsigned int lost;
+};
+
+int fanout_create(fanout_t *fanout, const char *name, uint32_t nslots);
+void fanout_destroy(fanout_t *fanout, const char *name);
+void fanout_publish(fanout_t *fanout, const j1850_frame_t *frame);
+void fanout_notify(fanout_t *fanout);
+
+int fanout_open(fanout_reader_t *reader, const char *name);
+void fanout_close(fanout_reader_t *reader);
+const j1850_frame_t *fanout_peek(fanout_reader_t *reader);
+int fanout_pop(fanout_reader_t *reader);
+int fanout_wait(fanout_reader_t *reader, int timeout_ms);
+
+#endif // __FANOUT_H__
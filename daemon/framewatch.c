@@ -0,0 +1,75 @@
+/*
+ * framewatch.c - Prints every frame the daemon receives and sends
+ *
+ * Follows the daemon's shared memory frame fanout rather than opening the
+ * SPI device, so any number can run alongside it.
+ *
+ * Usage: framewatch [-b bus] [-h header]
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include <stdint.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <signal.h>
+#include "j1850.h"
+#include "fanout.h"
+
+static volatile sig_atomic_t running = 1;
+
+static void sig_handler(int sig) {
+    running = 0;
+}
+
+int main(int argc, char *argv[]) {
+    fanout_reader_t reader;
+    unsigned int lost = 0;
+    int bus = -1;
+    int header = -1;
+    int opt;
+    
+    while((opt = getopt(argc, argv, "b:h:")) != -1) {
+        switch(opt) {
+        case 'b': bus = strtol(optarg, NULL, 0); break;
+        case 'h': header = strtol(optarg, NULL, 16); break;
+        default:
+            fprintf(stderr, "Usage: %s [-b bus] [-h header]\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    
+    if(fanout_open(&reader, FANOUT_NAME) < 0) {
+        fprintf(stderr, "Couldn't attach to %s, is the daemon running?\n", FANOUT_NAME);
+        exit(EXIT_FAILURE);
+    }
+    
+    signal(SIGINT, sig_handler);
+    signal(SIGTERM, sig_handler);
+    
+    while(running) {
+        const j1850_frame_t *frame;
+        
+        fanout_wait(&reader, 1000);
+        
+        while((frame = fanout_peek(&reader)) != NULL) {
+            char output[256];
+            int skip = (bus >= 0 && frame->bus != bus) || (header >= 0 && frame->data[0] != header);
+            
+            //Formatted straight out of shared memory, only printed if it held still
+            if(!skip) j1850_format_frame(frame, output, sizeof output);
+            if(fanout_pop(&reader) == 0 && !skip) printf("%s%s\n", frame->flags & J1850_FRAME_TX ? "TX " : "RX ", output);
+        }
+        
+        if(reader.lost != lost) {
+            printf("Lost %u frames\n", reader.lost - lost);
+            lost = reader.lost;
+        }
+        fflush(stdout);
+    }
+    
+    fanout_close(&reader);
+    
+    return 0;
+}
@@ -0,0 +1,617 @@
+/*
+ * io.c - SPI/bus servicing thread
+ *
+ * Keeps the micro's buffers drained no matter what the rest of the daemon is
+ * blocked on. Everything crosses over through the rx/tx rings, which are
+ * single producer/single consumer so neither side ever takes a lock.
+ *
+ * The thread also looks after the link itself. Any failed command gets the
+ * micro resynced on the spot, and heartbeats in between catch it going out of
+ * step or being reset while nothing else is going on.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include "io.h"
+#include "latency.h"
+
+#define IO_STACK_PREFAULT (64*1024)
+
+//VPW timing for working out how long a frame holds the bus, bits average
+//out between the short and long pulse
+#define IO_VPW_BIT_US 96
+#define IO_VPW_FRAME_US (200 + 280 + 300)
+
+static const io_class_t class_defaults[IO_CLASSES] = {
+    [IO_CLASS_CONTROL] = {.share = 100, .burst = IO_BUS_BURST_US, .reserve = 0},
+    [IO_CLASS_PERIODIC] = {.share = 10, .burst = 50000, .reserve = 1},
+    [IO_CLASS_BULK] = {.share = 25, .burst = 100000, .reserve = 2},
+};
+
+static void prefault_stack(void) {
+    volatile uint8_t stack[IO_STACK_PREFAULT];
+    
+    memset((uint8_t *)stack, 0, sizeof stack);
+}
+
+/*
+ * Bus time a frame takes in us, SOF, EOF and IFS plus its bytes and CRC
+ */
+static int64_t frame_cost(const j1850_frame_t *frame) {
+    return IO_VPW_FRAME_US + (frame->bytes + 1) * 8 * IO_VPW_BIT_US;
+}
+
+/*
+ * Sent frames go out to readers as the bus will see them, with their CRC
+ */
+static void publish_tx(io_thread_t *io, const j1850_frame_t *frame) {
+    j1850_frame_t sent = *frame;
+    
+    sent.timestamp = j1850_now_us();
+    sent.bus += io->bus_base;
+    sent.age = 0;
+    sent.flags = J1850_FRAME_TX;
+    sent.data[sent.bytes] = j1850_crc(sent.data, sent.bytes);
+    sent.bytes ++;
+    fanout_publish(io->fanout, &sent);
+}
+
+/*
+ * Sends the highest priority frame that fits, over and over until nothing
+ * does. Each class has to have the bus time saved up and leave its reserve of
+ * the micro's transmit slots free. Control frames only need a slot, their bus
+ * time is taken out of the ceiling anyway so everything else backs off
+ */
+static int schedule_tx(io_thread_t *io) {
+    uint64_t now = j1850_now_us();
+    int64_t elapsed = now - io->last_refill;
+    j1850_frame_t *frame;
+    int bus;
+    int i;
+    
+    io->last_refill = now;
+    for(bus=0; bus<J1850_MAX_BUSSES; bus++) {
+        io->bus_tokens[bus] += elapsed * io->ceiling / 100;
+        if(io->bus_tokens[bus] > IO_BUS_BURST_US) io->bus_tokens[bus] = IO_BUS_BURST_US;
+    }
+    for(i=0; i<IO_CLASSES; i++) {
+        io_class_t *class = &io->classes[i];
+        class->tokens += elapsed * class->share / 100;
+        if(class->tokens > class->burst) class->tokens = class->burst;
+    }
+    
+    //Nothing to go by without a snapshot, try again next time round
+    if(io->status.nbusses == 0) return 0;
+    
+    while(1) {
+        io_class_t *class = NULL;
+        int64_t cost = 0;
+        
+        for(i=0; i<IO_CLASSES; i++) {
+            frame = j1850_ring_peek(&io->classes[i].tx);
+            if(frame == NULL) continue;
+            
+            if(frame->bus >= io->status.nbusses) {
+                printf("No bus %i, dropping message\n", frame->bus + io->bus_base);
+                j1850_ring_pop(&io->classes[i].tx);
+                i --;
+                continue;
+            }
+            
+            cost = frame_cost(frame);
+            if(io->status.tx_free[frame->bus] <= io->classes[i].reserve) continue;
+            if(i != IO_CLASS_CONTROL && (io->classes[i].tokens < cost || io->bus_tokens[frame->bus] < cost)) continue;
+            
+            class = &io->classes[i];
+            break;
+        }
+        if(class == NULL) break;
+        
+        int ret = j1850_send_frame(io->dev, &io->status, frame);
+        if(ret < 0) {
+            //Left where it is to go again once the link's back in step, the
+            //rest won't get through before then either
+            printf("Error sending bus %i message: %i\n", frame->bus + io->bus_base, ret);
+            class->failures ++;
+            if(class->failures >= IO_TX_ATTEMPTS) {
+                printf("Dropping bus %i message after %i tries\n", frame->bus + io->bus_base, class->failures);
+                io->tx_dropped ++;
+                class->failures = 0;
+                j1850_ring_pop(&class->tx);
+            }
+            return ret;
+        }
+        else {
+            class->tokens -= cost;
+            io->bus_tokens[frame->bus] -= cost;
+            if(frame->id) io->tx_pending ++;
+            class->failures = 0;
+            if(io->fanout) publish_tx(io, frame);
+            if(frame->flags & J1850_FRAME_TIMED) {
+                uint64_t sent = j1850_now_us() - frame->timestamp;
+                lat_record(LAT_REPLY_SENT, sent);
+                lat_record(LAT_REPLY_TOTAL, sent + frame->age);
+            }
+        }
+        j1850_ring_pop(&class->tx);
+    }
+    
+    return 0;
+}
+
+/*
+ * Trades heartbeats with the board, returns 1 if it's been reset since the
+ * last one. A reset board is set up again, reports on anything sent before
+ * went with it
+ */
+static int heartbeat(io_thread_t *io) {
+    j1850_heartbeat_t beat;
+    uint8_t seq = ++io->heartbeat_seq;
+    int reset = 0;
+    int ret;
+    
+    ret = j1850_heartbeat(io->dev, seq, &beat);
+    if(ret < 0) return ret;
+    if(beat.seq != seq) return -1;
+    
+    io->last_heartbeat = j1850_now_us();
+    io->board_resyncs = beat.resyncs;
+    
+    if(beat.reset_flags) {
+        printf("%s: board was reset%s, setting it up again\n", io->dev->device, (beat.reset_flags & J1850_RESET_WATCHDOG) ? " by its watchdog" : "");
+        io->board_resets ++;
+        io->tx_pending = 0;
+        memset(io->rx_unacked, 0, sizeof io->rx_unacked);
+        io->needs_setup = 1;
+        reset = 1;
+    }
+    //Kept at until it takes, the reset flags are only reported the once
+    if(io->needs_setup) {
+        if(io_setup_board(io) < 0) return -1;
+        io->needs_setup = 0;
+    }
+    
+    return reset;
+}
+
+/*
+ * Resyncs until a heartbeat gets through with the board's resync count moved
+ * on, so a stray byte can't pass for the acknowledgement
+ */
+static int link_resync(io_thread_t *io) {
+    int i;
+    
+    for(i=0; i<IO_RESYNC_ATTEMPTS; i++) {
+        uint8_t last_resyncs = io->board_resyncs;
+        int ret;
+        
+        io->resyncs ++;
+        if(spi_resync(io->dev) < 0) continue;
+        
+        ret = heartbeat(io);
+        if(ret < 0) continue;
+        if(ret == 0 && io->board_resyncs == last_resyncs) continue;
+        
+        return 0;
+    }
+    
+    return -1;
+}
+
+/*
+ * Something on the link failed, or it's down and due another try. Gets it back
+ * in step and keeps track of how long it was out
+ */
+static void link_failed(io_thread_t *io) {
+    uint64_t now = j1850_now_us();
+    uint64_t recovery;
+    
+    if(!io->link_down) io->link_lost = now;
+    //Whatever went with the link, the handoff may have too
+    io->handoff_dirty = 1;
+    
+    if(link_resync(io) < 0) {
+        if(!io->link_down) {
+            printf("%s: SPI link down, no answer after %i resyncs\n", io->dev->device, IO_RESYNC_ATTEMPTS);
+            io->link_downs ++;
+            io->link_down = 1;
+            //The board clears out its own rings once we've gone quiet
+            memset(io->rx_unacked, 0, sizeof io->rx_unacked);
+            //Come back at the slowest speed, the probe finds the way up again
+            io->dev->speed = spi_link_speeds[0];
+        }
+        io->last_retry = j1850_now_us();
+        return;
+    }
+    
+    recovery = j1850_now_us() - io->link_lost;
+    lat_record(LAT_LINK_RECOVERY, recovery);
+    if(recovery > io->recovery_max_us) io->recovery_max_us = recovery;
+    io->recoveries ++;
+    
+    if(io->link_down) printf("%s: SPI link back after %.1f ms\n", io->dev->device, recovery / 1000.0);
+    io->link_down = 0;
+}
+
+static void *io_main(void *arg) {
+    io_thread_t *io = arg;
+    spi_dev_t *dev = io->dev;
+    j1850_frame_t *frame;
+    int ret;
+    int bus;
+    int nmsgs;
+    uint8_t changed = J1850_SNAP_SW | J1850_SNAP_PWR;
+    uint64_t last_1s = j1850_now_us();
+    int tmr_1s = 0;
+    
+    if(io->priority) prefault_stack();
+    
+    while(io->running) {
+        int signal = 0;
+        int link_error = 0;
+        
+        //Nothing else gets through with the link down, just keep trying for it
+        if(io->link_down) {
+            if(j1850_now_us() - io->last_retry >= IO_LINK_RETRY_US) link_failed(io);
+            if(io->link_down) {
+                nanosleep((const struct timespec[]){{0, IO_POLL_NS}}, NULL);
+                continue;
+            }
+        }
+        
+        //Get switch and power state, queue depths and what changed
+        ret = j1850_get_status(dev, &io->status);
+        if(ret < 0) {
+            printf("Error getting status snapshot: %i\n", ret);
+            memset(&io->status, 0, sizeof io->status);
+            link_error = 1;
+        }
+        else changed |= io->status.changed;
+        
+        //Pass on switch and power changes, holding them until there's room
+        if(ret == 0 && (changed & (J1850_SNAP_SW | J1850_SNAP_PWR))) {
+            frame = j1850_ring_claim(&io->rx);
+            if(frame) {
+                frame->timestamp = j1850_now_us();
+                frame->bus = io->bus_base;
+                frame->bytes = 3;
+                frame->flags = J1850_FRAME_STATUS;
+                frame->data[0] = io->status.sw_state;
+                frame->data[1] = io->status.pwr_state;
+                frame->data[2] = changed;
+                j1850_ring_push(&io->rx);
+                changed = 0;
+                signal = 1;
+            }
+        }
+        
+        //The board takes everything back if we go quiet for too long, take it over again.
+        //Checked every pass until the board's seen to hold it, a one off snapshot flag
+        //or takeover can go missing along with the link
+        if(ret == 0 && (io->status.changed & J1850_SNAP_HANDOFF)) io->handoff_dirty = 1;
+        if(ret == 0 && io->handoff_dirty && io->handoff) {
+            int handoff = j1850_get_handoff(dev);
+            if(handoff < 0) {
+                printf("Error getting handoff state: %i\n", handoff);
+                link_error = 1;
+            }
+            else if((handoff & io->handoff) == io->handoff) io->handoff_dirty = 0;
+            else {
+                printf("Board took back %.2X, reclaiming\n", io->handoff & ~handoff);
+                ret = j1850_set_handoff(dev, io->handoff);
+                if(ret < 0) {
+                    printf("Error reclaiming from board: %i\n", ret);
+                    link_error = 1;
+                }
+                ret = 0;
+            }
+        }
+        
+        //Switch events go out in the order they happened, each as its own frame
+        if(ret == 0 && (io->status.changed & J1850_SNAP_SW_EVT)) {
+            j1850_sw_event_t events[J1850_SW_EVT_MAX];
+            int nevents = j1850_get_sw_events(dev, events, J1850_SW_EVT_MAX);
+            int i;
+            
+            if(nevents < 0) {
+                printf("Error retrieving switch events: %i\n", nevents);
+                link_error = 1;
+            }
+            for(i=0; i<nevents; i++) {
+                frame = j1850_ring_claim(&io->rx);
+                if(frame == NULL) {
+                    io->rx_overflows ++;
+                    break;
+                }
+                
+                frame->timestamp = j1850_now_us();
+                frame->age = events[i].age;
+                frame->bus = io->bus_base;
+                frame->bytes = 2;
+                frame->flags = J1850_FRAME_SWITCH | J1850_FRAME_TIMED;
+                frame->data[0] = events[i].sw;
+                frame->data[1] = events[i].type;
+                j1850_ring_push(&io->rx);
+                signal = 1;
+            }
+        }
+        
+        //Get J1850 messages straight into the ring, only as many as are waiting.
+        //When the ring is full they wait on the micro until the daemon catches up
+        for(bus=0; bus<io->status.nbusses && !link_error; bus++) {
+            for(nmsgs = io->status.rx_depth[bus]; nmsgs > 0; nmsgs--) {
+                frame = j1850_ring_claim(&io->rx);
+                if(frame == NULL) {
+                    io->rx_overflows ++;
+                    break;
+                }
+                
+                uint8_t pos;
+                
+                ret = j1850_get_frame(dev, bus, frame, &pos);
+                if(ret < 0) {
+                    printf("Error retrieving bus %i messages: %i\n", bus + io->bus_base, ret);
+                    link_error = 1;
+                }
+                if(ret <= 0) break;
+                
+                //Handed over already, only the ack needs doing again
+                if(io->rx_unacked[bus] != pos + 1) {
+                    lat_record(LAT_FETCH, frame->age);
+                    frame->bus += io->bus_base;
+                    if(io->fanout) fanout_publish(io->fanout, frame);
+                    
+                    j1850_ring_push(&io->rx);
+                    signal = 1;
+                }
+                
+                //The frame's ours either way, if the ack doesn't get through
+                //the micro sends it again and it's picked out above
+                ret = j1850_ack_frame(dev, bus, pos);
+                if(ret < 0) {
+                    printf("Error acknowledging bus %i message: %i\n", bus + io->bus_base, ret);
+                    io->rx_unacked[bus] = pos + 1;
+                    link_error = 1;
+                    break;
+                }
+                io->rx_unacked[bus] = 0;
+            }
+        }
+        
+        //Hand back how frames sent with an id went
+        if(io->tx_pending) {
+            j1850_tx_report_t reports[J1850_TX_REPORT_MAX];
+            int nreports = j1850_get_tx_reports(dev, reports, J1850_TX_REPORT_MAX);
+            int i;
+            
+            if(nreports < 0) {
+                printf("Error retrieving transmit reports: %i\n", nreports);
+                link_error = 1;
+            }
+            else if(nreports == 0) {
+                //The micro drops reports when it's full, with its queues empty
+                //there's nothing left to wait for
+                for(bus=0; bus<io->status.nbusses; bus++) {
+                    if(io->status.tx_free[bus] != io->tx_free_max[bus]) break;
+                }
+                if(io->status.nbusses && bus == io->status.nbusses) io->tx_pending = 0;
+            }
+            else if((unsigned int)nreports > io->tx_pending) io->tx_pending = 0;
+            else io->tx_pending -= nreports;
+            
+            for(i=0; i<nreports; i++) {
+                frame = j1850_ring_claim(&io->rx);
+                if(frame == NULL) {
+                    io->rx_overflows ++;
+                    break;
+                }
+                
+                frame->timestamp = j1850_now_us();
+                frame->age = reports[i].age;
+                frame->bus = reports[i].bus + io->bus_base;
+                frame->id = reports[i].id;
+                frame->bytes = 2;
+                frame->flags = J1850_FRAME_TX_REPORT | J1850_FRAME_TIMED;
+                frame->data[0] = reports[i].status;
+                frame->data[1] = reports[i].losses;
+                j1850_ring_push(&io->rx);
+                signal = 1;
+            }
+        }
+        
+        for(bus=0; bus<io->status.nbusses; bus++) {
+            if(io->status.tx_free[bus] > io->tx_free_max[bus]) io->tx_free_max[bus] = io->status.tx_free[bus];
+        }
+        
+        if(!link_error && schedule_tx(io) < 0) link_error = 1;
+        
+        if(signal) {
+            uint64_t one = 1;
+            if(write(io->rx_event, &one, sizeof one) < 0) printf("Error signalling daemon\n");
+        }
+        if(io->fanout) fanout_notify(io->fanout);
+        
+        //Anything failing on the way round gets the link back in step straight
+        //away, otherwise a heartbeat now and then makes sure it still is
+        if(!link_error && j1850_now_us() - io->last_heartbeat >= IO_HEARTBEAT_US) link_error = heartbeat(io) < 0;
+        if(link_error) link_failed(io);
+        
+        //Fall back on errors, probe again now and then to find our way back up
+        if(j1850_now_us() - last_1s >= 1000000) {
+            last_1s += 1000000;
+            tmr_1s ++;
+            
+            spi_check_link(dev);
+            if(tmr_1s % IO_LINK_PROBE_INTERVAL == 0) spi_tune_link(dev);
+        }
+        
+        nanosleep((const struct timespec[]){{0, IO_POLL_NS}}, NULL);
+    }
+    
+    return NULL;
+}
+
+int io_init(io_thread_t *io, spi_dev_t *dev, int priority) {
+    int i;
+    
+    memset(io, 0, sizeof *io);
+    io->dev = dev;
+    io->priority = priority;
+    
+    if(j1850_ring_init(&io->rx, IO_RING_SIZE) < 0) return -1;
+    memcpy(io->classes, class_defaults, sizeof class_defaults);
+    for(i=0; i<IO_CLASSES; i++) {
+        if(j1850_ring_init(&io->classes[i].tx, IO_RING_SIZE) < 0) return -1;
+    }
+    io->ceiling = IO_BUS_CEILING;
+    
+    io->rx_event = eventfd(0, EFD_NONBLOCK);
+    if(io->rx_event < 0) return -1;
+    
+    //Keep the SPI path from ever waiting on a page fault
+    if(priority && mlockall(MCL_CURRENT | MCL_FUTURE) < 0) printf("Couldn't lock memory, continuing without\n");
+    
+    return 0;
+}
+
+int io_start(io_thread_t *io) {
+    int ret;
+    pthread_attr_t attr;
+    struct sched_param param;
+    
+    io->running = 1;
+    io->last_refill = j1850_now_us();
+    pthread_attr_init(&attr);
+    
+    if(io->priority) {
+        param.sched_priority = io->priority;
+        pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+        pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+        pthread_attr_setschedparam(&attr, &param);
+    }
+    
+    ret = pthread_create(&io->thread, &attr, io_main, io);
+    if(ret && io->priority) {
+        printf("Couldn't start SPI thread at SCHED_FIFO %i, continuing without\n", io->priority);
+        pthread_attr_destroy(&attr);
+        pthread_attr_init(&attr);
+        ret = pthread_create(&io->thread, &attr, io_main, io);
+    }
+    pthread_attr_destroy(&attr);
+    
+    if(ret) {
+        io->running = 0;
+        return -1;
+    }
+    
+    return 0;
+}
+
+void io_stop(io_thread_t *io) {
+    if(!io->running) return;
+    
+    io->running = 0;
+    pthread_join(io->thread, NULL);
+}
+
+/*
+ * Loads the board with the listen headers, switch thresholds and handoff it
+ * was set up with. Done before starting and again by the thread if it resets
+ */
+int io_setup_board(io_thread_t *io) {
+    int ret;
+    int sw;
+    
+    ret = j1850_set_listen_headers(io->dev, io->listen_headers, io->nlisten_headers);
+    if(ret < 0) return ret;
+    
+    for(sw=0; sw<2; sw++) {
+        if(!io->sw_thresh_set[sw]) continue;
+        ret = j1850_set_sw_thresh(io->dev, sw, io->sw_thresh[sw]);
+        if(ret < 0) return ret;
+    }
+    
+    if(io->handoff) {
+        io->handoff_dirty = 1;
+        return j1850_set_handoff(io->dev, io->handoff);
+    }
+    
+    return 0;
+}
+
+void io_free(io_thread_t *io) {
+    j1850_ring_free(&io->rx);
+    int i;
+    
+    for(i=0; i<IO_CLASSES; i++) j1850_ring_free(&io->classes[i].tx);
+    if(io->rx_event >= 0) close(io->rx_event);
+    io->rx_event = -1;
+}
+
+static int queue_send(io_thread_t *io, int class, int bus, const uint8_t *data, int bytes, uint64_t origin, uint8_t id, uint8_t retries, uint8_t timeout) {
+    j1850_frame_t *frame;
+    
+    if(bytes > J1850_MSG_SIZE - 1 || class < 0 || class >= IO_CLASSES) return -1;
+    if(bus < io->bus_base || bus - io->bus_base >= J1850_MAX_BUSSES) return -1;
+    
+    frame = j1850_ring_claim(&io->classes[class].tx);
+    if(frame == NULL) {
+        printf("Bus %i send queue full, dropping message\n", bus);
+        return -1;
+    }
+    
+    frame->timestamp = j1850_now_us();
+    frame->age = 0;
+    frame->bus = bus - io->bus_base;
+    frame->bytes = bytes;
+    frame->flags = J1850_FRAME_TX;
+    frame->id = id;
+    frame->retries = retries;
+    frame->timeout = timeout;
+    if(origin) {
+        frame->age = frame->timestamp - origin;
+        frame->flags |= J1850_FRAME_TIMED;
+    }
+    memcpy(frame->data, data, bytes);
+    j1850_ring_push(&io->classes[class].tx);
+    
+    return 0;
+}
+
+/*
+ * Queues a message for the thread to send in one of the IO_CLASS_ traffic
+ * classes, bytes doesn't include the CRC. origin is when the bus event being
+ * answered happened, 0 if there isn't one
+ */
+int io_send(io_thread_t *io, int class, int bus, const uint8_t *data, int bytes, uint64_t origin) {
+    return queue_send(io, class, bus, data, bytes, origin, 0, 0, 0);
+}
+
+/*
+ * Like io_send, but the micro gives up after retries lost arbitrations or
+ * timeout_ms without getting onto the bus, 0 for never. Returns the id the
+ * J1850_FRAME_TX_REPORT frame for it will carry
+ */
+int io_send_tracked(io_thread_t *io, int class, int bus, const uint8_t *data, int bytes, uint64_t origin, uint8_t retries, int timeout_ms) {
+    int timeout = (timeout_ms + J1850_TX_TIMEOUT_MS - 1) / J1850_TX_TIMEOUT_MS;
+    int ret;
+    
+    if(timeout > 0xFF) timeout = 0xFF;
+    
+    io->tx_id ++;
+    if(io->tx_id == 0) io->tx_id = 1;
+    
+    ret = queue_send(io, class, bus, data, bytes, origin, io->tx_id, retries, timeout);
+    if(ret < 0) return ret;
+    
+    return io->tx_id;
+}
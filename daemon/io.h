@@ -0,0 +1,133 @@
+/*
+ * io.h - SPI/bus servicing thread
+ */
+
+#ifndef __IO_H__
+#define __IO_H__
+
+#include <pthread.h>
+#include "spi.h"
+#include "j1850.h"
+#include "fanout.h"
+
+#define IO_RING_SIZE 64
+#define IO_POLL_NS 2000000L
+#define IO_LINK_PROBE_INTERVAL 60
+
+//Heartbeats go out this often when nothing's gone wrong in between. Anything
+//failing gets this many resyncs straight away before the link counts as down,
+//then it's tried again every IO_LINK_RETRY_US
+#define IO_HEARTBEAT_US 100000
+#define IO_RESYNC_ATTEMPTS 3
+#define IO_LINK_RETRY_US 100000
+//Tries a frame gets at being handed to the micro before it's dropped
+#define IO_TX_ATTEMPTS 3
+
+//Most of each bus's time the budgets let the daemon take, in percent, and
+//how much of it can be saved up in us
+#define IO_BUS_CEILING 50
+#define IO_BUS_BURST_US 100000
+
+//Transmit traffic classes, highest priority first
+enum {
+    IO_CLASS_CONTROL,   //Replies and button presses, never held back by a budget
+    IO_CLASS_PERIODIC,  //Keep alives and polling
+    IO_CLASS_BULK,      //Display text
+    IO_CLASSES
+};
+
+typedef struct io_class_t io_class_t;
+typedef struct io_thread_t io_thread_t;
+
+struct io_class_t {
+    j1850_ring_t tx;
+    //Share of bus time in percent and how much can be saved up in us
+    int share;
+    int64_t burst;
+    //Micro transmit slots to leave for the classes above
+    int reserve;
+    
+    //Only touched by the thread once started
+    int64_t tokens;
+    //Failed tries at handing the frame at the head to the micro
+    int failures;
+};
+
+struct io_thread_t {
+    spi_dev_t *dev;
+    pthread_t thread;
+    int priority;
+    volatile int running;
+    
+    //Bus messages and status changes out, messages to send in by class
+    j1850_ring_t rx;
+    io_class_t classes[IO_CLASSES];
+    int rx_event;
+    
+    //Only touched by the thread once started
+    j1850_status_t status;
+    unsigned int rx_overflows;
+    //Frames sent with an id still to be reported on, and the most free
+    //transmit slots seen per bus, which is all of them empty
+    unsigned int tx_pending;
+    uint8_t tx_free_max[J1850_MAX_BUSSES];
+    //Ring position + 1 of a frame per bus already handed over whose ack
+    //may not have got through, so it isn't handed over again
+    int rx_unacked[J1850_MAX_BUSSES];
+    int64_t bus_tokens[J1850_MAX_BUSSES];
+    uint64_t last_refill;
+    
+    //Bus utilization ceiling in percent, set before starting
+    int ceiling;
+    
+    //Only touched by the daemon
+    uint8_t tx_id;
+    
+    //Jobs to keep from the board, set before starting
+    uint8_t handoff;
+    
+    //Board set up, kept so it can all be put back if the board resets.
+    //Set before io_setup_board() and starting
+    uint8_t listen_headers[J1850_LISTEN_MAX];
+    int nlisten_headers;
+    uint8_t sw_thresh[2][J1850_SW_THRESH_COUNT];
+    int sw_thresh_set[2];
+    
+    //Link supervision, only touched by the thread once started
+    uint8_t heartbeat_seq;
+    uint8_t board_resyncs;
+    uint64_t last_heartbeat;
+    int needs_setup;
+    //Handoff not yet seen to have taken, checked until it has
+    int handoff_dirty;
+    int link_down;
+    uint64_t link_lost;
+    uint64_t last_retry;
+    
+    //Link stats, read once stopped
+    unsigned int resyncs;
+    unsigned int recoveries;
+    unsigned int link_downs;
+    unsigned int board_resets;
+    uint64_t recovery_max_us;
+    unsigned int tx_dropped;
+    
+    //Daemon wide number of the board's first bus, set before starting. Frames
+    //coming out and bus numbers going in are all daemon wide, the board only
+    //ever sees its own
+    int bus_base;
+    
+    //Where every frame received or sent is published for local readers,
+    //set before starting or NULL for nowhere
+    fanout_t *fanout;
+};
+
+int io_init(io_thread_t *io, spi_dev_t *dev, int priority);
+int io_start(io_thread_t *io);
+void io_stop(io_thread_t *io);
+void io_free(io_thread_t *io);
+int io_setup_board(io_thread_t *io);
+int io_send(io_thread_t *io, int class, int bus, const uint8_t *data, int bytes, uint64_t origin);
+int io_send_tracked(io_thread_t *io, int class, int bus, const uint8_t *data, int bytes, uint64_t origin, uint8_t retries, int timeout_ms);
+
+#endif // __IO_H__
@@ -0,0 +1,427 @@
+/*
+ * j1850.c - libj1850 frames, ring buffers and interface board commands
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include "j1850.h"
+
+uint64_t j1850_now_us(void) {
+    struct timespec now;
+    
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec*1000000 + now.tv_nsec/1000;
+}
+
+/*
+ * Calculates an appropriate CRC for a given message
+ */
+uint8_t j1850_crc(const uint8_t *msg_buf, int nbytes) {
+    uint8_t crc_reg = 0xFF;
+    int i, bit;
+    
+    for(i=0; i<nbytes; i++) {
+        crc_reg ^= msg_buf[i];
+        for(bit=0; bit<8; bit++) {
+            if(crc_reg & 0x80) crc_reg = (crc_reg << 1) ^ 0x1D;
+            else crc_reg <<= 1;
+        }
+    }
+    
+    return ~crc_reg;
+}
+
+void j1850_decode_header(const j1850_frame_t *frame, j1850_header_t *header) {
+    uint8_t hdr = frame->data[0];
+    
+    header->priority = (hdr & 0b11100000) >> 5;
+    header->bytes = 3;
+    if(hdr & 0b00010000) header->bytes = 1;
+    header->ifr = (hdr & 0b00001000) == 0;
+    header->functional = ((hdr & 0b00000100) >> 2) ^ 0x01;
+    header->bytes -= header->functional;
+    header->type = hdr & 0b00000011;
+    
+    header->target = -1;
+    header->source = -1;
+    if(header->bytes >= 2 && frame->bytes > 1) header->target = frame->data[1];
+    if(header->bytes == 3 && frame->bytes > 2) header->source = frame->data[2];
+}
+
+void j1850_format_frame(const j1850_frame_t *frame, char *output, int size) {
+    j1850_header_t header;
+    j1850_decode_header(frame, &header);
+    
+    char target[] = "--";
+    char source[] = "--";
+    if(header.target >= 0) snprintf(target, sizeof(target), "%.2X", header.target);
+    if(header.source >= 0) snprintf(source, sizeof(source), "%.2X", header.source);
+    
+    int len = snprintf(output, size, "BUS: %1i - HDR: %.2X (P%2i HL%1i IFR: %s ADR: %s TP%1i T%s S%s) MSG: ",
+                       frame->bus, frame->data[0], header.priority, header.bytes, header.ifr ? "Y" : "N",
+                       header.functional ? "F" : "P", header.type, target, source);
+    
+    int mbytes = frame->bytes - header.bytes - 1;
+    int i;
+    for(i=0; i<J1850_MSG_SIZE && len < size; i++) {
+        if(i < mbytes) len += snprintf(output + len, size - len, "%.2X ", frame->data[i+header.bytes]);
+        else len += snprintf(output + len, size - len, "   ");
+    }
+    if(len < size) len += snprintf(output + len, size - len, "[");
+    for(i=0; i<J1850_MSG_SIZE && len < size; i++) {
+        char c = ' ';
+        if(i < mbytes) c = isprint(frame->data[i+header.bytes]) ? frame->data[i+header.bytes] : '.';
+        len += snprintf(output + len, size - len, "%c", c);
+    }
+    if(len < size && frame->bytes) snprintf(output + len, size - len, "] CRC: %.2X%s", frame->data[frame->bytes-1], (frame->flags & J1850_FRAME_CRC_ERR) ? " BAD" : "");
+}
+
+int j1850_ring_init(j1850_ring_t *ring, unsigned int size) {
+    //Needs to be a power of two
+    if(size == 0 || (size & (size - 1))) return -1;
+    
+    ring->frames = calloc(size, sizeof(j1850_frame_t));
+    if(ring->frames == NULL) return -1;
+    
+    ring->mask = size - 1;
+    ring->head = 0;
+    ring->tail = 0;
+    
+    return 0;
+}
+
+void j1850_ring_free(j1850_ring_t *ring) {
+    free(ring->frames);
+    ring->frames = NULL;
+}
+
+unsigned int j1850_ring_count(const j1850_ring_t *ring) {
+    return __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Returns the next free slot to fill in place, or NULL when full,
+ * the frame isn't visible until j1850_ring_push()
+ */
+j1850_frame_t *j1850_ring_claim(j1850_ring_t *ring) {
+    //Only the producer writes head, tail needs to be seen after the consumer is done with the slot
+    if(ring->head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) > ring->mask) return NULL;
+    return &ring->frames[ring->head & ring->mask];
+}
+
+void j1850_ring_push(j1850_ring_t *ring) {
+    __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Returns the oldest frame without removing it, or NULL when empty
+ */
+j1850_frame_t *j1850_ring_peek(j1850_ring_t *ring) {
+    //Only the consumer writes tail, head needs to be seen after the producer filled the slot
+    if(__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == ring->tail) return NULL;
+    return &ring->frames[ring->tail & ring->mask];
+}
+
+void j1850_ring_pop(j1850_ring_t *ring) {
+    __atomic_store_n(&ring->tail, ring->tail + 1, __ATOMIC_RELEASE);
+}
+
+int j1850_get_status(spi_dev_t *dev, j1850_status_t *status) {
+    int ret;
+    int i;
+    uint8_t rx_buf[4 + 2*J1850_MAX_BUSSES];
+    uint8_t tx_buf = 0x09;
+    
+    ret = spi_flush(dev);
+    if(ret < 0) return ret;
+    
+    ret = spi_send_data(dev, &tx_buf, 1);
+    if(ret < 0) return ret;
+    ret = spi_get_response(dev, rx_buf, sizeof rx_buf);
+    if(ret < 0) return ret;
+    
+    //Switch, power, changed flags, bus count, then depths and free slots per bus
+    if(ret < 4 || rx_buf[3] > J1850_MAX_BUSSES || ret != 4 + 2*rx_buf[3]) {
+        printf("Bad status snapshot length %i\n", ret);
+        return -1;
+    }
+    
+    status->sw_state = rx_buf[0];
+    status->pwr_state = rx_buf[1];
+    status->changed = rx_buf[2];
+    status->nbusses = rx_buf[3];
+    for(i=0; i<status->nbusses; i++) {
+        status->rx_depth[i] = rx_buf[4+i];
+        status->tx_free[i] = rx_buf[4+status->nbusses+i];
+    }
+    
+    return 0;
+}
+
+/*
+ * Pops every queued switch event, returns how many there were.
+ * age is how long ago in us each one happened
+ */
+int j1850_get_sw_events(spi_dev_t *dev, j1850_sw_event_t *events, int max) {
+    int ret;
+    int i;
+    uint8_t rx_buf[1 + 4*J1850_SW_EVT_MAX];
+    uint8_t tx_buf = 0x0A;
+    
+    ret = spi_flush(dev);
+    if(ret < 0) return ret;
+    
+    ret = spi_send_data(dev, &tx_buf, 1);
+    if(ret < 0) return ret;
+    ret = spi_get_response(dev, rx_buf, sizeof rx_buf);
+    if(ret < 0) return ret;
+    
+    //Count, then switch, type and age for each
+    if(ret < 1 || rx_buf[0] > J1850_SW_EVT_MAX || ret != 1 + 4*rx_buf[0]) {
+        printf("Bad switch event length %i\n", ret);
+        return -1;
+    }
+    
+    for(i=0; i<rx_buf[0] && i<max; i++) {
+        events[i].sw = rx_buf[1 + 4*i];
+        events[i].type = rx_buf[2 + 4*i];
+        events[i].age = ((rx_buf[3 + 4*i] << 8) | rx_buf[4 + 4*i]) * J1850_STAMP_US;
+    }
+    
+    return i;
+}
+
+/*
+ * Reads the next received message on a bus into frame without taking it off
+ * the micro, returns the number of bytes including the CRC or 0 when there
+ * was nothing waiting. pos is where it sits in the micro's ring, for
+ * j1850_ack_frame(). Until it's acked asking again gets the same frame.
+ * The timestamp is when it was read, age is how long it sat on the micro
+ */
+int j1850_get_frame(spi_dev_t *dev, int bus, j1850_frame_t *frame, uint8_t *pos) {
+    int ret;
+    uint8_t rx_buf[J1850_MSG_SIZE + 4];
+    uint8_t tx_buf[] = {0x16, bus};
+    
+    ret = spi_flush(dev);
+    if(ret < 0) return ret;
+    
+    ret = spi_send_data(dev, tx_buf, sizeof tx_buf);
+    if(ret < 0) return ret;
+    
+    //Wait for and get the micro's response
+    ret = spi_get_response(dev, rx_buf, sizeof rx_buf);
+    if(ret < 0) return ret;
+    
+    if(rx_buf[0] == 0x00) return 0;
+    if(ret < 4) return -1;
+    ret -= 4;
+    
+    //Copy to output, discarding status, position and age bytes
+    *pos = rx_buf[1];
+    frame->timestamp = j1850_now_us();
+    frame->age = ((rx_buf[2] << 8) | rx_buf[3]) * J1850_STAMP_US;
+    frame->bus = bus;
+    frame->bytes = ret;
+    frame->flags = J1850_FRAME_RX | J1850_FRAME_TIMED;
+    frame->id = 0;
+    memcpy(frame->data, &rx_buf[4], ret);
+    if(ret == 0 || j1850_crc(frame->data, ret - 1) != frame->data[ret - 1]) frame->flags |= J1850_FRAME_CRC_ERR;
+    
+    return ret;
+}
+
+/*
+ * Lets the micro drop the frame j1850_get_frame() read from pos. It's only
+ * dropped if it's still there, so repeating an ack that might not have
+ * made it is safe
+ */
+int j1850_ack_frame(spi_dev_t *dev, int bus, uint8_t pos) {
+    uint8_t data[] = {0x17, bus, pos};
+    
+    return spi_send_data(dev, data, sizeof data);
+}
+
+/*
+ * Queues frame on its bus, bytes doesn't include the CRC, the micro adds it.
+ * Backs off until the micro has a free slot, giving up after 100ms.
+ * Frames with an id get a transmit report once they're done with
+ */
+int j1850_send_frame(spi_dev_t *dev, j1850_status_t *status, const j1850_frame_t *frame) {
+    int ret;
+    uint8_t tx_buf[J1850_MSG_SIZE + 6];
+    uint8_t *data = tx_buf;
+    uint64_t start;
+    
+    if(frame->bytes > J1850_MSG_SIZE - 1 || frame->bus >= J1850_MAX_BUSSES) return -1;
+    
+    start = j1850_now_us();
+    while(status->tx_free[frame->bus] == 0) {
+        ret = j1850_get_status(dev, status);
+        if(ret < 0) return ret;
+        if(status->tx_free[frame->bus] > 0) break;
+        
+        if(j1850_now_us() - start > 100000) {
+            printf("Bus %i TX queue full, dropping message\n", frame->bus);
+            return -1;
+        }
+        nanosleep((const struct timespec[]){{0, 1000000L}}, NULL);
+    }
+    
+    if(frame->id) {
+        *data++ = 0x13;
+        *data++ = frame->bus;
+        *data++ = frame->id;
+        *data++ = frame->retries;
+        *data++ = frame->timeout;
+    }
+    else if(frame->bus == 0) *data++ = 0x07;
+    else if(frame->bus == 1) *data++ = 0x08;
+    else {
+        *data++ = 0x12;
+        *data++ = frame->bus;
+    }
+    *data++ = frame->bytes;
+    memcpy(data, frame->data, frame->bytes);
+    data += frame->bytes;
+    
+    ret = spi_send_data(dev, tx_buf, data - tx_buf);
+    if(ret < 0) return ret;
+    status->tx_free[frame->bus] --;
+    
+    return 0;
+}
+
+/*
+ * Pops up to J1850_TX_REPORT_MAX transmit reports, returns how many there
+ * were. age is how long ago in us each frame was done with
+ */
+int j1850_get_tx_reports(spi_dev_t *dev, j1850_tx_report_t *reports, int max) {
+    int ret;
+    int i;
+    uint8_t rx_buf[1 + 6*J1850_TX_REPORT_MAX];
+    uint8_t tx_buf = 0x14;
+    
+    ret = spi_flush(dev);
+    if(ret < 0) return ret;
+    
+    ret = spi_send_data(dev, &tx_buf, 1);
+    if(ret < 0) return ret;
+    ret = spi_get_response(dev, rx_buf, sizeof rx_buf);
+    if(ret < 0) return ret;
+    
+    //Count, then bus, id, status, losses and age for each
+    if(ret < 1 || rx_buf[0] > J1850_TX_REPORT_MAX || ret != 1 + 6*rx_buf[0]) {
+        printf("Bad transmit report length %i\n", ret);
+        return -1;
+    }
+    
+    for(i=0; i<rx_buf[0] && i<max; i++) {
+        uint8_t *report = &rx_buf[1 + 6*i];
+        reports[i].bus = report[0];
+        reports[i].id = report[1];
+        reports[i].status = report[2];
+        reports[i].losses = report[3];
+        reports[i].age = ((report[4] << 8) | report[5]) * J1850_STAMP_US;
+    }
+    
+    return i;
+}
+
+int j1850_set_listen_headers(spi_dev_t *dev, const uint8_t *headers, int nheaders) {
+    int ret;
+    uint8_t data[2];
+    int i;
+    
+    data[0] = 0x05;
+    ret = spi_send_data(dev, data, 1);
+    if(ret < 0) return ret;
+    
+    for(i=0; i<nheaders; i++) {
+        data[0] = 0x06;
+        data[1] = headers[i];
+        ret = spi_send_data(dev, data, 2);
+        if(ret < 0) return ret;
+    }
+    
+    return 0;
+}
+
+/*
+ * Loads a switch channel's resistor ladder, the micro ignores it
+ * unless the thresholds go strictly up
+ */
+int j1850_set_sw_thresh(spi_dev_t *dev, int sw, const uint8_t *thresh) {
+    uint8_t data[2 + J1850_SW_THRESH_COUNT];
+    int i;
+    
+    for(i=1; i<J1850_SW_THRESH_COUNT; i++) {
+        if(thresh[i] <= thresh[i-1]) return -1;
+    }
+    
+    data[0] = 0x0B;
+    data[1] = sw;
+    memcpy(&data[2], thresh, J1850_SW_THRESH_COUNT);
+    
+    return spi_send_data(dev, data, sizeof data);
+}
+
+/*
+ * Returns the jobs the board has handed over along with its satellite state
+ */
+int j1850_get_handoff(spi_dev_t *dev) {
+    int ret;
+    uint8_t rx_buf;
+    uint8_t tx_buf = 0x0C;
+    
+    ret = spi_flush(dev);
+    if(ret < 0) return ret;
+    
+    ret = spi_send_data(dev, &tx_buf, 1);
+    if(ret < 0) return ret;
+    ret = spi_get_response(dev, &rx_buf, 1);
+    if(ret < 0) return ret;
+    if(ret != 1) return -1;
+    
+    return rx_buf;
+}
+
+/*
+ * Takes over the jobs in flags, handing back anything left out
+ */
+int j1850_set_handoff(spi_dev_t *dev, uint8_t flags) {
+    uint8_t data[] = {0x0D, flags & J1850_HANDOFF_SAT};
+    
+    return spi_send_data(dev, data, sizeof data);
+}
+
+/*
+ * Trades heartbeats with the board, it echoes seq back along with whether it's
+ * been reset and its resync count
+ */
+int j1850_heartbeat(spi_dev_t *dev, uint8_t seq, j1850_heartbeat_t *heartbeat) {
+    int ret;
+    uint8_t rx_buf[3];
+    uint8_t tx_buf[] = {0x15, seq};
+    
+    ret = spi_flush(dev);
+    if(ret < 0) return ret;
+    
+    ret = spi_send_data(dev, tx_buf, sizeof tx_buf);
+    if(ret < 0) return ret;
+    ret = spi_get_response(dev, rx_buf, sizeof rx_buf);
+    if(ret < 0) return ret;
+    if(ret != sizeof rx_buf) return -1;
+    
+    heartbeat->seq = rx_buf[0];
+    heartbeat->reset_flags = rx_buf[1];
+    heartbeat->resyncs = rx_buf[2];
+    
+    return 0;
+}
@@ -0,0 +1,173 @@
+/*
+ * j1850.h - libj1850 frames, ring buffers and interface board commands
+ */
+
+#ifndef __J1850_H__
+#define __J1850_H__
+
+#include <stdint.h>
+#include "spi.h"
+
+#define J1850_MSG_SIZE 12
+#define J1850_MAX_BUSSES 4
+//Most headers the board can be told to listen for
+#define J1850_LISTEN_MAX 16
+
+//Frame flags
+#define J1850_FRAME_RX 0x01
+#define J1850_FRAME_TX 0x02
+#define J1850_FRAME_CRC_ERR 0x04
+//Board status rather than a bus message, data is switch state, power state, changed flags
+#define J1850_FRAME_STATUS 0x08
+//age holds how long before timestamp the bus event behind this frame happened
+#define J1850_FRAME_TIMED 0x10
+//Switch event rather than a bus message, data is switch, event type
+#define J1850_FRAME_SWITCH 0x20
+//How a frame sent with an id went rather than a bus message, data is status, arbitration losses
+#define J1850_FRAME_TX_REPORT 0x40
+
+//Units of the micro's frame age
+#define J1850_STAMP_US 256
+
+//Status snapshot change flags
+#define J1850_SNAP_SW 0x01
+#define J1850_SNAP_PWR 0x02
+#define J1850_SNAP_RX0 0x04
+#define J1850_SNAP_TX0 0x10
+#define J1850_SNAP_SW_EVT 0x40
+#define J1850_SNAP_HANDOFF 0x80
+
+//Jobs taken over from the board's firmware, it covers anything not set
+#define J1850_HANDOFF_SAT 0x01
+//Only read back, the satellite state the board last saw the radio ask for
+#define J1850_HANDOFF_SAT_ACTIVE 0x80
+
+//Switch event types
+#define J1850_SW_PRESS 0x01
+#define J1850_SW_RELEASE 0x02
+#define J1850_SW_LONG 0x03
+#define J1850_SW_REPEAT 0x04
+#define J1850_SW_EVT_MAX 8
+
+//Switch resistor ladder thresholds per channel, lowest first, in 8 bit ADC counts
+#define J1850_SW_THRESH_COUNT 5
+
+//Transmit report statuses
+#define J1850_TX_SENT 0x00
+#define J1850_TX_LOST 0x01
+#define J1850_TX_TIMEOUT 0x02
+#define J1850_TX_FULL 0x03
+#define J1850_TX_RETRY_FOREVER 0xFF
+//Most reports the micro hands over per request
+#define J1850_TX_REPORT_MAX 8
+//Units of a transmit timeout
+#define J1850_TX_TIMEOUT_MS 10
+
+//What reset the board, only reported by the first heartbeat after it
+#define J1850_RESET_POWER 0x01
+#define J1850_RESET_EXTERNAL 0x02
+#define J1850_RESET_BROWNOUT 0x04
+#define J1850_RESET_WATCHDOG 0x08
+
+typedef struct j1850_frame_t j1850_frame_t;
+typedef struct j1850_ring_t j1850_ring_t;
+typedef struct j1850_header_t j1850_header_t;
+typedef struct j1850_status_t j1850_status_t;
+typedef struct j1850_sw_event_t j1850_sw_event_t;
+typedef struct j1850_tx_report_t j1850_tx_report_t;
+typedef struct j1850_heartbeat_t j1850_heartbeat_t;
+
+struct __attribute__((packed)) j1850_frame_t {
+    uint64_t timestamp;
+    uint32_t age;
+    uint8_t bus;
+    uint8_t bytes;
+    uint8_t flags;
+    //Sending: id to get a report back with or 0, arbitration losses to retry
+    //after and J1850_TX_TIMEOUT_MS units to give up after or 0 for never.
+    //Reports carry the id back
+    uint8_t id;
+    uint8_t retries;
+    uint8_t timeout;
+    uint8_t data[J1850_MSG_SIZE];
+};
+
+/*
+ * Preallocated ring of frames, size is a power of two so the free running
+ * head and tail can be masked down to an index. Safe without locks for one
+ * producer thread (claim/push) and one consumer thread (peek/pop)
+ */
+struct j1850_ring_t {
+    j1850_frame_t *frames;
+    unsigned int mask;
+    unsigned int head;
+    unsigned int tail;
+};
+
+struct j1850_header_t {
+    uint8_t priority;
+    uint8_t bytes;
+    uint8_t ifr;
+    uint8_t functional;
+    uint8_t type;
+    int target;
+    int source;
+};
+
+struct j1850_status_t {
+    uint8_t sw_state;
+    uint8_t pwr_state;
+    uint8_t changed;
+    uint8_t nbusses;
+    uint8_t rx_depth[J1850_MAX_BUSSES];
+    uint8_t tx_free[J1850_MAX_BUSSES];
+};
+
+struct j1850_sw_event_t {
+    uint8_t sw;
+    uint8_t type;
+    uint32_t age;
+};
+
+struct j1850_tx_report_t {
+    uint8_t bus;
+    uint8_t id;
+    uint8_t status;
+    uint8_t losses;
+    uint32_t age;
+};
+
+struct j1850_heartbeat_t {
+    uint8_t seq;
+    //J1850_RESET_ flags if the board's been reset since the last heartbeat
+    uint8_t reset_flags;
+    //Resyncs the board has done, wraps
+    uint8_t resyncs;
+};
+
+uint64_t j1850_now_us(void);
+uint8_t j1850_crc(const uint8_t *msg_buf, int nbytes);
+void j1850_decode_header(const j1850_frame_t *frame, j1850_header_t *header);
+void j1850_format_frame(const j1850_frame_t *frame, char *output, int size);
+
+int j1850_ring_init(j1850_ring_t *ring, unsigned int size);
+void j1850_ring_free(j1850_ring_t *ring);
+unsigned int j1850_ring_count(const j1850_ring_t *ring);
+j1850_frame_t *j1850_ring_claim(j1850_ring_t *ring);
+void j1850_ring_push(j1850_ring_t *ring);
+j1850_frame_t *j1850_ring_peek(j1850_ring_t *ring);
+void j1850_ring_pop(j1850_ring_t *ring);
+
+int j1850_get_status(spi_dev_t *dev, j1850_status_t *status);
+int j1850_get_sw_events(spi_dev_t *dev, j1850_sw_event_t *events, int max);
+int j1850_get_frame(spi_dev_t *dev, int bus, j1850_frame_t *frame, uint8_t *pos);
+int j1850_ack_frame(spi_dev_t *dev, int bus, uint8_t pos);
+int j1850_send_frame(spi_dev_t *dev, j1850_status_t *status, const j1850_frame_t *frame);
+int j1850_get_tx_reports(spi_dev_t *dev, j1850_tx_report_t *reports, int max);
+int j1850_set_listen_headers(spi_dev_t *dev, const uint8_t *headers, int nheaders);
+int j1850_set_sw_thresh(spi_dev_t *dev, int sw, const uint8_t *thresh);
+int j1850_get_handoff(spi_dev_t *dev);
+int j1850_set_handoff(spi_dev_t *dev, uint8_t flags);
+int j1850_heartbeat(spi_dev_t *dev, uint8_t seq, j1850_heartbeat_t *heartbeat);
+
+#endif // __J1850_H__
@@ -0,0 +1,89 @@
+/*
+ * latency.c - Per stage latency histograms from bus event to action
+ *
+ * Recorded from both the SPI thread and the main thread, so the counters are
+ * only ever touched with atomics.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include "latency.h"
+
+typedef struct lat_hist_t lat_hist_t;
+
+struct lat_hist_t {
+    uint32_t buckets[LAT_BUCKETS];
+    uint32_t count;
+    uint64_t total;
+    uint64_t max;
+};
+
+static lat_hist_t hists[LAT_STAGES];
+
+static const char *stage_names[LAT_STAGES] = {
+    "fetch",
+    "dispatch",
+    "issue",
+    "reply sent",
+    "media queued",
+    "dbus done",
+    "reply total",
+    "button total",
+    "link recovery",
+};
+
+void lat_record(int stage, uint64_t us) {
+    lat_hist_t *hist = &hists[stage];
+    int bucket = 0;
+    uint64_t max;
+    
+    while(bucket < LAT_BUCKETS - 1 && (us >> bucket) > 1) bucket ++;
+    
+    __atomic_fetch_add(&hist->buckets[bucket], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&hist->count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&hist->total, us, __ATOMIC_RELAXED);
+    
+    max = __atomic_load_n(&hist->max, __ATOMIC_RELAXED);
+    while(us > max && !__atomic_compare_exchange_n(&hist->max, &max, us, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+/*
+ * Upper edge of the bucket holding the given fraction of samples
+ */
+static uint64_t percentile(lat_hist_t *hist, uint32_t count, int percent) {
+    uint64_t seen = 0;
+    int bucket;
+    
+    for(bucket=0; bucket<LAT_BUCKETS; bucket++) {
+        seen += __atomic_load_n(&hist->buckets[bucket], __ATOMIC_RELAXED);
+        if(seen * 100 >= (uint64_t)count * percent) break;
+    }
+    
+    return 2ULL << bucket;
+}
+
+void lat_dump(void) {
+    int stage;
+    int bucket;
+    
+    printf("Latency (us)      count       mean        p50        p99        max\n");
+    for(stage=0; stage<LAT_STAGES; stage++) {
+        lat_hist_t *hist = &hists[stage];
+        uint32_t count = __atomic_load_n(&hist->count, __ATOMIC_RELAXED);
+        
+        if(count == 0) {
+            printf("%-14s %8u\n", stage_names[stage], 0);
+            continue;
+        }
+        
+        printf("%-14s %8u %10llu %10llu %10llu %10llu\n", stage_names[stage], count,
+               (unsigned long long)(__atomic_load_n(&hist->total, __ATOMIC_RELAXED) / count),
+               (unsigned long long)percentile(hist, count, 50),
+               (unsigned long long)percentile(hist, count, 99),
+               (unsigned long long)__atomic_load_n(&hist->max, __ATOMIC_RELAXED));
+        
+        printf("  ");
+        for(bucket=0; bucket<LAT_BUCKETS; bucket++) printf(" %u", __atomic_load_n(&hist->buckets[bucket], __ATOMIC_RELAXED));
+        printf("\n");
+    }
+}
@@ -0,0 +1,29 @@
+/*
+ * latency.h - Per stage latency histograms from bus event to action
+ */
+
+#ifndef __LATENCY_H__
+#define __LATENCY_H__
+
+#include <stdint.h>
+
+//Power of two buckets in us, the last one catches everything from ~8s up
+#define LAT_BUCKETS 24
+
+enum {
+    LAT_FETCH,          //End of data on the micro to read over SPI
+    LAT_DISPATCH,       //Read over SPI to picked up by the daemon
+    LAT_ISSUE,          //Picked up to reply queued or D-Bus call sent
+    LAT_REPLY_SENT,     //Reply queued to handed to the micro
+    LAT_MEDIA_QUEUED,   //Media command queued to its D-Bus call sent
+    LAT_DBUS_DONE,      //D-Bus call sent to its reply
+    LAT_REPLY_TOTAL,    //Satellite query end of data to reply handed to the micro
+    LAT_BUTTON_TOTAL,   //Radio button end of data to D-Bus reply
+    LAT_LINK_RECOVERY,  //SPI link failure noticed to back in step
+    LAT_STAGES
+};
+
+void lat_record(int stage, uint64_t us);
+void lat_dump(void);
+
+#endif // __LATENCY_H__
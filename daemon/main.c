@@ -12,52 +12,79 @@
 #include <stdlib.h>
 #include <signal.h>
 #include <fcntl.h>
-#include <sys/ioctl.h>
 #include <time.h>
-#include <linux/types.h>
-#include <linux/spi/spidev.h>
 #include <string.h>
 #include <dbus/dbus.h>
 #include <regex.h>
+#include "spi.h"
+#include "j1850.h"
+#include "io.h"
+#include "board.h"
+#include "latency.h"
+#include "segment.h"
+#include "display.h"
+#include "obd.h"
+#include "sigdb.h"
+#include "tstore.h"
+#include "media.h"
 
 #define PWR_FILE_PATH "/home/pi/pwroff"
 
-static const char *device = "/dev/spidev0.0";
-static uint8_t mode = 0;
-static uint8_t bits = 8;
-static uint32_t speed = 100000;
-static uint16_t delay = 0;
+//A satellite reply the radio didn't get soon after asking is no use to it
+#define SAT_REPLY_RETRIES 3
+#define SAT_REPLY_TIMEOUT_MS 100
+
+//Tracks a long press on Seek skips on top of the one the press itself gave
+#define SW_FAST_SKIP 4
+
+//Diagnostic queries go out on the vehicle side bus unless -o says otherwise
+#define OBD_BUS 0
+#define OBD_BUDGET 200
+#define OBD_PERIOD_MS 1000
+
+//What the daemon itself acts on, -g adds more to decode
+static const char *builtin_signals =
+    "message sat_query bus=0 match=8D,0F\n"
+    "    signal sat_request byte=2 len=8\n"
+    "message radio_button bus=0 match=3D,12,83\n"
+    "    signal radio_button byte=3 len=8\n";
+
+static const char *default_device = "/dev/spidev0.0";
+static const char *spi_devices[BOARD_MAX];
+static int nspi_devices;
+static uint32_t spi_max_speed;
+static board_set_t boards;
+static fanout_t fanout;
+static seg_t seg;
+static seg_msg_t seg_msg;
+static disp_t disp;
+static obd_t obd;
+static sigdb_t sigdb;
+static const char *signal_file;
+static tstore_t tstore;
+static const char *telemetry_dir;
+static media_t media;
 
 static int dbg_level;
 static int listen;
+static int rt_priority;
+static int bus_ceiling = IO_BUS_CEILING;
 
-static int state;
+static uint8_t sw_thresh[2][J1850_SW_THRESH_COUNT];
+static int sw_thresh_set[2];
 
-static int xferbyte(int fd, int outbyte);
-static int spi_send_data(int fd, int *tx_buf, int len);
-static int spi_get_data(int fd, int *rx_buf);
-static int spi_get_response(int fd, int *rx_buf);
-static int update_pwr_file(int pwr);
-static int update_sw(int fd, int sw_state, int last_sw_state);
+static volatile sig_atomic_t running = 1;
+static volatile sig_atomic_t dump_latency;
 
+static int update_pwr_file(int pwr);
+static int update_sw(board_t *board);
 static DBusMessage *create_property_get_message(const char *bus_name, const char *path, const char *iface, const char *propname);
 
-static int xferbyte(int fd, int outbyte) {
-    int ret;
-    int rx = 0;
-    struct spi_ioc_transfer tr = {
-        .tx_buf = (unsigned long)&outbyte,
-        .rx_buf = (unsigned long)&rx,
-        .len = 1,
-        .delay_usecs = delay,
-        .speed_hz = 0,
-        .bits_per_word = 0,
-    };
-    
-    ret = ioctl(fd, SPI_IOC_MESSAGE(1), &tr);
-    
-    if(ret < 0) return ret;
-    else return rx;
+static void print_frame(const j1850_frame_t *frame) {
+    char output[256];
+    
+    j1850_format_frame(frame, output, sizeof output);
+    printf("%s\n", output);
 }
 
 static int update_pwr_file(int pwr) {
@@ -83,242 +110,141 @@ static int update_pwr_file(int pwr) {
     return 0;
 }
 
-static int update_sw(int fd, int sw_state, int last_sw_state) {
+/*
+ * Sends the board's switches as they are to the radio on its first bus
+ */
+static int update_sw(board_t *board) {
     int ret;
-    int send_buf[] = {0x07, 0x04, 0x3D, 0x11, 0x00, 0x00};
+    uint8_t send_buf[] = {0x3D, 0x11, 0x00, 0x00};
+    //Nothing pressed or let go is just keeping the radio up to date
+    int class = (board->sw_state || board->last_sw_state) ? IO_CLASS_CONTROL : IO_CLASS_PERIODIC;
     
-    if(sw_state) {
-        switch(sw_state) {
+    if(board->sw_state) {
+        switch(board->sw_state) {
             //Off/Vol-
             case 0x01:
-                send_buf[4] = 0x02;
-                send_buf[5] = 0x00;
+                send_buf[2] = 0x02;
+                send_buf[3] = 0x00;
                 break;
             //Cancel/Mode
             case 0x02:
-                send_buf[4] = 0x00;
-                send_buf[5] = 0x02;
+                send_buf[2] = 0x00;
+                send_buf[3] = 0x02;
                 break;
             //Set/Seek-
             case 0x03:
-                send_buf[4] = 0x10;
-                send_buf[5] = 0x00;
+                send_buf[2] = 0x10;
+                send_buf[3] = 0x00;
                 break;
             //Resume/Seek+
             case 0x04:
-                send_buf[4] = 0x20;
-                send_buf[5] = 0x00;
+                send_buf[2] = 0x20;
+                send_buf[3] = 0x00;
                 break;
             //On/Vol+
             case 0x05:
-                send_buf[4] = 0x04;
-                send_buf[5] = 0x00;
+                send_buf[2] = 0x04;
+                send_buf[3] = 0x00;
                 break;
         }
-        ret = spi_send_data(fd, send_buf, 6);
+        ret = io_send(&board->io, class, board->bus_base, send_buf, 4, 0);
     }
     else {
-        ret = spi_send_data(fd, send_buf, 6);
+        ret = io_send(&board->io, class, board->bus_base, send_buf, 4, 0);
     }
     
     return ret;
 }
 
-static int set_listen_headers(int fd, int *headers) {
-    int ret;
-    int data;
-    int nheaders = 0;
-    
-    data = 0x05;
-    ret = spi_send_data(fd, &data, 1);
-    if(ret < 0) return ret;
-    
-	while(headers[nheaders] != 0) {
-        data = 0x06;
-        ret = spi_send_data(fd, &data, 1);
-        if(ret < 0) return ret;
-        ret = spi_send_data(fd, &headers[nheaders], 1);
-        if(ret < 0) return ret;
-		nheaders++;
-	}
+/*
+ * Switch ladder for one channel as channel:t0,t1,t2,t3,t4
+ */
+static int parse_sw_thresh(const char *arg) {
+    int sw;
+    int t[J1850_SW_THRESH_COUNT];
+    int i;
+    
+    if(sscanf(arg, "%i:%i,%i,%i,%i,%i", &sw, &t[0], &t[1], &t[2], &t[3], &t[4]) != 1 + J1850_SW_THRESH_COUNT) return -1;
+    if(sw < 0 || sw > 1) return -1;
+    
+    for(i=0; i<J1850_SW_THRESH_COUNT; i++) {
+        if(t[i] < 0 || t[i] > 255 || (i && t[i] <= t[i-1])) return -1;
+        sw_thresh[sw][i] = t[i];
+    }
+    sw_thresh_set[sw] = 1;
     
     return 0;
 }
 
-static void print_j1850_msg(int *msg, int bytes, int bus) {
-    int priority = (msg[0] & 0b11100000) >> 5;
-    int headertype = 3;
-    if((msg[0] & 0b00010000) > 0) headertype = 1;
-    char ifr[] = "N";
-    if((msg[0] & 0b00001000) > 0) ifr[0] = 'N';
-    int addr = ((msg[0] & 0b00000100) >> 2) ^ 0x01;
-    headertype = headertype - addr;
-    char addressing[] = "F";
-    if(!addr) addressing[0] = 'P';
-    int msg_type = msg[0] & 0b00000011;
-    
-    char target[] = "--";
-    char source[] = "--";
-    if(headertype == 3) {
-        snprintf(target, sizeof(target), "%.2X", msg[1]);
-        snprintf(source, sizeof(source), "%.2X", msg[2]);
-    }
-    else if(headertype == 2) {
-        snprintf(target, sizeof(target), "%.2X", msg[1]);
-    }
-
-    char output[256] = {0};
-    
-    snprintf(output, sizeof(output), "BUS: %1i - HDR: %.2X (P%2i HL%1i IFR: %s ADR: %s TP%1i T%s S%s) ", bus, msg[0], priority, headertype, ifr, addressing, msg_type, target, source);
-    
-    char message[64] = {0};
-    strcat(message, "MSG: ");
-    int mbytes = bytes - headertype - 1;
-    int i;
-    for(i = 0; i < mbytes; i++) {
-        char tempstr[8] = {0};
-        
-        snprintf(tempstr, sizeof(tempstr), "%.2X ", msg[i+headertype]);
-        strcat(message, tempstr);
-    }
-    for(i=i; i<(12); i++) {
-        strcat(message, "   ");
-    }
-    strcat(message, "[");
-    for(i = 0; i < mbytes; i++) {
-        char tempstr[8] = {0};
-        
-        snprintf(tempstr, sizeof(tempstr), "%c", msg[i+headertype]);
-        strcat(message, tempstr);
+/*
+ * [bus/][ecu@]mode:pid[:period_ms] with the ECU's address, mode and PID in hex.
+ * Goes out on OBD_BUS and to every ECU unless a bus or ECU is given
+ */
+static int parse_obd_pid(const char *arg) {
+    int bus = OBD_BUS;
+    unsigned int target = OBD_FUNCTIONAL;
+    unsigned int mode;
+    unsigned int pid;
+    int period = OBD_PERIOD_MS;
+    const char *p;
+    
+    if((p = strchr(arg, '/')) != NULL) {
+        if(sscanf(arg, "%i/", &bus) != 1) return -1;
+        arg = p + 1;
     }
-    for(i=i; i<(12); i++) {
-        strcat(message, " ");
+    if((p = strchr(arg, '@')) != NULL) {
+        if(sscanf(arg, "%x@", &target) != 1 || target > 0xFF) return -1;
+        arg = p + 1;
     }
-    strcat(message, "] ");
-    strcat(output, message);
+    if(sscanf(arg, "%x:%x:%i", &mode, &pid, &period) < 2) return -1;
+    if(mode > 0x3F || pid > 0xFF) return -1;
     
-    char crc[8] = {0};
-    snprintf(crc, sizeof(crc), "CRC: %.2X", msg[11]);
-    
-    strcat(output, crc);
-			
-    printf("%s\n", output);
+    return obd_add_pid(&obd, bus, target, mode, pid, period);
 }
 
-static int get_j1850_msg(int fd, int bus, int *data) {
-    int ret;
+/*
+ * Every PID being polled with its last value, or why there isn't a fresh one
+ */
+static void dump_obd(void) {
     int i;
-    int rx_buf[64];
-    int tx_buf;
+    int j;
     
-    //Clear send buffer on micro
-    do {
-        ret = spi_get_data(fd, rx_buf);
-    } while(ret > 0);
-    if(ret < 0) return ret;
-    
-    //Request the next message in the buffer
-    if(bus == 0) tx_buf = 0x03;
-    else tx_buf = 0x04;
-    ret = spi_send_data(fd, &tx_buf, 1);
-    if(ret < 0) return ret;
-    
-    //Wait for and get the micro's response
-    ret = spi_get_response(fd, rx_buf);
-    if(ret < 0) return ret;
-    ret --;
-    
-    if(rx_buf[0] != 0x00) {
-        //Copy to output, discarding status byte
-        for(i=0; i<ret; i++) data[i] = rx_buf[i+1];
+    for(i=0; i<obd.npids; i++) {
+        const obd_pid_t *p = &obd.pids[i];
+        const obd_pid_t *fresh = obd_get(&obd, p->bus, p->target, p->mode, p->pid);
         
-        if(dbg_level) print_j1850_msg(data, ret, bus);
+        printf("OBD bus %i %.2X@%.2X:%.2X %u samples %u timeouts:", p->bus, p->target, p->mode, p->pid, p->samples, p->timeouts);
+        if(p->unsupported) printf(" unsupported\n");
+        else if(fresh == NULL) printf(" stale\n");
+        else {
+            printf(" from %.2X", fresh->source);
+            for(j=0; j<fresh->len; j++) printf(" %.2X", fresh->value[j]);
+            printf("\n");
+        }
     }
-    
-    return ret;
 }
 
-static int spi_send_data(int fd, int *tx_buf, int len) {
-    int ret;
-    
+/*
+ * Whether the radio on any board has the satellite as its source
+ */
+static int sat_active(void) {
     int i;
-    for(i=0; i<len; i++) {
-        //Send write command
-        ret = xferbyte(fd, 0x02);
-        if(ret < 0) return ret;
-        
-        //Send data byte and verify command/data
-        ret = xferbyte(fd, tx_buf[i]);
-        if(ret != 0x02) {
-            printf("Command didn't match request, wanted %i, got %i\n", 0x02, ret);
-            return -1;
-        }
-        ret = xferbyte(fd, 0x00);
-        if(ret != tx_buf[i]) {
-            printf("Data didn't match request, wanted %i, got %i\n", tx_buf[i], ret);
-            return -1;
-        }
-    }
     
-    return 0;
-}
-
-static int spi_get_data(int fd, int *rx_buf) {
-    int ret;
-    int len = 0;
-    
-    //Clear SPDR and get buffer status
-    ret = xferbyte(fd, 0x00);
-    if(ret < 0) return ret;
-    ret = xferbyte(fd, 0x00);
-    if(ret < 0) return ret;
-    
-    while(ret) {
-        //Send and verify read command
-        ret = xferbyte(fd, 0x01);
-        if(ret < 0) return ret;
-        ret = xferbyte(fd, 0x00);
-        if(ret != 1) return -1;
-        
-        //Get actual data byte
-        ret = xferbyte(fd, 0x00);
-        if(ret < 0) return ret;
-        rx_buf[len] = ret;
-        len ++;
-        
-        //Get buffer status
-        ret = xferbyte(fd, 0x00);
-        if(ret < 0) return ret;
+    for(i=0; i<boards.nboards; i++) {
+        if(boards.boards[i].sat_state) return 1;
     }
     
-    return len;
-}
-
-static int spi_get_response(int fd, int *rx_buf) {
-    int ret;
-    struct timespec start, end;
-    
-    //Wait for the micro to respond to our request
-    clock_gettime(CLOCK_MONOTONIC, &start);
-    do {
-        ret = spi_get_data(fd, rx_buf);
-        if(ret < 1) return ret;
-        
-        //Give up after 100ms
-        clock_gettime(CLOCK_MONOTONIC, &end);
-        if(end.tv_nsec - start.tv_nsec > 100000000) return -1;
-    } while(ret == 0);
-    
-    return ret;
+    return 0;
 }
 
 void sig_handler(int sig) {
-    if(sig == SIGINT) state = 0xFF;
+    if(sig == SIGINT) running = 0;
+    else if(sig == SIGUSR1) dump_latency = 1;
 }
 
 static DBusMessage *create_property_get_message(const char *bus_name, const char *path, const char *iface, const char *propname) {
     DBusMessage *queryMessage = NULL;
- 
+    
     queryMessage = dbus_message_new_method_call(bus_name, path, 
                             "org.freedesktop.DBus.Properties",
                             "Get");
@@ -326,7 +252,7 @@ static DBusMessage *create_property_get_message(const char *bus_name, const char
                  DBUS_TYPE_STRING, &iface,
                  DBUS_TYPE_STRING, &propname,
                  DBUS_TYPE_INVALID);
- 
+    
     return queryMessage;
 }
                                  
@@ -334,7 +260,7 @@ static void get_track_parameter(DBusConnection *connection, const char *device,
     DBusError myError;
     DBusMessage *queryMessage = NULL;
     DBusMessage *replyMessage = NULL;
- 
+    
     dbus_error_init(&myError);
     
     char path[100] = {0};
@@ -358,18 +284,18 @@ static void get_track_parameter(DBusConnection *connection, const char *device,
         dbus_move_error(&myError, error);
         return;
     }
-     
+    
     DBusMessageIter iter;
     DBusMessageIter sub;
     DBusMessageIter entry;
-     
+    
     dbus_message_iter_init(replyMessage, &iter);
- 
+    
     if (DBUS_TYPE_VARIANT != dbus_message_iter_get_arg_type(&iter)) {
         dbus_set_error_const(error, "reply_should_be_variant", "This message hasn't a variant entry response type\n");
         return;
     }
- 
+	
 	//Move in to array of response (array)
     dbus_message_iter_recurse(&iter, &iter);
 	
@@ -401,7 +327,7 @@ static void get_track_parameter(DBusConnection *connection, const char *device,
 			dbus_message_iter_get_basic(&value, result);
 		}
 	} while (dbus_message_iter_next(&sub));
- 
+    
     dbus_message_unref(replyMessage);
 }
 
@@ -409,9 +335,9 @@ static void get_device(DBusConnection *connection, DBusError *error, char *devic
     DBusError myError;
     DBusMessage *queryMessage = NULL;
     DBusMessage *replyMessage = NULL;
- 
+    
     dbus_error_init(&myError);
-     
+    
     queryMessage = dbus_message_new_method_call("org.bluez", // target for the method call
                                                 "/org/bluez/hci0", // object to call on
                                                 "org.freedesktop.DBus.Introspectable", // interface to call on
@@ -427,9 +353,9 @@ static void get_device(DBusConnection *connection, DBusError *error, char *devic
     }
     
     DBusMessageIter iter;
-     
+    
     dbus_message_iter_init(replyMessage, &iter);
- 
+    
     if (DBUS_TYPE_STRING != dbus_message_iter_get_arg_type(&iter)) {
         dbus_set_error_const(error, "reply_should_be_string", "This message hasn't a string entry response type\n");
         return;
@@ -447,10 +373,10 @@ static void get_device(DBusConnection *connection, DBusError *error, char *devic
             memcpy(tempdev, search, 21);
             
             char path[100] = {0};
-    
+            
             strcat(path, "/org/bluez/hci0/");
             strcat(path, tempdev);
-    
+            
             queryMessage = dbus_message_new_method_call("org.bluez", // target for the method call
                                                 path, // object to call on
                                                 "org.freedesktop.DBus.Introspectable", // interface to call on
@@ -464,9 +390,9 @@ static void get_device(DBusConnection *connection, DBusError *error, char *devic
                 dbus_move_error(&myError, error);
                 return;
             }
-             
+            
             dbus_message_iter_init(replyMessage, &iter);
-         
+            
             if (DBUS_TYPE_STRING != dbus_message_iter_get_arg_type(&iter)) {
                 dbus_set_error_const(error, "reply_should_be_string", "This message hasn't a string entry response type\n");
                 return;
@@ -485,254 +411,319 @@ static void get_device(DBusConnection *connection, DBusError *error, char *devic
     } while (search != NULL);
 }
 
-static int send_info(int fd, char *text, uint8_t field) {
-	int character = 0;
-	int msg_char = 0;
-	int msgs = 0;
-	int msg[9][8] = {0};
-	int maxchar;
-	
-	switch(field) {
-		case 0x00:
-			maxchar = 20;
-			break;
-		case 0x01:
-			maxchar = 18;
-			break;
-		case 0x02:
-			maxchar = 8;
-			break;
-		case 0x04:
-			maxchar = 36;
-			break;
-		case 0x05:
-			maxchar = 36;
-			break;
-		default:
-			return -1;
-	}
-	
-	while(text[character] != '\0' && character < maxchar) {
-		while(text[character] != '\0' && character < maxchar && msg_char < 4) {
-			msg[msgs][msg_char+4] = text[character];
-			msg_char ++;
-			character ++;
-		}
-		for(; msg_char<4; msg_char++) msg[msgs][msg_char+4] = 0x20;
-		
-		msg[msgs][0] = 0x08;
-		msg[msgs][1] = 0x06;
-		msg[msgs][2] = 0xAB;
-		
-		msg_char = 0;
-		msgs ++;
-	}
-	
-	msg[0][3] += 0x08;
-	
-	int sendmsg;
-	for(sendmsg=0; sendmsg<msgs; sendmsg++) {
-		msg[sendmsg][3] += 0x10 * (msgs-sendmsg) + field;
-		
-		spi_send_data(fd, &msg[sendmsg][0], 8);
-	}
-	
-	return 0;
+static uint64_t dispatch_start(const j1850_frame_t *frame) {
+    uint64_t dispatched = j1850_now_us();
+    
+    lat_record(LAT_DISPATCH, dispatched - frame->timestamp);
+    return dispatched;
 }
 
-void dbus_method(DBusConnection *connection, char *device, char *method) {
-	DBusMessage* msg;
-	DBusPendingCall* pending;
+/*
+ * The radio asking after the satellite receiver, 0x26 is it being picked as the source
+ */
+static void on_sat_request(const sigdb_signal_t *signal, double value, const j1850_frame_t *frame, void *ctx) {
+    board_t *board = board_for_bus(&boards, frame->bus);
+    uint64_t origin = frame->timestamp - frame->age;
+    uint64_t dispatched = dispatch_start(frame);
+    
+    if(board == NULL) return;
+    
+    if(value == 0x26) {
+        if(dbg_level) printf("Sending sat active on bus %i\n", frame->bus);
+        uint8_t send_buf[] = {0x8D, 0x22, 0x11, 0x01, 0x01};
+        io_send_tracked(&board->io, IO_CLASS_CONTROL, frame->bus, send_buf, 5, origin, SAT_REPLY_RETRIES, SAT_REPLY_TIMEOUT_MS);
+        lat_record(LAT_ISSUE, j1850_now_us() - dispatched);
+        board->sat_state = 0x01;
+    }
+    else {
+        if(dbg_level) printf("Sending sat exists on bus %i\n", frame->bus);
+        uint8_t send_buf[] = {0x8D, 0x22, 0x10, 0x00, 0x01};
+        io_send_tracked(&board->io, IO_CLASS_CONTROL, frame->bus, send_buf, 5, origin, SAT_REPLY_RETRIES, SAT_REPLY_TIMEOUT_MS);
+        lat_record(LAT_ISSUE, j1850_now_us() - dispatched);
+        board->sat_state = 0x00;
+    }
+}
 
-    char path[100] = {0};
+/*
+ * Seek buttons on the radio, only ours while the satellite is the source
+ */
+static void on_radio_button(const sigdb_signal_t *signal, double value, const j1850_frame_t *frame, void *ctx) {
+    board_t *board = board_for_bus(&boards, frame->bus);
+    uint64_t origin = frame->timestamp - frame->age;
+    uint64_t dispatched = dispatch_start(frame);
     
-    if(device[0] == 0) return;
+    if(board == NULL || !board->sat_state) return;
     
-    strcat(path, "/org/bluez/hci0/");
-    strcat(path, device);
-    strcat(path, "/player0");
-
-	msg = dbus_message_new_method_call("org.bluez", // target for the method call
-	path, // object to call on
-	"org.bluez.MediaPlayer1", // interface to call on
-	method); // method name
-	if (NULL == msg) { 
-		fprintf(stderr, "Message Null\n");
-		return;
-	}
-
-	// send message and get a handle for a reply
-	if (!dbus_connection_send_with_reply (connection, msg, &pending, -1)) { // -1 is default timeout
-		fprintf(stderr, "Out Of Memory!\n"); 
-		return;
-	}
-	if (NULL == pending) { 
-		fprintf(stderr, "Pending Call Null\n"); 
-		return; 
-	}
-	dbus_connection_flush(connection);
+    if(value == 0x26) media_command(&media, MEDIA_NEXT, origin);
+    else if(value == 0x27) media_command(&media, MEDIA_PREVIOUS, origin);
+    else return;
+    lat_record(LAT_ISSUE, j1850_now_us() - dispatched);
+}
 
-	// free message
-	dbus_message_unref(msg);
+static void store_signal(const sigdb_signal_t *signal, double value, const j1850_frame_t *frame, void *ctx) {
+    tstore_append(ctx, signal->index, frame->timestamp - frame->age, value);
 }
 
-static int spi_init(int *fd) {
-    int ret;
+/*
+ * Every signal gets a column in the store, in the same order so the
+ * signal's index is its column
+ */
+static int start_telemetry(void) {
+    int i;
     
-    while(*fd < 0) {
-        *fd = open(device, O_RDWR);
-        if (*fd < 0) {
-            printf("can't open spi device\n");
-            nanosleep((const struct timespec[]){{0, 500000000L}}, NULL);
-        }
+    if(tstore_init(&tstore, telemetry_dir) < 0) return -1;
+    for(i=0; i<sigdb.nsignals; i++) {
+        sigdb_signal_t *signal = &sigdb.signals[i];
+        if(tstore_add_column(&tstore, signal->name, signal->unit, signal->scale, signal->offset) != i) return -1;
     }
     
-    // spi mode
-    ret = ioctl(*fd, SPI_IOC_WR_MODE, &mode);
-    if (ret == -1) {
-        printf("can't set spi mode\n");
-        return ret;
-    }
-    ret = ioctl(*fd, SPI_IOC_RD_MODE, &mode);
-    if (ret == -1) {
-        printf("can't get spi mode\n");
-        return ret;
-    }
-
-    // bits per word
-    ret = ioctl(*fd, SPI_IOC_WR_BITS_PER_WORD, &bits);
-    if (ret == -1) {
-        printf("can't set bits per word\n");
-        return ret;
-    }
-    ret = ioctl(*fd, SPI_IOC_RD_BITS_PER_WORD, &bits);
-    if (ret == -1) {
-        printf("can't get bits per word\n");
-        return ret;
-    }
+    if(sigdb_subscribe(&sigdb, NULL, store_signal, &tstore) < 0) return -1;
+    return tstore_start(&tstore);
+}
 
-    // max speed hz
-    ret = ioctl(*fd, SPI_IOC_WR_MAX_SPEED_HZ, &speed);
-    if (ret == -1) {
-        printf("can't set max speed hz\n");
-        return ret;
-    }
-    ret = ioctl(*fd, SPI_IOC_RD_MAX_SPEED_HZ, &speed);
-    if (ret == -1) {
-        printf("can't get max speed hz\n");
-        return ret;
-    }
-    
-    return 0;
+static void log_signal(const sigdb_signal_t *signal, double value, const j1850_frame_t *frame, void *ctx) {
+    printf("Bus %i %s: %g %s\n", frame->bus, signal->name, value, signal->unit);
 }
 
 int main(int argc, char *argv[])
 {
     int ret = 0;
-    int fd = -1;
+    int i;
     
     dbg_level = 0;
     listen = 0;
     int opt;
-    while ((opt = getopt(argc, argv, "dl")) != -1) {
+    rt_priority = 0;
+    obd_init(&obd, OBD_BUDGET);
+    while ((opt = getopt(argc, argv, "dlD:s:r:t:u:o:g:w:")) != -1) {
         switch (opt) {
         case 'd': dbg_level = 1; break;
         case 'l': listen = 1; break;
+        case 's': spi_max_speed = strtoul(optarg, NULL, 0); break;
+        case 'D':
+            if(nspi_devices == BOARD_MAX) goto usage;
+            spi_devices[nspi_devices++] = optarg;
+            break;
+        case 'r': rt_priority = atoi(optarg); break;
+        case 'g': signal_file = optarg; break;
+        case 'w': telemetry_dir = optarg; break;
+        case 't':
+            if(parse_sw_thresh(optarg) == 0) break;
+            goto usage;
+        case 'o':
+            if(parse_obd_pid(optarg) == 0) break;
+            goto usage;
+        case 'u':
+            bus_ceiling = atoi(optarg);
+            if(bus_ceiling > 0 && bus_ceiling <= 100) break;
+            //Bad arguments all end up at usage
         default:
-            fprintf(stderr, "Usage: %s [-dl]\n", argv[0]);
+        usage:
+            fprintf(stderr, "Usage: %s [-dl] [-D spidev]... [-s max_spi_hz] [-r fifo_priority] [-t channel:t0,t1,t2,t3,t4] [-u bus_ceiling_percent] [-o [bus/][ecu@]mode:pid[:period_ms]] [-g signal_defs] [-w telemetry_dir]\n", argv[0]);
+            fprintf(stderr, "OBD PIDs given with -o are asked of every ECU on bus %i unless an ECU or bus is given, and polled alongside the satellite emulation. -l only listens and never answers the radio. SIGUSR1 prints latencies and OBD values\n", OBD_BUS);
+            exit(EXIT_FAILURE);
+        }
+    }
+    
+    sigdb_init(&sigdb);
+    if(sigdb_load_string(&sigdb, "builtin", builtin_signals) < 0) exit(EXIT_FAILURE);
+    if(signal_file && sigdb_load(&sigdb, signal_file) < 0) exit(EXIT_FAILURE);
+    if(sigdb_compile(&sigdb) < 0) exit(EXIT_FAILURE);
+    
+    //Each board's busses are numbered on from the last one's, in the order given
+    if(nspi_devices == 0) spi_devices[nspi_devices++] = default_device;
+    board_set_init(&boards);
+    for(i=0; i<nspi_devices; i++) {
+        board_t *board = board_add(&boards, spi_devices[i]);
+        if(spi_max_speed) board->dev.max_speed = spi_max_speed;
+        if(board_open(&boards, board, rt_priority) < 0) return -1;
+    }
+    for(i=0; i<obd.npids; i++) {
+        if(obd.pids[i].bus >= boards.nbusses) {
+            fprintf(stderr, "No bus %i to poll OBD on\n", obd.pids[i].bus);
             exit(EXIT_FAILURE);
         }
     }
-
-    if(spi_init(&fd) < 0) return -1;
     
     signal(SIGINT, sig_handler);
+    signal(SIGUSR1, sig_handler);
     
     DBusConnection *connection = NULL;
     DBusError error;
- 
+    
     dbus_error_init(&error);
     connection = dbus_bus_get(DBUS_BUS_SYSTEM, &error);
     if (dbus_error_is_set(&error)) {
         fprintf(stderr, "%s", error.message);
         abort();
     }
- 
+    
     puts("This is my unique name");
     puts(dbus_bus_get_unique_name(connection));
     
-    int headers[8] = {0x00};
-	if(!listen) {
-        headers[0] = 0x8D;
-        headers[1] = 0x3D;
+    //Watchers read frames from here instead of fighting over spidev
+    if(fanout_create(&fanout, FANOUT_NAME, FANOUT_SLOTS) < 0) printf("Couldn't share frames at %s, continuing without\n", FANOUT_NAME);
+    
+    //Satellite queries and radio buttons, OBD answers while there's anything to poll
+    //and whatever the signal definitions decode. If they can't all be listed
+    //the board passes everything
+    uint8_t headers[J1850_LISTEN_MAX] = {0x8D, 0x3D};
+    int nheaders = 2;
+    if(obd.npids) {
+        headers[nheaders++] = OBD_RESP_FUNCTIONAL;
+        headers[nheaders++] = OBD_REQ_PHYSICAL;
+    }
+    nheaders = sigdb_add_headers(&sigdb, headers, nheaders, J1850_LISTEN_MAX);
+    if(nheaders < 0) nheaders = 0;
+    if(dbg_level && !listen) {
+        printf("Listening for");
+        for(i=0; i<nheaders; i++) printf(" %.2X", headers[i]);
+        printf(nheaders ? "\n" : " everything\n");
+    }
+    
+    for(i=0; i<boards.nboards; i++) {
+        board_t *board = &boards.boards[i];
+        
+        //Take the satellite over from the board, carrying on in whatever state it left the radio.
+        //The board keeps answering until it's told, so the radio never sees a gap
+        ret = j1850_get_handoff(&board->dev);
+        if(ret < 0) exit(EXIT_FAILURE);
+        if(ret & J1850_HANDOFF_SAT_ACTIVE) board->sat_state = 0x01;
+        if(dbg_level) printf("%s: handoff state %.2X\n", board->dev.device, ret);
+        
+        //Kept with the thread, which sets the board up again if it resets
+        if(!listen) {
+            memcpy(board->io.listen_headers, headers, nheaders);
+            board->io.nlisten_headers = nheaders;
+            board->io.handoff = J1850_HANDOFF_SAT;
+        }
+        memcpy(board->io.sw_thresh, sw_thresh, sizeof sw_thresh);
+        memcpy(board->io.sw_thresh_set, sw_thresh_set, sizeof sw_thresh_set);
+        if(io_setup_board(&board->io) < 0) exit(EXIT_FAILURE);
+        
+        board->io.ceiling = bus_ceiling;
+        if(fanout.header) board->io.fanout = &fanout;
     }
-    ret = set_listen_headers(fd, headers);
-    if(ret < 0) exit(EXIT_FAILURE);
     
-    char device[24];
+    char device[24] = {0};
+    media_init(&media, connection, device);
+    
+    //Listening only watches, it never answers the radio
+    if(!listen) {
+        sigdb_subscribe(&sigdb, "sat_request", on_sat_request, NULL);
+        sigdb_subscribe(&sigdb, "radio_button", on_radio_button, NULL);
+    }
+    if(dbg_level) sigdb_subscribe(&sigdb, NULL, log_signal, NULL);
+    if(telemetry_dir && start_telemetry() < 0) {
+        printf("Error starting telemetry store\n");
+        exit(EXIT_FAILURE);
+    }
     
-    int tmr_10ms = 0;
-    state = 0;
-    int last_sw_state = 0;
+    uint64_t last_1s = j1850_now_us();
     int last_state = 0;
-    while(1) {
-        int rx_buf[64];
-        int tx_buf[64];
-        int sw_state;
+    
+    seg_init(&seg);
+    seg_listen(&seg, DISP_BUS, &disp_scheme);
+    disp_init(&disp);
+    
+    if(board_start(&boards) < 0) exit(EXIT_FAILURE);
+    
+    while(running) {
+        j1850_frame_t *frame;
+        int state;
+        int b;
         
-        if(state == 0xFF) break;
-      
-        //Get switch state
-        while(spi_get_data(fd, rx_buf) > 0);
-        tx_buf[0] = 0x01;
-        ret = spi_send_data(fd, tx_buf, 1);
-        if(ret < 0) printf("Error sending switch command: %i\n", ret);
-        ret = spi_get_response(fd, rx_buf);
-        if(ret < 0) printf("Error getting switch response: %i\n", ret);
-        sw_state = rx_buf[0];
+        //Wait for the SPI threads to hand over messages or status changes
+        board_wait(&boards, 10);
         
-        //Do switches
-        if(sw_state != last_sw_state) {
-            last_sw_state = sw_state;
-            
-            if(dbg_level) printf("Switch byte: %.2X\n", sw_state);
-            ret = update_sw(fd, sw_state, last_sw_state);
-            if(ret < 0) printf("Error handling switch state: %i\n", ret);
+        //Pick up D-Bus replies
+        dbus_connection_read_write(connection, 0);
+        while(dbus_connection_dispatch(connection) == DBUS_DISPATCH_DATA_REMAINS);
+        media_service(&media);
+        
+        if(dump_latency) {
+            dump_latency = 0;
+            lat_dump();
+            dump_obd();
         }
         
-        //Get J1850 bus 0 messages
-        ret = get_j1850_msg(fd, 0, rx_buf);
-        if(ret < 0) printf("Error retrieving bus 0 messages: %i\n", ret);
-        if(ret && !listen) {
-            if(rx_buf[0] == 0x8D && rx_buf[1] == 0x0F) {
-                if(rx_buf[2] == 0x26) {
-                    if(dbg_level) printf("Sending sat active\n");
-                    int send_buf[] = {0x07, 0x05, 0x8D, 0x22, 0x11, 0x01, 0x01};
-                    spi_send_data(fd, send_buf, 7);
-                    state = 0x01;
+        for(b=0; b<boards.nboards; b++) {
+            board_t *board = &boards.boards[b];
+            
+            while((frame = j1850_ring_peek(&board->io.rx)) != NULL) {
+                if(frame->flags & J1850_FRAME_SWITCH) {
+                    if(dbg_level) printf("%s: switch %.2X event %i, %u us ago\n", board->dev.device, frame->data[0], frame->data[1], frame->age);
+                    
+                    //Presses and repeats go out as the button, releases let it go
+                    switch(frame->data[1]) {
+                        case J1850_SW_PRESS:
+                        case J1850_SW_REPEAT:
+                            board->last_sw_state = board->sw_state;
+                            board->sw_state = frame->data[0];
+                            ret = update_sw(board);
+                            if(ret < 0) printf("Error handling switch event: %i\n", ret);
+                            break;
+                        case J1850_SW_RELEASE:
+                            if(frame->data[0] != board->sw_state) break;
+                            board->last_sw_state = board->sw_state;
+                            board->sw_state = 0;
+                            ret = update_sw(board);
+                            if(ret < 0) printf("Error handling switch event: %i\n", ret);
+                            break;
+                        //Seek held down skips on through the player's tracks while the satellite's the source
+                        case J1850_SW_LONG:
+                            if(board->sat_state && (frame->data[0] == 0x03 || frame->data[0] == 0x04)) {
+                                int i;
+                                for(i=0; i<SW_FAST_SKIP; i++) media_command(&media, frame->data[0] == 0x04 ? MEDIA_NEXT : MEDIA_PREVIOUS, frame->timestamp - frame->age);
+                            }
+                            break;
+                    }
                 }
-                else {
-                    if(dbg_level) printf("Sending sat exists\n");
-                    int send_buf[] = {0x07, 0x05, 0x8D, 0x22, 0x10, 0x00, 0x01};
-                    spi_send_data(fd, send_buf, 7);
-                    state = 0x00;
+                else if(frame->flags & J1850_FRAME_TX_REPORT) {
+                    if(seg_tx_report(&seg, frame)) {
+                        //Segmented messages look after their own frames
+                    }
+                    else if(frame->data[0] != J1850_TX_SENT) {
+                        printf("Bus %i message %i not sent, status %i after %i arbitration losses\n", frame->bus, frame->id, frame->data[0], frame->data[1]);
+                    }
+                    else if(dbg_level) printf("Bus %i message %i sent after %i arbitration losses, %u us ago\n", frame->bus, frame->id, frame->data[1], frame->age);
                 }
-            }
-            if(state) {
-                if(rx_buf[0] == 0x3D && rx_buf[1] == 0x12 && rx_buf[2] == 0x83) {
-                    if(rx_buf[3] == 0x26) dbus_method(connection, device, "Next");
-                    else if(rx_buf[3] == 0x27) dbus_method(connection, device, "Previous");
+                else if(frame->flags & J1850_FRAME_STATUS) {
+                    //Do power pins, the file only needs touching when they change
+                    if(frame->data[2] & J1850_SNAP_PWR) {
+                        ret = update_pwr_file(frame->data[1] & 0x01);
+                        if(ret < 0) printf("Error processing power: %i\n", ret);
+                    }
                 }
+                else {
+                    if(dbg_level) print_frame(frame);
+                    const obd_pid_t *pid = obd_rx(&obd, frame);
+                    if(pid && dbg_level) {
+                        int i;
+                        printf("OBD %.2X %.2X from %.2X:", pid->mode, pid->pid, pid->source);
+                        for(i=0; i<pid->len; i++) printf(" %.2X", pid->value[i]);
+                        printf("\n");
+                    }
+                    if(seg_rx(&seg, frame, &seg_msg) > 0 && dbg_level) {
+                        printf("Bus %i channel %i: %.*s\n", seg_msg.bus, seg_msg.channel, seg_msg.bytes, seg_msg.payload);
+                    }
+                    sigdb_decode(&sigdb, frame);
+                }
+                
+                j1850_ring_pop(&board->io.rx);
             }
         }
         
-        //Get J1850 bus 1 messages
-        ret = get_j1850_msg(fd, 1, rx_buf);
-        if(ret < 0) printf("Error retrieving bus 1 messages: %i\n", ret);
+        //Scroll display text and keep segmented messages moving as their frames go out
+        state = sat_active();
+        disp_set_active(&disp, state);
+        disp_service(&disp, &seg);
+        seg_service(&seg, &boards);
+        obd_service(&obd, &boards);
         
         //1000ms timer
-        if(tmr_10ms > 100) {
-            tmr_10ms = 0;
+        if(j1850_now_us() - last_1s >= 1000000) {
+            last_1s = j1850_now_us();
             
             int nodev = 0;
             if(device[0] == 0) nodev = 1;
@@ -742,18 +733,24 @@ int main(int argc, char *argv[])
             get_device(connection, &error, device);
             if(dbus_error_is_set(&error)) printf("%s", error.message);
             
-            if(device[0] && nodev) dbus_method(connection, device, "Play");
+            if(device[0] && nodev) media_command(&media, MEDIA_PLAY, 0);
             
-            if(sw_state == 0) update_sw(fd, 0x00, 0x00);
+            for(b=0; b<boards.nboards; b++) {
+                board_t *board = &boards.boards[b];
+                if(board->sw_state == 0) {
+                    board->last_sw_state = 0;
+                    update_sw(board);
+                }
+            }
             
             if(state != last_state) {
                 last_state = state;
                 if(state) {
-                    send_info(fd, "Playing Bluetooth", 0x00);
-                    dbus_method(connection, device, "Play");
+                    disp_set(&disp, 0x00, "Playing Bluetooth");
+                    media_command(&media, MEDIA_PLAY, 0);
                 }
                 else {
-                    dbus_method(connection, device, "Pause");
+                    media_command(&media, MEDIA_PAUSE, 0);
                 }
             }
             if(state) {
@@ -763,10 +760,10 @@ int main(int argc, char *argv[])
 				if(dbus_error_is_set(&error)) printf("%s", error.message);
 				
 				if(song) {
-                    send_info(fd, song, 0x04);
+                    disp_set(&disp, 0x04, song);
                 }
                 else {
-                    send_info(fd, " ", 0x04);
+                    disp_set(&disp, 0x04, " ");
                 }
 				
 				char *album = NULL;
@@ -775,48 +772,51 @@ int main(int argc, char *argv[])
 				if(dbus_error_is_set(&error)) printf("%s", error.message);
 				
 				if(album) {
-                    send_info(fd, album, 0x01);
+                    disp_set(&disp, 0x01, album);
 				}
 				else {
-                    send_info(fd, " ", 0x01);
+                    disp_set(&disp, 0x01, " ");
                 }
-                
+				
 				char *artist = NULL;
 				dbus_error_init(&error);
 				get_track_parameter(connection, device, &error, "Artist", &artist);
 				if(dbus_error_is_set(&error)) printf("%s", error.message);
 				
 				if(artist) {
-                    send_info(fd, artist, 0x05);
+                    disp_set(&disp, 0x05, artist);
 				}
                 else {
-                    send_info(fd, " ", 0x05);
+                    disp_set(&disp, 0x05, " ");
                 }
-				
-                send_info(fd, " ", 0x02);
+                
+                disp_set(&disp, 0x02, " ");
             }
         }
         
-        //Do power pins
-        while(spi_get_data(fd, rx_buf) > 0);
-        tx_buf[0] = 0x02;
-        ret = spi_send_data(fd, tx_buf, 1);
-        if(ret < 0) printf("Error sending power command: %i\n", ret);
-        ret = spi_get_response(fd, rx_buf);
-        if(ret < 0) printf("Error getting power response: %i\n", ret);
-        ret = update_pwr_file(rx_buf[0] & 0x01);
-        if(ret < 0) printf("Error processing power: %i\n", ret);
-        
         //Done
         fflush(stdout);
-        nanosleep((const struct timespec[]){{0, 10000000L}}, NULL);
-        tmr_10ms ++;
+    }
+    
+    board_stop(&boards);
+    for(i=0; i<boards.nboards; i++) {
+        io_thread_t *io = &boards.boards[i].io;
+        if(dbg_level || io->resyncs || io->board_resets || io->tx_dropped) {
+            printf("%s: SPI link recovered %u times, longest %llu us, %u resyncs, down %u times, board reset %u times, %u frames dropped\n", boards.boards[i].dev.device,
+                   io->recoveries, (unsigned long long)io->recovery_max_us, io->resyncs, io->link_downs, io->board_resets, io->tx_dropped);
+        }
+    }
+    media_free(&media);
+    if(dbg_level) printf("Media: %u calls, %u done, %u retried, %u failed, %u coalesced\n", media.calls, media.completed, media.retried, media.failed, media.coalesced);
+    if(fanout.header) fanout_destroy(&fanout, FANOUT_NAME);
+    sigdb_free(&sigdb);
+    if(telemetry_dir) {
+        tstore_stop(&tstore);
+        if(dbg_level) printf("Telemetry: %u chunks, %llu bytes of samples written in %llu, %u dropped\n", tstore.chunks, (unsigned long long)tstore.raw_bytes, (unsigned long long)tstore.written_bytes, tstore.dropped);
     }
     
     ret = update_pwr_file(0x01);
     if(ret < 0) printf("Error cleaning up power: %i\n", ret);
-        
-    close(fd);
     
     exit(EXIT_SUCCESS);
 }
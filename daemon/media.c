@@ -0,0 +1,203 @@
+/*
+ * media.c - Queued transport commands to the Bluetooth media player
+ *
+ * Commands go out one D-Bus call at a time, each tracked to its reply. While
+ * one's waiting, more of the same kind fold into what's queued: seeks add up
+ * into one count of tracks to skip, forward and back cancelling out, and play
+ * or pause only keeps the latest. Calls that fail for a reason that might pass
+ * are tried again shortly after.
+ *
+ * Only ever used from the daemon's main thread, replies come back through
+ * dbus_connection_dispatch().
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dbus/dbus.h>
+#include "j1850.h"
+#include "latency.h"
+#include "media.h"
+
+static void send_call(media_t *media);
+
+void media_init(media_t *media, DBusConnection *connection, const char *device) {
+    memset(media, 0, sizeof *media);
+    media->connection = connection;
+    media->device = device;
+}
+
+/*
+ * Gives up on the call in flight, there's no reply coming that matters now
+ */
+void media_free(media_t *media) {
+    if(media->pending) {
+        dbus_pending_call_cancel(media->pending);
+        dbus_pending_call_unref(media->pending);
+    }
+    media->pending = NULL;
+    media->nqueued = 0;
+}
+
+static const char *method_name(const media_cmd_t *cmd) {
+    switch(cmd->command) {
+        case MEDIA_PLAY: return "Play";
+        case MEDIA_PAUSE: return "Pause";
+        default: return cmd->skip > 0 ? "Next" : "Previous";
+    }
+}
+
+static void pop_queue(media_t *media) {
+    media->nqueued --;
+    memmove(&media->queue[0], &media->queue[1], media->nqueued * sizeof media->queue[0]);
+}
+
+static void call_failed(media_t *media, const char *error, int retry) {
+    if(retry && media->inflight.attempts <= MEDIA_RETRIES) {
+        media->retrying = 1;
+        media->retry_at = j1850_now_us() + MEDIA_RETRY_US;
+        media->retried ++;
+    }
+    else {
+        printf("Media %s failed: %s\n", method_name(&media->inflight), error);
+        media->failed ++;
+    }
+}
+
+static void call_done(DBusPendingCall *pending, void *data) {
+    media_t *media = data;
+    DBusMessage *reply = dbus_pending_call_steal_reply(pending);
+    uint64_t now = j1850_now_us();
+    
+    dbus_pending_call_unref(pending);
+    media->pending = NULL;
+    
+    if(reply == NULL) call_failed(media, "no reply", 1);
+    else if(dbus_message_get_type(reply) == DBUS_MESSAGE_TYPE_ERROR) {
+        const char *error = dbus_message_get_error_name(reply);
+        //No player to ask, asking again won't bring one back
+        int retry = strcmp(error, DBUS_ERROR_UNKNOWN_OBJECT) != 0 && strcmp(error, DBUS_ERROR_UNKNOWN_METHOD) != 0 && strcmp(error, DBUS_ERROR_SERVICE_UNKNOWN) != 0;
+        call_failed(media, error, retry);
+    }
+    else {
+        lat_record(LAT_DBUS_DONE, now - media->sent);
+        if(media->inflight.origin) lat_record(LAT_BUTTON_TOTAL, now - media->inflight.origin);
+        media->completed ++;
+    }
+    if(reply) dbus_message_unref(reply);
+    
+    //Straight on to whatever queued up meanwhile
+    media_service(media);
+}
+
+static void send_call(media_t *media) {
+    DBusMessage *msg;
+    char path[100];
+    
+    snprintf(path, sizeof path, "/org/bluez/hci0/%s/player0", media->device);
+    media->inflight.attempts ++;
+    
+    msg = dbus_message_new_method_call("org.bluez", path, "org.bluez.MediaPlayer1", method_name(&media->inflight));
+    if(msg == NULL) {
+        call_failed(media, "out of memory", 1);
+        return;
+    }
+    
+    if(!dbus_connection_send_with_reply(media->connection, msg, &media->pending, MEDIA_TIMEOUT_MS) || media->pending == NULL) {
+        media->pending = NULL;
+        dbus_message_unref(msg);
+        call_failed(media, "not connected", 1);
+        return;
+    }
+    dbus_message_unref(msg);
+    
+    media->sent = j1850_now_us();
+    media->calls ++;
+    //Nothing's dispatched until the main loop gets back round, so the reply can't beat this
+    dbus_pending_call_set_notify(media->pending, call_done, media, NULL);
+    dbus_connection_flush(media->connection);
+}
+
+/*
+ * Queues a MEDIA_ command, origin is when the bus event that asked for it
+ * happened or 0. Goes out straight away if nothing's waiting on a reply
+ */
+int media_command(media_t *media, int command, uint64_t origin) {
+    media_cmd_t *tail = media->nqueued ? &media->queue[media->nqueued - 1] : NULL;
+    int skip = 0;
+    
+    if(command < 0 || command >= MEDIA_COMMANDS) return -1;
+    if(command == MEDIA_NEXT || command == MEDIA_PREVIOUS) {
+        skip = command == MEDIA_NEXT ? 1 : -1;
+        command = MEDIA_NEXT;
+    }
+    
+    if(command == MEDIA_NEXT && tail && tail->command == MEDIA_NEXT) {
+        if(abs(tail->skip + skip) <= MEDIA_SKIP_MAX) tail->skip += skip;
+        if(tail->skip == 0) media->nqueued --;
+        media->coalesced ++;
+    }
+    else if(command != MEDIA_NEXT && tail && tail->command != MEDIA_NEXT) {
+        tail->command = command;
+        media->coalesced ++;
+    }
+    else if(command != MEDIA_NEXT && tail == NULL && (media->pending || media->retrying) && media->inflight.command == command) {
+        //Already on its way
+        media->coalesced ++;
+    }
+    else if(media->nqueued == MEDIA_QUEUE_SIZE) {
+        printf("Media queue full, dropping command\n");
+        return -1;
+    }
+    else {
+        media_cmd_t *cmd = &media->queue[media->nqueued++];
+        cmd->command = command;
+        cmd->skip = skip;
+        cmd->origin = origin;
+        cmd->queued = j1850_now_us();
+        cmd->attempts = 0;
+    }
+    
+    media_service(media);
+    return 0;
+}
+
+/*
+ * Sends the next command when the last one's done with, or tries a failed one again
+ */
+void media_service(media_t *media) {
+    uint64_t now = j1850_now_us();
+    media_cmd_t *head = &media->queue[0];
+    
+    if(media->pending) return;
+    
+    //No player to send to, what's waiting would be stale by the time there is one
+    if(media->device[0] == 0) {
+        media->nqueued = 0;
+        media->retrying = 0;
+        return;
+    }
+    
+    if(media->retrying) {
+        if((int64_t)(now - media->retry_at) < 0) return;
+        media->retrying = 0;
+        send_call(media);
+        return;
+    }
+    
+    if(media->nqueued == 0) return;
+    
+    media->inflight = *head;
+    if(head->command == MEDIA_NEXT) {
+        //Skips go one track a call, the bus event only started the first
+        media->inflight.skip = head->skip > 0 ? 1 : -1;
+        head->skip -= media->inflight.skip;
+        head->origin = 0;
+        if(head->skip == 0) pop_queue(media);
+    }
+    else pop_queue(media);
+    
+    lat_record(LAT_MEDIA_QUEUED, now - media->inflight.queued);
+    send_call(media);
+}
@@ -0,0 +1,69 @@
+/*
+ * media.h - Queued transport commands to the Bluetooth media player
+ */
+
+#ifndef __MEDIA_H__
+#define __MEDIA_H__
+
+#include <stdint.h>
+#include <dbus/dbus.h>
+
+#define MEDIA_QUEUE_SIZE 8
+//A held down seek button only skips so far ahead of the player
+#define MEDIA_SKIP_MAX 8
+#define MEDIA_TIMEOUT_MS 1000
+#define MEDIA_RETRIES 2
+#define MEDIA_RETRY_US 200000
+
+enum {
+    MEDIA_PLAY,
+    MEDIA_PAUSE,
+    MEDIA_NEXT,
+    MEDIA_PREVIOUS,
+    MEDIA_COMMANDS
+};
+
+typedef struct media_cmd_t media_cmd_t;
+typedef struct media_t media_t;
+
+/*
+ * Play, pause or skip tracks, Next and Previous net out into one skip
+ */
+struct media_cmd_t {
+    int command;
+    //Tracks forward or back for MEDIA_NEXT, which covers both
+    int skip;
+    //Bus event that asked for it if any, for the latency from there
+    uint64_t origin;
+    uint64_t queued;
+    int attempts;
+};
+
+struct media_t {
+    DBusConnection *connection;
+    //Bluetooth device address as in its object path, empty with none
+    const char *device;
+    
+    media_cmd_t queue[MEDIA_QUEUE_SIZE];
+    int nqueued;
+    
+    //One call at a time so the player sees them in order
+    DBusPendingCall *pending;
+    media_cmd_t inflight;
+    uint64_t sent;
+    int retrying;
+    uint64_t retry_at;
+    
+    unsigned int calls;
+    unsigned int completed;
+    unsigned int retried;
+    unsigned int failed;
+    unsigned int coalesced;
+};
+
+void media_init(media_t *media, DBusConnection *connection, const char *device);
+void media_free(media_t *media);
+int media_command(media_t *media, int command, uint64_t origin);
+void media_service(media_t *media);
+
+#endif // __MEDIA_H__
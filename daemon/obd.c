@@ -0,0 +1,175 @@
+/*
+ * obd.c - OBD-II diagnostic queries over J1850 VPW
+ *
+ * Polls a set of mode/PID pairs, each at its own period. As many requests
+ * are kept going as the protocol allows, one per ECU for physical requests
+ * and only the one for a functional request, which every ECU may answer.
+ * The most overdue PID goes next, as often as the bus budget lets it.
+ *
+ * Only ever used from the daemon's main thread.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include "obd.h"
+
+void obd_init(obd_t *obd, int budget) {
+    memset(obd, 0, sizeof *obd);
+    obd->budget = budget;
+}
+
+/*
+ * Starts polling mode/PID at target on bus every period_ms
+ */
+int obd_add_pid(obd_t *obd, int bus, uint8_t target, uint8_t mode, uint8_t pid, int period_ms) {
+    obd_pid_t *p;
+    
+    if(obd->npids == OBD_MAX_PIDS || bus < 0 || period_ms <= 0) return -1;
+    
+    p = &obd->pids[obd->npids];
+    memset(p, 0, sizeof *p);
+    p->bus = bus;
+    p->target = target;
+    p->mode = mode;
+    p->pid = pid;
+    p->period = (uint64_t)period_ms * 1000;
+    obd->npids ++;
+    
+    return 0;
+}
+
+/*
+ * Whether a request to target on bus would overlap one that can't be overlapped
+ */
+static int target_busy(obd_t *obd, int bus, uint8_t target) {
+    int i;
+    
+    for(i=0; i<obd->npids; i++) {
+        obd_pid_t *p = &obd->pids[i];
+        if(!p->requested || p->bus != bus) continue;
+        if(p->target == OBD_FUNCTIONAL || target == OBD_FUNCTIONAL || p->target == target) return 1;
+    }
+    
+    return 0;
+}
+
+static void request_done(obd_t *obd, obd_pid_t *p) {
+    p->requested = 0;
+    obd->inflight --;
+}
+
+/*
+ * Times out unanswered requests and sends the next ones that are due
+ */
+void obd_service(obd_t *obd, board_set_t *boards) {
+    uint64_t now = j1850_now_us();
+    int i;
+    
+    for(i=0; i<obd->npids; i++) {
+        obd_pid_t *p = &obd->pids[i];
+        if(p->requested && now - p->requested > OBD_P2_US) {
+            p->timeouts ++;
+            request_done(obd, p);
+        }
+    }
+    
+    while(obd->inflight < OBD_MAX_INFLIGHT && (int64_t)(now - obd->next) >= 0) {
+        obd_pid_t *next = NULL;
+        uint64_t overdue = 0;
+        uint8_t data[5];
+        
+        for(i=0; i<obd->npids; i++) {
+            obd_pid_t *p = &obd->pids[i];
+            uint64_t since = now - p->last_request;
+            
+            if(p->unsupported || p->requested || (p->last_request && since < p->period)) continue;
+            if(target_busy(obd, p->bus, p->target)) continue;
+            
+            //Never asked for counts as the most overdue
+            if(p->last_request == 0) since = UINT64_MAX;
+            if(next == NULL || since - p->period > overdue) {
+                next = p;
+                overdue = since - p->period;
+            }
+        }
+        if(next == NULL) break;
+        
+        data[0] = next->target == OBD_FUNCTIONAL ? OBD_REQ_FUNCTIONAL : OBD_REQ_PHYSICAL;
+        data[1] = next->target;
+        data[2] = OBD_TESTER;
+        data[3] = next->mode;
+        data[4] = next->pid;
+        if(board_send(boards, IO_CLASS_PERIODIC, next->bus, data, sizeof data, 0) < 0) break;
+        
+        next->requested = now;
+        next->last_request = now;
+        obd->inflight ++;
+        obd->next = now + (uint64_t)OBD_EXCHANGE_BYTES * 1000000 / obd->budget;
+    }
+}
+
+/*
+ * Takes a received frame, returns the PID it updated if it was an answer
+ */
+const obd_pid_t *obd_rx(obd_t *obd, const j1850_frame_t *frame) {
+    const uint8_t *data = frame->data;
+    obd_pid_t *updated = NULL;
+    int i;
+    
+    if(frame->bytes < 6 || (frame->flags & J1850_FRAME_CRC_ERR)) return NULL;
+    if(!(data[0] == OBD_RESP_FUNCTIONAL && data[1] == OBD_RESP_TARGET) && !(data[0] == OBD_REQ_PHYSICAL && data[1] == OBD_TESTER)) return NULL;
+    
+    uint8_t source = data[2];
+    
+    //Negative response, the mode and PID asked for then the reason
+    if(data[3] == OBD_NEGATIVE) {
+        if(frame->bytes < 8) return NULL;
+        
+        for(i=0; i<obd->npids; i++) {
+            obd_pid_t *p = &obd->pids[i];
+            if(p->bus != frame->bus || p->mode != data[4] || p->pid != data[5] || (p->target != OBD_FUNCTIONAL && p->target != source)) continue;
+            
+            //Service or sub function not supported, stop asking
+            if(data[6] == 0x11 || data[6] == 0x12) p->unsupported = 1;
+            if(p->requested) request_done(obd, p);
+        }
+        
+        return NULL;
+    }
+    
+    if(!(data[3] & OBD_RESP_OFFSET)) return NULL;
+    
+    uint8_t mode = data[3] & ~OBD_RESP_OFFSET;
+    int len = frame->bytes - 6;
+    
+    for(i=0; i<obd->npids; i++) {
+        obd_pid_t *p = &obd->pids[i];
+        if(p->bus != frame->bus || p->mode != mode || p->pid != data[4] || (p->target != OBD_FUNCTIONAL && p->target != source)) continue;
+        
+        p->stamp = frame->timestamp;
+        p->source = source;
+        p->len = len;
+        memcpy(p->value, &data[5], len);
+        p->samples ++;
+        if(p->requested) request_done(obd, p);
+        updated = p;
+    }
+    
+    return updated;
+}
+
+/*
+ * The last value of mode/PID from target on bus, NULL if there isn't one
+ * fresher than its period
+ */
+const obd_pid_t *obd_get(obd_t *obd, int bus, uint8_t target, uint8_t mode, uint8_t pid) {
+    uint64_t now = j1850_now_us();
+    int i;
+    
+    for(i=0; i<obd->npids; i++) {
+        obd_pid_t *p = &obd->pids[i];
+        if(p->bus == bus && p->target == target && p->mode == mode && p->pid == pid && p->stamp && now - p->stamp <= p->period) return p;
+    }
+    
+    return NULL;
+}
@@ -0,0 +1,74 @@
+/*
+ * obd.h - OBD-II diagnostic queries over J1850 VPW
+ */
+
+#ifndef __OBD_H__
+#define __OBD_H__
+
+#include <stdint.h>
+#include "j1850.h"
+#include "board.h"
+
+//Requests go out functional to every ECU or physical to one, from the tester
+#define OBD_REQ_FUNCTIONAL 0x68
+#define OBD_REQ_PHYSICAL 0x6C
+#define OBD_FUNCTIONAL 0x6A
+#define OBD_TESTER 0xF1
+//Responses to functional requests come back to 0x6B, physical ones to the tester
+#define OBD_RESP_FUNCTIONAL 0x48
+#define OBD_RESP_TARGET 0x6B
+#define OBD_RESP_OFFSET 0x40
+#define OBD_NEGATIVE 0x7F
+
+#define OBD_MAX_PIDS 32
+//Physical requests to different ECUs can overlap, a functional one has the bus to itself
+#define OBD_MAX_INFLIGHT 4
+//How long an ECU has to answer
+#define OBD_P2_US 100000
+//Header, mode and PID leave this much of a frame for the value
+#define OBD_VALUE_MAX (J1850_MSG_SIZE - 6)
+//A request and a typical answer, for the bus budget
+#define OBD_EXCHANGE_BYTES 14
+
+typedef struct obd_pid_t obd_pid_t;
+typedef struct obd_t obd_t;
+
+struct obd_pid_t {
+    //Daemon wide bus it's asked on, and OBD_FUNCTIONAL or an ECU's address
+    int bus;
+    uint8_t target;
+    uint8_t mode;
+    uint8_t pid;
+    //How often it's asked for and how long the value counts as fresh
+    uint64_t period;
+    int unsupported;
+    
+    uint64_t requested;
+    uint64_t last_request;
+    
+    uint64_t stamp;
+    uint8_t source;
+    uint8_t len;
+    uint8_t value[OBD_VALUE_MAX];
+    
+    unsigned int samples;
+    unsigned int timeouts;
+};
+
+struct obd_t {
+    //Bus bytes a second the queries can take, across every bus they go out on
+    int budget;
+    uint64_t next;
+    int inflight;
+    
+    obd_pid_t pids[OBD_MAX_PIDS];
+    int npids;
+};
+
+void obd_init(obd_t *obd, int budget);
+int obd_add_pid(obd_t *obd, int bus, uint8_t target, uint8_t mode, uint8_t pid, int period_ms);
+void obd_service(obd_t *obd, board_set_t *boards);
+const obd_pid_t *obd_rx(obd_t *obd, const j1850_frame_t *frame);
+const obd_pid_t *obd_get(obd_t *obd, int bus, uint8_t target, uint8_t mode, uint8_t pid);
+
+#endif // __OBD_H__
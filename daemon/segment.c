@@ -0,0 +1,279 @@
+/*
+ * segment.c - Payloads longer than one J1850 frame, split up and put back together
+ *
+ * Sending, each bus works through its streams oldest first, keeping no more
+ * frames on the micro than its transmit queue holds and moving on as the
+ * transmit reports come back. A stream that loses a frame starts over.
+ * Receiving, frames are put back together per bus, scheme and channel until
+ * the last one turns up or they go stale.
+ *
+ * Only ever used from the daemon's main thread.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "segment.h"
+
+void seg_init(seg_t *seg) {
+    memset(seg, 0, sizeof *seg);
+}
+
+/*
+ * Puts frames matching scheme on bus back together in seg_rx()
+ */
+int seg_listen(seg_t *seg, int bus, const seg_scheme_t *scheme) {
+    if(seg->nrx_schemes == SEG_RX_SCHEMES) return -1;
+    
+    seg->rx_schemes[seg->nrx_schemes] = scheme;
+    seg->rx_busses[seg->nrx_schemes] = bus;
+    seg->nrx_schemes ++;
+    
+    return 0;
+}
+
+/*
+ * Queues payload to go out on bus in an IO_CLASS_ traffic class. One still waiting to start on the same
+ * bus, scheme and channel is replaced, so only the latest of a run of
+ * updates goes out
+ */
+int seg_send(seg_t *seg, int class, int bus, const seg_scheme_t *scheme, uint8_t channel, const uint8_t *payload, int bytes) {
+    seg_tx_t *stream = NULL;
+    int i;
+    
+    //Header, sequence byte and chunk have to leave room for the CRC
+    if(scheme->chunk == 0 || scheme->header_bytes + 1 + scheme->chunk > J1850_MSG_SIZE - 1) return -1;
+    if(bytes < 0 || bytes > SEG_MAX_FRAMES * scheme->chunk || channel > SEG_SEQ_CHANNEL) return -1;
+    
+    for(i=0; i<SEG_TX_STREAMS; i++) {
+        seg_tx_t *tx = &seg->tx[i];
+        if(tx->active && tx->queued == 0 && tx->bus == bus && tx->scheme == scheme && tx->channel == channel) {
+            stream = tx;
+            break;
+        }
+    }
+    for(i=0; i<SEG_TX_STREAMS && stream == NULL; i++) {
+        if(!seg->tx[i].active) {
+            stream = &seg->tx[i];
+            stream->order = seg->order ++;
+        }
+    }
+    if(stream == NULL) {
+        printf("Bus %i segment queue full, dropping message\n", bus);
+        return -1;
+    }
+    
+    stream->active = 1;
+    stream->scheme = scheme;
+    stream->class = class;
+    stream->bus = bus;
+    stream->channel = channel;
+    stream->bytes = bytes;
+    memcpy(stream->payload, payload, bytes);
+    
+    //Always at least one frame, even if it's all padding
+    stream->nframes = (bytes + scheme->chunk - 1) / scheme->chunk;
+    if(stream->nframes == 0) stream->nframes = 1;
+    stream->queued = 0;
+    stream->sent = 0;
+    stream->attempts = 0;
+    stream->progress = j1850_now_us();
+    memset(stream->ids, 0, sizeof stream->ids);
+    
+    return 0;
+}
+
+/*
+ * A frame didn't make it, so the stream goes again from the start
+ */
+static void tx_failed(seg_t *seg, seg_tx_t *stream) {
+    stream->attempts ++;
+    if(stream->attempts >= SEG_TX_ATTEMPTS) {
+        printf("Bus %i segmented message on channel %i not sent, giving up\n", stream->bus, stream->channel);
+        seg->tx_failures ++;
+        stream->active = 0;
+        return;
+    }
+    
+    stream->queued = 0;
+    stream->sent = 0;
+    stream->progress = j1850_now_us();
+    memset(stream->ids, 0, sizeof stream->ids);
+}
+
+/*
+ * Whether stream is the oldest one going on its bus
+ */
+static int tx_is_head(seg_t *seg, seg_tx_t *stream) {
+    int i;
+    
+    for(i=0; i<SEG_TX_STREAMS; i++) {
+        seg_tx_t *tx = &seg->tx[i];
+        if(tx->active && tx->bus == stream->bus && (int)(tx->order - stream->order) < 0) return 0;
+    }
+    
+    return 1;
+}
+
+/*
+ * Hands the IO thread as many frames as the window allows
+ */
+void seg_service(seg_t *seg, board_set_t *boards) {
+    uint64_t now = j1850_now_us();
+    int i;
+    
+    for(i=0; i<SEG_TX_STREAMS; i++) {
+        seg_tx_t *stream = &seg->tx[i];
+        const seg_scheme_t *scheme = stream->scheme;
+        
+        if(!stream->active || !tx_is_head(seg, stream)) continue;
+        
+        //Reports can go missing, don't wait forever on them
+        if(stream->queued && now - stream->progress > SEG_TX_STALL_US) {
+            tx_failed(seg, stream);
+            if(!stream->active) continue;
+        }
+        
+        while(stream->queued < stream->nframes && stream->queued - stream->sent < SEG_TX_WINDOW) {
+            uint8_t data[J1850_MSG_SIZE];
+            int offset = stream->queued * scheme->chunk;
+            int len = stream->bytes - offset;
+            int id;
+            
+            if(len > scheme->chunk) len = scheme->chunk;
+            if(len < 0) len = 0;
+            
+            memcpy(data, scheme->header, scheme->header_bytes);
+            data[scheme->header_bytes] = ((stream->nframes - stream->queued) << 4) | stream->channel;
+            if(stream->queued == 0) data[scheme->header_bytes] |= SEG_SEQ_FIRST;
+            memcpy(&data[scheme->header_bytes + 1], &stream->payload[offset], len);
+            memset(&data[scheme->header_bytes + 1 + len], scheme->pad, scheme->chunk - len);
+            
+            id = board_send_tracked(boards, stream->class, stream->bus, data, scheme->header_bytes + 1 + scheme->chunk, 0, SEG_FRAME_RETRIES, SEG_FRAME_TIMEOUT_MS);
+            if(id < 0) break;
+            
+            stream->ids[stream->queued] = id;
+            stream->queued ++;
+        }
+    }
+}
+
+/*
+ * Takes a transmit report, returns 1 if it was for a stream's frame
+ */
+int seg_tx_report(seg_t *seg, const j1850_frame_t *frame) {
+    int i, j;
+    
+    if(frame->id == 0) return 0;
+    
+    for(i=0; i<SEG_TX_STREAMS; i++) {
+        seg_tx_t *stream = &seg->tx[i];
+        if(!stream->active || stream->bus != frame->bus) continue;
+        
+        for(j=0; j<stream->queued; j++) {
+            if(stream->ids[j] != frame->id) continue;
+            
+            stream->ids[j] = 0;
+            if(frame->data[0] != J1850_TX_SENT) {
+                tx_failed(seg, stream);
+                return 1;
+            }
+            
+            stream->sent ++;
+            stream->progress = j1850_now_us();
+            if(stream->sent == stream->nframes) stream->active = 0;
+            return 1;
+        }
+    }
+    
+    return 0;
+}
+
+/*
+ * Takes a received frame. Returns 1 with msg filled in once the last frame of
+ * a payload is in, 0 if the frame was part of one, -1 if it wasn't. The
+ * payload keeps the padding of its last frame
+ */
+int seg_rx(seg_t *seg, const j1850_frame_t *frame, seg_msg_t *msg) {
+    const seg_scheme_t *scheme = NULL;
+    seg_rx_t *stream = NULL;
+    seg_rx_t *free_stream = NULL;
+    uint64_t now = j1850_now_us();
+    int i;
+    
+    for(i=0; i<seg->nrx_schemes; i++) {
+        const seg_scheme_t *rx_scheme = seg->rx_schemes[i];
+        
+        if(seg->rx_busses[i] != frame->bus || frame->bytes < rx_scheme->header_bytes + 2) continue;
+        if(memcmp(frame->data, rx_scheme->header, rx_scheme->header_bytes) == 0) {
+            scheme = rx_scheme;
+            break;
+        }
+    }
+    if(scheme == NULL) return -1;
+    
+    uint8_t seq = frame->data[scheme->header_bytes];
+    uint8_t channel = seq & SEG_SEQ_CHANNEL;
+    int left = seq >> 4;
+    int len = frame->bytes - scheme->header_bytes - 2;
+    
+    for(i=0; i<SEG_RX_STREAMS; i++) {
+        seg_rx_t *rx = &seg->rx[i];
+        
+        if(rx->active && (int64_t)(now - rx->deadline) > 0) {
+            seg->rx_timeouts ++;
+            rx->active = 0;
+        }
+        
+        if(!rx->active) {
+            if(free_stream == NULL) free_stream = rx;
+        }
+        else if(rx->bus == frame->bus && rx->scheme == scheme && rx->channel == channel) stream = rx;
+    }
+    
+    if(frame->flags & J1850_FRAME_CRC_ERR) {
+        seg->rx_errors ++;
+        if(stream) stream->active = 0;
+        return 0;
+    }
+    
+    if(seq & SEG_SEQ_FIRST) {
+        //A new first frame starts over whatever was there
+        if(stream == NULL) stream = free_stream;
+        if(stream == NULL || left == 0) {
+            seg->rx_errors ++;
+            return 0;
+        }
+        
+        stream->active = 1;
+        stream->scheme = scheme;
+        stream->bus = frame->bus;
+        stream->channel = channel;
+        stream->left = left;
+        stream->msg.timestamp = frame->timestamp;
+        stream->msg.age = frame->age;
+        stream->msg.bus = frame->bus;
+        stream->msg.channel = channel;
+        stream->msg.scheme = scheme;
+        stream->msg.bytes = 0;
+    }
+    else if(stream == NULL || left != stream->left) {
+        //Missed a frame or never saw the first, wait for the next first frame
+        seg->rx_errors ++;
+        if(stream) stream->active = 0;
+        return 0;
+    }
+    
+    if(stream->msg.bytes + len > SEG_MAX_PAYLOAD) len = SEG_MAX_PAYLOAD - stream->msg.bytes;
+    memcpy(&stream->msg.payload[stream->msg.bytes], &frame->data[scheme->header_bytes + 1], len);
+    stream->msg.bytes += len;
+    stream->left --;
+    stream->deadline = now + SEG_RX_TIMEOUT_US;
+    
+    if(stream->left) return 0;
+    
+    stream->active = 0;
+    memcpy(msg, &stream->msg, sizeof *msg);
+    
+    return 1;
+}
@@ -0,0 +1,108 @@
+/*
+ * segment.h - Payloads longer than one J1850 frame, split up and put back together
+ */
+
+#ifndef __SEGMENT_H__
+#define __SEGMENT_H__
+
+#include <stdint.h>
+#include "j1850.h"
+#include "board.h"
+
+//Every frame is the scheme's header, a sequence byte, then a chunk of payload.
+//The sequence byte's high nibble is how many frames are left including this
+//one, 0x08 marks the first frame and the low three bits are the channel
+#define SEG_SEQ_FIRST 0x08
+#define SEG_SEQ_CHANNEL 0x07
+#define SEG_MAX_FRAMES 15
+#define SEG_MAX_CHUNK (J1850_MSG_SIZE - 2)
+#define SEG_MAX_PAYLOAD (SEG_MAX_FRAMES * SEG_MAX_CHUNK)
+
+#define SEG_TX_STREAMS 8
+#define SEG_RX_STREAMS 8
+#define SEG_RX_SCHEMES 4
+
+//Frames of a stream on the micro at once, its transmit queue holds 4
+#define SEG_TX_WINDOW 4
+#define SEG_TX_ATTEMPTS 2
+#define SEG_TX_STALL_US 1000000
+#define SEG_FRAME_RETRIES 3
+#define SEG_FRAME_TIMEOUT_MS 200
+#define SEG_RX_TIMEOUT_US 500000
+
+typedef struct seg_scheme_t seg_scheme_t;
+typedef struct seg_msg_t seg_msg_t;
+typedef struct seg_tx_t seg_tx_t;
+typedef struct seg_rx_t seg_rx_t;
+typedef struct seg_t seg_t;
+
+struct seg_scheme_t {
+    uint8_t header[3];
+    uint8_t header_bytes;
+    //Payload bytes per frame, the last one is filled out with pad
+    uint8_t chunk;
+    uint8_t pad;
+};
+
+struct seg_msg_t {
+    uint64_t timestamp;
+    uint32_t age;
+    uint8_t bus;
+    uint8_t channel;
+    const seg_scheme_t *scheme;
+    int bytes;
+    uint8_t payload[SEG_MAX_PAYLOAD];
+};
+
+struct seg_tx_t {
+    int active;
+    unsigned int order;
+    const seg_scheme_t *scheme;
+    int class;
+    uint8_t bus;
+    uint8_t channel;
+    int bytes;
+    uint8_t payload[SEG_MAX_PAYLOAD];
+    
+    //Frames handed to the IO thread, reported sent, and their ids
+    int nframes;
+    int queued;
+    int sent;
+    uint8_t ids[SEG_MAX_FRAMES];
+    int attempts;
+    uint64_t progress;
+};
+
+struct seg_rx_t {
+    int active;
+    const seg_scheme_t *scheme;
+    uint8_t bus;
+    uint8_t channel;
+    int left;
+    uint64_t deadline;
+    seg_msg_t msg;
+};
+
+struct seg_t {
+    seg_tx_t tx[SEG_TX_STREAMS];
+    seg_rx_t rx[SEG_RX_STREAMS];
+    unsigned int order;
+    
+    //What to put back together on receive
+    const seg_scheme_t *rx_schemes[SEG_RX_SCHEMES];
+    uint8_t rx_busses[SEG_RX_SCHEMES];
+    int nrx_schemes;
+    
+    unsigned int tx_failures;
+    unsigned int rx_timeouts;
+    unsigned int rx_errors;
+};
+
+void seg_init(seg_t *seg);
+int seg_listen(seg_t *seg, int bus, const seg_scheme_t *scheme);
+int seg_send(seg_t *seg, int class, int bus, const seg_scheme_t *scheme, uint8_t channel, const uint8_t *payload, int bytes);
+void seg_service(seg_t *seg, board_set_t *boards);
+int seg_tx_report(seg_t *seg, const j1850_frame_t *frame);
+int seg_rx(seg_t *seg, const j1850_frame_t *frame, seg_msg_t *msg);
+
+#endif // __SEGMENT_H__
@@ -0,0 +1,480 @@
+/*
+ * sigdb.c - Vehicle message definitions compiled into a signal decoder
+ *
+ * Definitions are plain text, one message and then its signals:
+ *
+ *   # Engine speed from an OBD-II mode 01 answer
+ *   message engine_rpm bus=0 match=48,6B,*,41,0C
+ *       signal rpm byte=5 len=16 scale=0.25 unit=rpm
+ *
+ * match is the frame's leading bytes in hex, * for any. A signal is len bits,
+ * big endian from byte, ending bit bits up from the bottom of its last byte,
+ * optionally signed, then scaled and offset.
+ *
+ * Compiling turns each set of wildcards into a perfect hash on the bus and
+ * first SIGDB_KEY_BYTES bytes, so a frame is a handful of table lookups, and
+ * each signal into a precomputed read, shift and mask.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sigdb.h"
+
+//Displacements to try per bucket before giving up on a table
+#define SIGDB_MAX_DISP 65536
+
+void sigdb_init(sigdb_t *db) {
+    memset(db, 0, sizeof *db);
+}
+
+static void free_tables(sigdb_t *db) {
+    int i;
+    
+    for(i=0; i<db->ntables; i++) {
+        free(db->tables[i].disp);
+        free(db->tables[i].keys);
+        free(db->tables[i].entries);
+    }
+    memset(db->tables, 0, sizeof db->tables);
+    db->ntables = 0;
+}
+
+void sigdb_free(sigdb_t *db) {
+    free_tables(db);
+}
+
+static int parse_message(sigdb_t *db, const char *name, int line, char **save) {
+    sigdb_message_t *msg;
+    char *token;
+    int i;
+    
+    if(db->nmessages == SIGDB_MAX_MESSAGES) {
+        printf("%s:%i: Too many messages\n", name, line);
+        return -1;
+    }
+    
+    msg = &db->messages[db->nmessages];
+    memset(msg, 0, sizeof *msg);
+    msg->first_signal = db->nsignals;
+    msg->next = -1;
+    
+    token = strtok_r(NULL, " \t\r", save);
+    if(token == NULL) {
+        printf("%s:%i: Message needs a name\n", name, line);
+        return -1;
+    }
+    snprintf(msg->name, sizeof msg->name, "%s", token);
+    
+    while((token = strtok_r(NULL, " \t\r", save)) != NULL) {
+        if(strncmp(token, "bus=", 4) == 0) msg->bus = strtoul(token + 4, NULL, 0);
+        else if(strncmp(token, "match=", 6) == 0) {
+            char *byte = token + 6;
+            while(*byte && msg->match_bytes < J1850_MSG_SIZE - 1) {
+                if(*byte == '*') byte ++;
+                else {
+                    msg->match[msg->match_bytes] = strtoul(byte, &byte, 16);
+                    msg->match_mask[msg->match_bytes] = 0xFF;
+                }
+                msg->match_bytes ++;
+                if(*byte == ',') byte ++;
+                else if(*byte) break;
+            }
+            if(*byte) {
+                printf("%s:%i: Bad match %s\n", name, line, token);
+                return -1;
+            }
+        }
+        else {
+            printf("%s:%i: Unknown message option %s\n", name, line, token);
+            return -1;
+        }
+    }
+    
+    if(msg->match_bytes == 0) {
+        printf("%s:%i: Message %s needs a match\n", name, line, msg->name);
+        return -1;
+    }
+    
+    //The bus always counts, bytes only where they aren't wildcards
+    msg->key = (uint64_t)msg->bus << (8*SIGDB_KEY_BYTES);
+    msg->key_mask = (uint64_t)0xFF << (8*SIGDB_KEY_BYTES);
+    for(i=0; i<SIGDB_KEY_BYTES && i<msg->match_bytes; i++) {
+        msg->key |= (uint64_t)(msg->match[i] & msg->match_mask[i]) << (8*(SIGDB_KEY_BYTES-1-i));
+        msg->key_mask |= (uint64_t)msg->match_mask[i] << (8*(SIGDB_KEY_BYTES-1-i));
+    }
+    msg->min_bytes = msg->match_bytes;
+    
+    db->nmessages ++;
+    return 0;
+}
+
+static int parse_signal(sigdb_t *db, const char *name, int line, char **save) {
+    sigdb_message_t *msg;
+    sigdb_signal_t *sig;
+    char *token;
+    int byte = -1;
+    int bit = 0;
+    int bits = 0;
+    
+    if(db->nmessages == 0 || db->messages[db->nmessages-1].first_signal + db->messages[db->nmessages-1].nsignals != db->nsignals) {
+        printf("%s:%i: Signal outside a message\n", name, line);
+        return -1;
+    }
+    if(db->nsignals == SIGDB_MAX_SIGNALS) {
+        printf("%s:%i: Too many signals\n", name, line);
+        return -1;
+    }
+    
+    msg = &db->messages[db->nmessages-1];
+    sig = &db->signals[db->nsignals];
+    memset(sig, 0, sizeof *sig);
+    sig->message = db->nmessages - 1;
+    sig->index = db->nsignals;
+    sig->scale = 1;
+    
+    token = strtok_r(NULL, " \t\r", save);
+    if(token == NULL) {
+        printf("%s:%i: Signal needs a name\n", name, line);
+        return -1;
+    }
+    snprintf(sig->name, sizeof sig->name, "%s", token);
+    
+    while((token = strtok_r(NULL, " \t\r", save)) != NULL) {
+        if(strncmp(token, "byte=", 5) == 0) byte = strtol(token + 5, NULL, 0);
+        else if(strncmp(token, "bit=", 4) == 0) bit = strtol(token + 4, NULL, 0);
+        else if(strncmp(token, "len=", 4) == 0) bits = strtol(token + 4, NULL, 0);
+        else if(strncmp(token, "scale=", 6) == 0) sig->scale = strtod(token + 6, NULL);
+        else if(strncmp(token, "offset=", 7) == 0) sig->offset = strtod(token + 7, NULL);
+        else if(strncmp(token, "unit=", 5) == 0) snprintf(sig->unit, sizeof sig->unit, "%s", token + 5);
+        else if(strcmp(token, "signed") == 0) sig->is_signed = 1;
+        else {
+            printf("%s:%i: Unknown signal option %s\n", name, line, token);
+            return -1;
+        }
+    }
+    
+    if(bits < 1 || bits > 32 || bit < 0 || bit > 7 || byte < 0) {
+        printf("%s:%i: Signal %s needs a byte and 1 to 32 bits\n", name, line, sig->name);
+        return -1;
+    }
+    
+    sig->byte = byte;
+    sig->nbytes = (bit + bits + 7) / 8;
+    sig->shift = bit;
+    sig->bits = bits;
+    sig->mask = bits == 32 ? 0xFFFFFFFF : (1UL << bits) - 1;
+    
+    //The CRC is never part of a signal
+    if(sig->byte + sig->nbytes > J1850_MSG_SIZE - 1) {
+        printf("%s:%i: Signal %s runs off the end of the frame\n", name, line, sig->name);
+        return -1;
+    }
+    if(sig->byte + sig->nbytes > msg->min_bytes) msg->min_bytes = sig->byte + sig->nbytes;
+    
+    msg->nsignals ++;
+    db->nsignals ++;
+    return 0;
+}
+
+/*
+ * Adds the definitions in defs, name is only for error messages.
+ * sigdb_compile() has to be run again afterwards
+ */
+int sigdb_load_string(sigdb_t *db, const char *name, const char *defs) {
+    char *text = strdup(defs);
+    char *line_start = text;
+    int line = 0;
+    int ret = 0;
+    
+    if(text == NULL) return -1;
+    
+    while(*line_start && ret == 0) {
+        char *line_end = strchr(line_start, '\n');
+        char *comment;
+        char *token;
+        char *save;
+        
+        line ++;
+        if(line_end) *line_end = '\0';
+        comment = strchr(line_start, '#');
+        if(comment) *comment = '\0';
+        
+        token = strtok_r(line_start, " \t\r", &save);
+        if(token == NULL);
+        else if(strcmp(token, "message") == 0) ret = parse_message(db, name, line, &save);
+        else if(strcmp(token, "signal") == 0) ret = parse_signal(db, name, line, &save);
+        else {
+            printf("%s:%i: Unknown definition %s\n", name, line, token);
+            ret = -1;
+        }
+        
+        if(line_end == NULL) break;
+        line_start = line_end + 1;
+    }
+    
+    free(text);
+    return ret;
+}
+
+int sigdb_load(sigdb_t *db, const char *path) {
+    FILE *file = fopen(path, "r");
+    char *defs;
+    long size;
+    int ret;
+    
+    if(file == NULL) {
+        printf("Couldn't open signal definitions %s\n", path);
+        return -1;
+    }
+    
+    fseek(file, 0, SEEK_END);
+    size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    
+    defs = calloc(1, size + 1);
+    if(defs == NULL || fread(defs, 1, size, file) != (size_t)size) {
+        free(defs);
+        fclose(file);
+        return -1;
+    }
+    fclose(file);
+    
+    ret = sigdb_load_string(db, path, defs);
+    free(defs);
+    
+    return ret;
+}
+
+static uint64_t mix(uint64_t x) {
+    x ^= x >> 33;
+    x *= 0xFF51AFD7ED558CCDULL;
+    x ^= x >> 33;
+    x *= 0xC4CEB9FE1A85EC53ULL;
+    x ^= x >> 33;
+    return x;
+}
+
+static unsigned int table_slot(const sigdb_table_t *table, uint64_t key) {
+    uint32_t disp = table->disp[mix(key) % table->nbuckets];
+    return mix(key ^ ((uint64_t)(disp + 1) * 0x9E3779B97F4A7C15ULL)) & (table->size - 1);
+}
+
+/*
+ * Builds the perfect hash for every message under table's key mask, biggest
+ * buckets first while there's the most room to place them
+ */
+static int build_table(sigdb_t *db, sigdb_table_t *table) {
+    uint64_t keys[SIGDB_MAX_MESSAGES];
+    int first[SIGDB_MAX_MESSAGES];
+    int last[SIGDB_MAX_MESSAGES];
+    unsigned int buckets[SIGDB_MAX_MESSAGES];
+    unsigned int counts[SIGDB_MAX_MESSAGES] = {0};
+    unsigned int nkeys = 0;
+    unsigned int i, j, k;
+    
+    //Messages sharing a key are chained off the first one
+    for(i=0; i<(unsigned int)db->nmessages; i++) {
+        sigdb_message_t *msg = &db->messages[i];
+        if(msg->key_mask != table->key_mask) continue;
+        
+        for(j=0; j<nkeys && keys[j] != msg->key; j++);
+        if(j == nkeys) {
+            keys[nkeys] = msg->key;
+            first[nkeys] = i;
+            nkeys ++;
+        }
+        else db->messages[last[j]].next = i;
+        last[j] = i;
+        msg->next = -1;
+    }
+    
+    table->nbuckets = nkeys;
+    for(table->size=1; table->size < 2*nkeys; table->size <<= 1);
+    
+    table->disp = calloc(table->nbuckets, sizeof *table->disp);
+    table->keys = calloc(table->size, sizeof *table->keys);
+    table->entries = malloc(table->size * sizeof *table->entries);
+    if(table->disp == NULL || table->keys == NULL || table->entries == NULL) return -1;
+    for(i=0; i<table->size; i++) table->entries[i] = -1;
+    
+    for(i=0; i<nkeys; i++) {
+        buckets[i] = i;
+        counts[mix(keys[i]) % table->nbuckets] ++;
+    }
+    //Sort buckets by how many keys they have, there's never many
+    for(i=1; i<nkeys; i++) {
+        unsigned int b = buckets[i];
+        for(j=i; j>0 && counts[buckets[j-1]] < counts[b]; j--) buckets[j] = buckets[j-1];
+        buckets[j] = b;
+    }
+    
+    for(i=0; i<nkeys && counts[buckets[i]]; i++) {
+        unsigned int bucket = buckets[i];
+        unsigned int slots[SIGDB_MAX_MESSAGES];
+        unsigned int members[SIGDB_MAX_MESSAGES];
+        unsigned int nmembers = 0;
+        uint32_t disp;
+        
+        for(j=0; j<nkeys; j++) {
+            if(mix(keys[j]) % table->nbuckets == bucket) members[nmembers++] = j;
+        }
+        
+        for(disp=0; disp<SIGDB_MAX_DISP; disp++) {
+            table->disp[bucket] = disp;
+            for(j=0; j<nmembers; j++) {
+                slots[j] = table_slot(table, keys[members[j]]);
+                if(table->entries[slots[j]] >= 0) break;
+                for(k=0; k<j && slots[k] != slots[j]; k++);
+                if(k < j) break;
+            }
+            if(j == nmembers) break;
+        }
+        if(disp == SIGDB_MAX_DISP) return -1;
+        
+        for(j=0; j<nmembers; j++) {
+            table->keys[slots[j]] = keys[members[j]];
+            table->entries[slots[j]] = first[members[j]];
+        }
+    }
+    
+    return 0;
+}
+
+/*
+ * Builds the lookup tables for everything loaded so far
+ */
+int sigdb_compile(sigdb_t *db) {
+    int i, j;
+    
+    free_tables(db);
+    
+    for(i=0; i<db->nmessages; i++) {
+        uint64_t key_mask = db->messages[i].key_mask;
+        
+        for(j=0; j<db->ntables && db->tables[j].key_mask != key_mask; j++);
+        if(j < db->ntables) continue;
+        
+        if(db->ntables == SIGDB_MAX_TABLES) {
+            printf("Too many different wildcard patterns in signal definitions\n");
+            return -1;
+        }
+        db->tables[db->ntables].key_mask = key_mask;
+        db->ntables ++;
+    }
+    
+    for(i=0; i<db->ntables; i++) {
+        if(build_table(db, &db->tables[i]) < 0) {
+            printf("Couldn't build signal lookup table\n");
+            return -1;
+        }
+    }
+    
+    return 0;
+}
+
+/*
+ * Adds the first byte of every message that has one to the nheaders already
+ * in headers, skipping any already there. Returns the new count, or -1 if a
+ * message could start with anything or they don't all fit in max
+ */
+int sigdb_add_headers(const sigdb_t *db, uint8_t *headers, int nheaders, int max) {
+    int i, j;
+    
+    for(i=0; i<db->nmessages; i++) {
+        const sigdb_message_t *msg = &db->messages[i];
+        
+        if(msg->match_bytes == 0 || msg->match_mask[0] != 0xFF) return -1;
+        
+        for(j=0; j<nheaders && headers[j] != msg->match[0]; j++);
+        if(j < nheaders) continue;
+        
+        if(nheaders == max) return -1;
+        headers[nheaders++] = msg->match[0];
+    }
+    
+    return nheaders;
+}
+
+/*
+ * Calls callback with every decoded value of the named signal, or of every
+ * signal if signal is NULL. Returns how many signals it covers
+ */
+int sigdb_subscribe(sigdb_t *db, const char *signal, sigdb_callback_t callback, void *ctx) {
+    int count = 0;
+    int i;
+    
+    for(i=-1; i<db->nsignals; i++) {
+        if(i < 0 && signal) continue;
+        if(i >= 0 && (signal == NULL || strcmp(db->signals[i].name, signal) != 0)) continue;
+        
+        if(db->nhandlers == SIGDB_MAX_HANDLERS) return -1;
+        db->handlers[db->nhandlers].signal = i;
+        db->handlers[db->nhandlers].callback = callback;
+        db->handlers[db->nhandlers].ctx = ctx;
+        db->nhandlers ++;
+        count ++;
+    }
+    
+    return count ? count : -1;
+}
+
+static void decode_message(sigdb_t *db, const sigdb_message_t *msg, const j1850_frame_t *frame) {
+    int i, j;
+    
+    for(i=0; i<msg->match_bytes; i++) {
+        if((frame->data[i] & msg->match_mask[i]) != msg->match[i]) return;
+    }
+    
+    for(i=msg->first_signal; i<msg->first_signal + msg->nsignals; i++) {
+        const sigdb_signal_t *sig = &db->signals[i];
+        uint64_t raw = 0;
+        int64_t value;
+        
+        for(j=0; j<sig->nbytes; j++) raw = (raw << 8) | frame->data[sig->byte + j];
+        raw = (raw >> sig->shift) & sig->mask;
+        value = raw;
+        if(sig->is_signed && (raw >> (sig->bits - 1))) value -= (int64_t)1 << sig->bits;
+        
+        db->decoded ++;
+        for(j=0; j<db->nhandlers; j++) {
+            if(db->handlers[j].signal < 0 || db->handlers[j].signal == i) {
+                db->handlers[j].callback(sig, value * sig->scale + sig->offset, frame, db->handlers[j].ctx);
+            }
+        }
+    }
+}
+
+/*
+ * Decodes every signal in frame and hands them to their handlers,
+ * returns how many messages it matched
+ */
+int sigdb_decode(sigdb_t *db, const j1850_frame_t *frame) {
+    uint64_t key = (uint64_t)frame->bus << (8*SIGDB_KEY_BYTES);
+    int matched = 0;
+    int i;
+    
+    if(frame->flags & J1850_FRAME_CRC_ERR) return 0;
+    
+    for(i=0; i<SIGDB_KEY_BYTES && i<frame->bytes; i++) key |= (uint64_t)frame->data[i] << (8*(SIGDB_KEY_BYTES-1-i));
+    
+    for(i=0; i<db->ntables; i++) {
+        sigdb_table_t *table = &db->tables[i];
+        uint64_t masked = key & table->key_mask;
+        unsigned int slot = table_slot(table, masked);
+        int entry;
+        
+        if(table->entries[slot] < 0 || table->keys[slot] != masked) continue;
+        
+        for(entry = table->entries[slot]; entry >= 0; entry = db->messages[entry].next) {
+            const sigdb_message_t *msg = &db->messages[entry];
+            if(frame->bytes - 1 < msg->min_bytes) continue;
+            
+            decode_message(db, msg, frame);
+            matched ++;
+        }
+    }
+    
+    return matched;
+}
@@ -0,0 +1,107 @@
+/*
+ * sigdb.h - Vehicle message definitions compiled into a signal decoder
+ */
+
+#ifndef __SIGDB_H__
+#define __SIGDB_H__
+
+#include <stdint.h>
+#include "j1850.h"
+
+#define SIGDB_MAX_MESSAGES 256
+#define SIGDB_MAX_SIGNALS 1024
+#define SIGDB_MAX_HANDLERS 32
+#define SIGDB_NAME_MAX 32
+#define SIGDB_UNIT_MAX 16
+//Frames are looked up by their bus and first few bytes, the rest of a match
+//is checked after
+#define SIGDB_KEY_BYTES 5
+//Different sets of wildcards each need their own table
+#define SIGDB_MAX_TABLES 8
+
+typedef struct sigdb_signal_t sigdb_signal_t;
+typedef struct sigdb_message_t sigdb_message_t;
+typedef struct sigdb_table_t sigdb_table_t;
+typedef struct sigdb_handler_t sigdb_handler_t;
+typedef struct sigdb_t sigdb_t;
+
+typedef void (*sigdb_callback_t)(const sigdb_signal_t *signal, double value, const j1850_frame_t *frame, void *ctx);
+
+struct sigdb_signal_t {
+    char name[SIGDB_NAME_MAX];
+    char unit[SIGDB_UNIT_MAX];
+    int message;
+    int index;
+    
+    //Big endian bytes from byte on, shifted down and masked to the bits
+    uint8_t byte;
+    uint8_t nbytes;
+    uint8_t shift;
+    uint8_t bits;
+    uint8_t is_signed;
+    uint32_t mask;
+    double scale;
+    double offset;
+};
+
+struct sigdb_message_t {
+    char name[SIGDB_NAME_MAX];
+    uint8_t bus;
+    uint8_t match[J1850_MSG_SIZE];
+    uint8_t match_mask[J1850_MSG_SIZE];
+    uint8_t match_bytes;
+    //Bytes a frame needs for every signal, not counting the CRC
+    uint8_t min_bytes;
+    int first_signal;
+    int nsignals;
+    //Next message with the same lookup key, -1 at the end
+    int next;
+    uint64_t key;
+    uint64_t key_mask;
+};
+
+/*
+ * Perfect hash of every message key under one wildcard mask, the bucket's
+ * displacement picks a slot no other key lands in
+ */
+struct sigdb_table_t {
+    uint64_t key_mask;
+    unsigned int size;
+    unsigned int nbuckets;
+    uint32_t *disp;
+    uint64_t *keys;
+    int *entries;
+};
+
+struct sigdb_handler_t {
+    //-1 for every signal
+    int signal;
+    sigdb_callback_t callback;
+    void *ctx;
+};
+
+struct sigdb_t {
+    sigdb_message_t messages[SIGDB_MAX_MESSAGES];
+    int nmessages;
+    sigdb_signal_t signals[SIGDB_MAX_SIGNALS];
+    int nsignals;
+    
+    sigdb_table_t tables[SIGDB_MAX_TABLES];
+    int ntables;
+    
+    sigdb_handler_t handlers[SIGDB_MAX_HANDLERS];
+    int nhandlers;
+    
+    unsigned int decoded;
+};
+
+void sigdb_init(sigdb_t *db);
+void sigdb_free(sigdb_t *db);
+int sigdb_load(sigdb_t *db, const char *path);
+int sigdb_load_string(sigdb_t *db, const char *name, const char *defs);
+int sigdb_compile(sigdb_t *db);
+int sigdb_add_headers(const sigdb_t *db, uint8_t *headers, int nheaders, int max);
+int sigdb_subscribe(sigdb_t *db, const char *signal, sigdb_callback_t callback, void *ctx);
+int sigdb_decode(sigdb_t *db, const j1850_frame_t *frame);
+
+#endif // __SIGDB_H__
@@ -0,0 +1,325 @@
+/*
+ * spi.c - libj1850 SPI transport to the interface board
+ *
+ * Every byte to the micro goes through its link layer: 0x00 reads whether it
+ * has data waiting, 0x01 reads the next data byte and 0x02 writes one. 0x04
+ * has it drop whatever command it's partway through and 0x05 asks whether
+ * that's done.
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include <stdint.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include <linux/types.h>
+#include <linux/spi/spidev.h>
+#include "spi.h"
+
+const uint32_t spi_link_speeds[SPI_LINK_SPEEDS] = {100000, 250000, 500000, 1000000, 2000000};
+
+//Probe pattern stays clear of the command bytes in case a byte gets misread
+static const uint8_t link_pattern[] = {0x55, 0xAA, 0xFF, 0xC3, 0x5A, 0xA5, 0xF0, 0x99};
+#define LINK_PATTERN_BYTES (sizeof(link_pattern)/sizeof(link_pattern[0]))
+#define LINK_PROBE_ROUNDS 8
+
+//long is 32 bits on the Pi, nanoseconds held in one wrap after about 2.1s
+static int64_t elapsed_ns(struct timespec *start) {
+    struct timespec now;
+    
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)(now.tv_sec - start->tv_sec)*1000000000 + now.tv_nsec - start->tv_nsec;
+}
+
+void spi_dev_init(spi_dev_t *dev, const char *device) {
+    dev->device = device;
+    dev->fd = -1;
+    dev->mode = 0;
+    dev->bits = 8;
+    dev->delay = 0;
+    dev->speed = spi_link_speeds[0];
+    dev->max_speed = spi_link_speeds[SPI_LINK_SPEEDS-1];
+    dev->link_errors = 0;
+}
+
+int spi_open(spi_dev_t *dev) {
+    int ret;
+    
+    while(dev->fd < 0) {
+        dev->fd = open(dev->device, O_RDWR);
+        if (dev->fd < 0) {
+            printf("can't open spi device %s\n", dev->device);
+            nanosleep((const struct timespec[]){{0, 500000000L}}, NULL);
+        }
+    }
+    
+    // spi mode
+    ret = ioctl(dev->fd, SPI_IOC_WR_MODE, &dev->mode);
+    if (ret == -1) {
+        printf("can't set spi mode\n");
+        return ret;
+    }
+    ret = ioctl(dev->fd, SPI_IOC_RD_MODE, &dev->mode);
+    if (ret == -1) {
+        printf("can't get spi mode\n");
+        return ret;
+    }
+    
+    // bits per word
+    ret = ioctl(dev->fd, SPI_IOC_WR_BITS_PER_WORD, &dev->bits);
+    if (ret == -1) {
+        printf("can't set bits per word\n");
+        return ret;
+    }
+    ret = ioctl(dev->fd, SPI_IOC_RD_BITS_PER_WORD, &dev->bits);
+    if (ret == -1) {
+        printf("can't get bits per word\n");
+        return ret;
+    }
+    
+    // max speed hz
+    ret = ioctl(dev->fd, SPI_IOC_WR_MAX_SPEED_HZ, &dev->speed);
+    if (ret == -1) {
+        printf("can't set max speed hz\n");
+        return ret;
+    }
+    ret = ioctl(dev->fd, SPI_IOC_RD_MAX_SPEED_HZ, &dev->speed);
+    if (ret == -1) {
+        printf("can't get max speed hz\n");
+        return ret;
+    }
+    
+    return 0;
+}
+
+void spi_close(spi_dev_t *dev) {
+    if(dev->fd >= 0) close(dev->fd);
+    dev->fd = -1;
+}
+
+int spi_xferbyte(spi_dev_t *dev, uint8_t outbyte) {
+    int ret;
+    uint8_t rx = 0;
+    struct spi_ioc_transfer tr = {
+        .tx_buf = (unsigned long)&outbyte,
+        .rx_buf = (unsigned long)&rx,
+        .len = 1,
+        .delay_usecs = dev->delay,
+        .speed_hz = dev->speed,
+        .bits_per_word = 0,
+    };
+    
+    ret = ioctl(dev->fd, SPI_IOC_MESSAGE(1), &tr);
+    
+    if(ret < 0) return ret;
+    else return rx;
+}
+
+int spi_send_data(spi_dev_t *dev, const uint8_t *tx_buf, int len) {
+    int ret;
+    
+    int i;
+    for(i=0; i<len; i++) {
+        //Send write command
+        ret = spi_xferbyte(dev, 0x02);
+        if(ret < 0) return ret;
+        
+        //Send data byte and verify command/data
+        ret = spi_xferbyte(dev, tx_buf[i]);
+        if(ret != 0x02) {
+            printf("Command didn't match request, wanted %i, got %i\n", 0x02, ret);
+            dev->link_errors ++;
+            return -1;
+        }
+        ret = spi_xferbyte(dev, 0x00);
+        if(ret != tx_buf[i]) {
+            printf("Data didn't match request, wanted %i, got %i\n", tx_buf[i], ret);
+            dev->link_errors ++;
+            return -1;
+        }
+    }
+    
+    return 0;
+}
+
+int spi_get_data(spi_dev_t *dev, uint8_t *rx_buf, int size) {
+    int ret;
+    int len = 0;
+    
+    //Clear SPDR and get buffer status
+    ret = spi_xferbyte(dev, 0x00);
+    if(ret < 0) return ret;
+    ret = spi_xferbyte(dev, 0x00);
+    if(ret < 0) return ret;
+    
+    while(ret) {
+        //Send and verify read command
+        ret = spi_xferbyte(dev, 0x01);
+        if(ret < 0) return ret;
+        ret = spi_xferbyte(dev, 0x00);
+        if(ret != 1) {
+            dev->link_errors ++;
+            return -1;
+        }
+        
+        //Get actual data byte, anything past the end of the buffer is dropped
+        ret = spi_xferbyte(dev, 0x00);
+        if(ret < 0) return ret;
+        if(len < size) rx_buf[len] = ret;
+        len ++;
+        
+        //Get buffer status
+        ret = spi_xferbyte(dev, 0x00);
+        if(ret < 0) return ret;
+    }
+    
+    if(len > size) return -1;
+    return len;
+}
+
+int spi_get_response(spi_dev_t *dev, uint8_t *rx_buf, int size) {
+    int ret;
+    struct timespec start;
+    
+    //Wait for the micro to respond to our request
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    do {
+        ret = spi_get_data(dev, rx_buf, size);
+        if(ret < 0) return ret;
+        
+        //Give up after 100ms
+        if(ret == 0 && elapsed_ns(&start) > 100000000L) return -1;
+    } while(ret == 0);
+    
+    return ret;
+}
+
+/*
+ * Throws away anything left over in the micro's send buffer
+ */
+int spi_flush(spi_dev_t *dev) {
+    int ret;
+    uint8_t rx_buf[64];
+    
+    do {
+        ret = spi_get_data(dev, rx_buf, sizeof rx_buf);
+    } while(ret > 0);
+    
+    return ret;
+}
+
+/*
+ * Gets the micro back in step after a lost or extra byte, without either side
+ * starting over. Anything it had half received or still had to send is
+ * thrown away, so the caller has to ask again for whatever it was doing
+ */
+int spi_resync(spi_dev_t *dev) {
+    int ret;
+    struct timespec start;
+    
+    //Finishes off any link command a lost byte left it waiting on, a write
+    //puts a stray byte in but that's dropped with the rest
+    ret = spi_xferbyte(dev, 0x00);
+    if(ret < 0) return ret;
+    ret = spi_xferbyte(dev, 0x04);
+    if(ret < 0) return ret;
+    
+    //Its main loop does the dropping, usually well inside a millisecond
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    do {
+        ret = spi_xferbyte(dev, 0x05);
+        if(ret < 0) return ret;
+        ret = spi_xferbyte(dev, 0x00);
+        if(ret < 0) return ret;
+        if(ret == SPI_SYNC_ACK) return 0;
+    } while(elapsed_ns(&start) < SPI_RESYNC_TIMEOUT_NS);
+    
+    return -1;
+}
+
+/*
+ * Sends the known pattern through the link echo at the given clock,
+ * returning the number of bytes that didn't come back inverted
+ */
+int spi_probe_speed(spi_dev_t *dev, uint32_t hz) {
+    int ret = 0;
+    int i;
+    int errors = 0;
+    uint32_t last_speed = dev->speed;
+    
+    dev->speed = hz;
+    for(i=0; i<LINK_PROBE_ROUNDS*LINK_PATTERN_BYTES; i++) {
+        uint8_t pattern = link_pattern[i % LINK_PATTERN_BYTES];
+        
+        ret = spi_xferbyte(dev, 0x03);
+        if(ret < 0) break;
+        ret = spi_xferbyte(dev, pattern);
+        if(ret < 0) break;
+        ret = spi_xferbyte(dev, 0x00);
+        if(ret < 0) break;
+        if(ret != (uint8_t)~pattern) errors ++;
+    }
+    dev->speed = last_speed;
+    
+    if(ret < 0) return ret;
+    return errors;
+}
+
+/*
+ * Steps the SPI clock up until the probe sees errors and settles on the
+ * fastest clean speed
+ */
+int spi_tune_link(spi_dev_t *dev) {
+    int ret;
+    int i;
+    int best = -1;
+    int fail = -1;
+    
+    for(i=0; i<SPI_LINK_SPEEDS && spi_link_speeds[i] <= dev->max_speed; i++) {
+        ret = spi_probe_speed(dev, spi_link_speeds[i]);
+        if(ret < 0) return ret;
+        if(ret > 0) {
+            fail = i;
+            break;
+        }
+        best = i;
+    }
+    
+    //Get back in step at the slowest speed after a failed probe
+    dev->speed = spi_link_speeds[0];
+    spi_xferbyte(dev, 0x00);
+    spi_xferbyte(dev, 0x00);
+    
+    if(best < 0) {
+        printf("%s: SPI link failed probe at %u Hz\n", dev->device, dev->speed);
+        return -1;
+    }
+    
+    dev->speed = spi_link_speeds[best];
+    if(fail >= 0) printf("%s: SPI link at %u Hz, %.1fx margin below failing %u Hz\n", dev->device, dev->speed, (float)spi_link_speeds[fail] / dev->speed, spi_link_speeds[fail]);
+    else printf("%s: SPI link at %u Hz, no errors up to %u Hz\n", dev->device, dev->speed, dev->speed);
+    
+    dev->link_errors = 0;
+    return 0;
+}
+
+/*
+ * Drops to the next slower speed when transfers keep failing, call once a second
+ */
+void spi_check_link(spi_dev_t *dev) {
+    int i;
+    
+    if(dev->link_errors >= SPI_LINK_ERROR_LIMIT) {
+        for(i=SPI_LINK_SPEEDS-1; i>0; i--) {
+            if(spi_link_speeds[i] <= dev->speed) {
+                printf("%s: SPI link saw %i errors, falling back from %u Hz to %u Hz\n", dev->device, dev->link_errors, dev->speed, spi_link_speeds[i-1]);
+                dev->speed = spi_link_speeds[i-1];
+                break;
+            }
+        }
+    }
+    dev->link_errors = 0;
+}
@@ -0,0 +1,49 @@
+/*
+ * spi.h - libj1850 SPI transport to the interface board
+ */
+
+#ifndef __SPI_H__
+#define __SPI_H__
+
+#include <stdint.h>
+
+//SPI clock steps tried by the link probe, the AVR slave tops out at F_CPU/4
+#define SPI_LINK_SPEEDS 5
+#define SPI_LINK_ERROR_LIMIT 3
+
+//What the micro answers a resync check with once it's back in step, and how
+//long it gets to get there
+#define SPI_SYNC_ACK 0xA5
+#define SPI_RESYNC_TIMEOUT_NS 5000000L
+
+typedef struct spi_dev_t spi_dev_t;
+
+struct spi_dev_t {
+    const char *device;
+    int fd;
+    uint8_t mode;
+    uint8_t bits;
+    uint16_t delay;
+    uint32_t speed;
+    uint32_t max_speed;
+    int link_errors;
+};
+
+extern const uint32_t spi_link_speeds[SPI_LINK_SPEEDS];
+
+void spi_dev_init(spi_dev_t *dev, const char *device);
+int spi_open(spi_dev_t *dev);
+void spi_close(spi_dev_t *dev);
+
+int spi_xferbyte(spi_dev_t *dev, uint8_t outbyte);
+int spi_send_data(spi_dev_t *dev, const uint8_t *tx_buf, int len);
+int spi_get_data(spi_dev_t *dev, uint8_t *rx_buf, int size);
+int spi_get_response(spi_dev_t *dev, uint8_t *rx_buf, int size);
+int spi_flush(spi_dev_t *dev);
+int spi_resync(spi_dev_t *dev);
+
+int spi_probe_speed(spi_dev_t *dev, uint32_t hz);
+int spi_tune_link(spi_dev_t *dev);
+void spi_check_link(spi_dev_t *dev);
+
+#endif // __SPI_H__
@@ -0,0 +1,23 @@
+/*
+ * test.h - Checks for the host tests under test/, each test is its own program
+ */
+
+#ifndef __TEST_H__
+#define __TEST_H__
+
+#include <stdio.h>
+#include <stdlib.h>
+
+static int test_failures;
+
+//Carries on after a failure so one run shows everything that's wrong
+#define CHECK(cond) do { \
+    if(!(cond)) { \
+        printf("%s:%i: %s\n", __FILE__, __LINE__, #cond); \
+        test_failures ++; \
+    } \
+} while(0)
+
+#define TEST_RESULT() (test_failures ? EXIT_FAILURE : EXIT_SUCCESS)
+
+#endif // __TEST_H__
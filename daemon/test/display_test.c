@@ -0,0 +1,107 @@
+/*
+ * display_test.c - Display text transcoding and scrolling against known strings
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "display.h"
+#include "test.h"
+
+static disp_t disp;
+static seg_t seg;
+
+static int transcodes_to(const char *utf8, const char *ascii) {
+    char output[DISP_TEXT_MAX];
+    int len = disp_transcode(utf8, output, sizeof output);
+    
+    if(len == (int)strlen(ascii) && strcmp(output, ascii) == 0) return 1;
+    printf("\"%s\" came out as \"%s\"\n", utf8, output);
+    return 0;
+}
+
+static void test_transcode(void) {
+    char output[8];
+    
+    CHECK(transcodes_to("Plain ASCII ~", "Plain ASCII ~"));
+    //Every accented Latin-1 letter
+    CHECK(transcodes_to("ÀÁÂÃÄÅÆÇÈÉÊËÌÍÎÏ",
+                        "AAAAAAACEEEEIIII"));
+    CHECK(transcodes_to("ÐÑÒÓÔÕÖ×ØÙÚÛÜÝÞß",
+                        "DNOOOOOxOUUUUYTs"));
+    CHECK(transcodes_to("àáâãäåæçèéêëìíîï",
+                        "aaaaaaaceeeeiiii"));
+    CHECK(transcodes_to("ðñòóôõö÷øùúûüýþÿ",
+                        "dnooooo/ouuuuyty"));
+    CHECK(transcodes_to("Björk – Jóga", "Bjork - Joga"));
+    
+    //Typographic punctuation, spaces and controls
+    CHECK(transcodes_to("‘a’ “b” — c…", "'a' \"b\" - c..."));
+    CHECK(transcodes_to("a b\tc", "a b c"));
+    
+    //Anything else, and anything malformed, is one ?
+    CHECK(transcodes_to("中\U0001F600.", "??."));
+    CHECK(transcodes_to("\xC3(\xE2\x82", "?(??"));
+    
+    //Cut short to fit, an ellipsis as far as it goes
+    CHECK(disp_transcode("abcdefghij", output, sizeof output) == 7 && strcmp(output, "abcdefg") == 0);
+    CHECK(disp_transcode("abcde…", output, sizeof output) == 7 && strcmp(output, "abcde..") == 0);
+}
+
+static const seg_tx_t *queued(uint8_t channel) {
+    int i;
+    
+    for(i=0; i<SEG_TX_STREAMS; i++) {
+        if(seg.tx[i].active && seg.tx[i].channel == channel) return &seg.tx[i];
+    }
+    
+    return NULL;
+}
+
+/*
+ * Every step of a scrolling field against the window worked out the long way
+ */
+static void test_marquee(void) {
+    const char *text = "ABCDEFGHIJKLMNOPQRSTUVW";
+    int len = strlen(text);
+    int loop = len + DISP_MARQUEE_GAP;
+    disp_field_t *f = &disp.fields[0];
+    int offset, j;
+    
+    disp_init(&disp);
+    seg_init(&seg);
+    CHECK(f->width < len);
+    CHECK(disp_set(&disp, f->field, text) == 0);
+    disp_set_active(&disp, 1);
+    
+    for(offset=0; offset<=loop; offset++) {
+        char window[DISP_WIDTH_MAX];
+        const seg_tx_t *tx;
+        
+        for(j=0; j<f->width; j++) {
+            int pos = (offset + j) % loop;
+            window[j] = pos < len ? text[pos] : ' ';
+        }
+        
+        f->next = 0;
+        disp_service(&disp, &seg);
+        tx = queued(f->field);
+        CHECK(tx != NULL && tx->bytes == f->width && memcmp(tx->payload, window, f->width) == 0);
+        if(tx) seg.tx[tx - seg.tx].active = 0;
+    }
+    
+    //Short text goes out as it is, and the same text again changes nothing
+    CHECK(disp_set(&disp, f->field, "Short") == 0);
+    f->next = 0;
+    disp_service(&disp, &seg);
+    CHECK(queued(f->field) && queued(f->field)->bytes == 5 && memcmp(queued(f->field)->payload, "Short", 5) == 0);
+    CHECK(disp_set(&disp, f->field, "Short") == 0 && !f->dirty);
+    CHECK(disp_set(&disp, 0x03, "No such field") == -1);
+}
+
+int main(void) {
+    test_transcode();
+    test_marquee();
+    
+    return TEST_RESULT();
+}
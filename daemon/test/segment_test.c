@@ -0,0 +1,132 @@
+/*
+ * segment_test.c - Segmented payloads put back together from known frames
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "segment.h"
+#include "test.h"
+
+#define BUS 1
+
+static const seg_scheme_t scheme = {{0xA1, 0x02}, 2, 6, 0x00};
+static const uint8_t payload[] = "Fourteen bytes";
+
+static seg_t seg;
+static seg_msg_t msg;
+
+/*
+ * Frame index of nframes carrying payload on channel, the way seg_service()
+ * sends it
+ */
+static int rx_frame(int channel, int index, int nframes, uint8_t flags) {
+    j1850_frame_t frame;
+    int offset = index * scheme.chunk;
+    int len = sizeof payload - 1 - offset;
+    
+    if(len > scheme.chunk) len = scheme.chunk;
+    
+    memset(&frame, 0, sizeof frame);
+    frame.bus = BUS;
+    frame.flags = flags;
+    memcpy(frame.data, scheme.header, scheme.header_bytes);
+    frame.data[scheme.header_bytes] = ((nframes - index) << 4) | channel;
+    if(index == 0) frame.data[scheme.header_bytes] |= SEG_SEQ_FIRST;
+    memcpy(&frame.data[scheme.header_bytes + 1], &payload[offset], len);
+    frame.bytes = scheme.header_bytes + 1 + scheme.chunk + 1;
+    
+    return seg_rx(&seg, &frame, &msg);
+}
+
+static void test_whole(void) {
+    seg_init(&seg);
+    CHECK(seg_listen(&seg, BUS, &scheme) == 0);
+    
+    CHECK(rx_frame(3, 0, 3, 0) == 0);
+    CHECK(rx_frame(3, 1, 3, 0) == 0);
+    CHECK(rx_frame(3, 2, 3, 0) == 1);
+    CHECK(msg.bus == BUS && msg.channel == 3 && msg.scheme == &scheme);
+    //The last frame's padding comes along
+    CHECK(msg.bytes == 3 * scheme.chunk);
+    CHECK(memcmp(msg.payload, payload, sizeof payload - 1) == 0);
+    CHECK(msg.payload[sizeof payload - 1] == scheme.pad);
+    CHECK(seg.rx_errors == 0 && seg.rx_timeouts == 0);
+}
+
+static void test_interleaved(void) {
+    seg_init(&seg);
+    seg_listen(&seg, BUS, &scheme);
+    
+    CHECK(rx_frame(1, 0, 3, 0) == 0);
+    CHECK(rx_frame(2, 0, 3, 0) == 0);
+    CHECK(rx_frame(1, 1, 3, 0) == 0);
+    CHECK(rx_frame(2, 1, 3, 0) == 0);
+    CHECK(rx_frame(2, 2, 3, 0) == 1 && msg.channel == 2);
+    CHECK(rx_frame(1, 2, 3, 0) == 1 && msg.channel == 1);
+    CHECK(memcmp(msg.payload, payload, sizeof payload - 1) == 0);
+}
+
+static void test_lost(void) {
+    j1850_frame_t other;
+    
+    seg_init(&seg);
+    seg_listen(&seg, BUS, &scheme);
+    
+    //A missing middle frame throws the payload away
+    CHECK(rx_frame(0, 0, 3, 0) == 0);
+    CHECK(rx_frame(0, 2, 3, 0) == 0);
+    CHECK(seg.rx_errors == 1);
+    
+    //So does a bad CRC, and nothing carries on after it
+    CHECK(rx_frame(0, 0, 3, 0) == 0);
+    CHECK(rx_frame(0, 1, 3, J1850_FRAME_CRC_ERR) == 0);
+    CHECK(rx_frame(0, 2, 3, 0) == 0);
+    CHECK(seg.rx_errors == 3);
+    
+    //A first frame always starts over
+    CHECK(rx_frame(0, 0, 3, 0) == 0);
+    CHECK(rx_frame(0, 0, 3, 0) == 0);
+    CHECK(rx_frame(0, 1, 3, 0) == 0);
+    CHECK(rx_frame(0, 2, 3, 0) == 1);
+    
+    //Not this scheme's
+    memset(&other, 0, sizeof other);
+    other.bus = BUS;
+    other.bytes = 6;
+    other.data[0] = 0xA1;
+    other.data[1] = 0x03;
+    CHECK(seg_rx(&seg, &other, &msg) == -1);
+    other.bus = BUS + 1;
+    other.data[1] = 0x02;
+    CHECK(seg_rx(&seg, &other, &msg) == -1);
+}
+
+static void test_timeout(void) {
+    seg_init(&seg);
+    seg_listen(&seg, BUS, &scheme);
+    
+    CHECK(rx_frame(5, 0, 3, 0) == 0);
+    CHECK(rx_frame(5, 1, 3, 0) == 0);
+    usleep(SEG_RX_TIMEOUT_US + 100000);
+    CHECK(rx_frame(5, 2, 3, 0) == 0);
+    CHECK(seg.rx_timeouts == 1 && seg.rx_errors == 1);
+    
+    //Each frame moves the deadline on
+    CHECK(rx_frame(5, 0, 3, 0) == 0);
+    usleep(SEG_RX_TIMEOUT_US * 3 / 4);
+    CHECK(rx_frame(5, 1, 3, 0) == 0);
+    usleep(SEG_RX_TIMEOUT_US * 3 / 4);
+    CHECK(rx_frame(5, 2, 3, 0) == 1);
+    CHECK(seg.rx_timeouts == 1);
+}
+
+int main(void) {
+    test_whole();
+    test_interleaved();
+    test_lost();
+    test_timeout();
+    
+    return TEST_RESULT();
+}
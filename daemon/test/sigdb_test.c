@@ -0,0 +1,161 @@
+/*
+ * sigdb_test.c - Signal definitions compiled and decoded against known frames
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "sigdb.h"
+#include "test.h"
+
+#define HASH_MESSAGES 200
+
+typedef struct decoded_t decoded_t;
+
+struct decoded_t {
+    int count;
+    char name[SIGDB_NAME_MAX];
+    double value;
+};
+
+static const char *defs =
+    "# OBD answer from any ECU\n"
+    "message engine_rpm bus=0 match=48,6B,*,41,0C\n"
+    "    signal rpm byte=5 len=16 scale=0.25 unit=rpm\n"
+    "message fields bus=1 match=A0,01\n"
+    "    signal nibbles byte=2 bit=4 len=12\n"
+    "    signal negative byte=2 bit=2 len=10 signed\n"
+    "    signal three_bytes byte=2 bit=6 len=16\n";
+
+static void on_signal(const sigdb_signal_t *signal, double value, const j1850_frame_t *frame, void *ctx) {
+    decoded_t *decoded = ctx;
+    
+    decoded->count ++;
+    snprintf(decoded->name, sizeof decoded->name, "%s", signal->name);
+    decoded->value = value;
+}
+
+//The fields message's signals come straight after rpm
+static void on_field(const sigdb_signal_t *signal, double value, const j1850_frame_t *frame, void *ctx) {
+    decoded_t *decoded = &((decoded_t *)ctx)[signal->index - 1];
+    
+    decoded->count ++;
+    decoded->value = value;
+}
+
+//bytes is the frame without its CRC
+static void make_frame(j1850_frame_t *frame, int bus, const uint8_t *data, int bytes) {
+    memset(frame, 0, sizeof *frame);
+    frame->bus = bus;
+    frame->bytes = bytes + 1;
+    memcpy(frame->data, data, bytes);
+}
+
+static sigdb_t db;
+
+static void test_signals(void) {
+    j1850_frame_t frame;
+    decoded_t rpm = {0};
+    decoded_t fields[3] = {{0}};
+    
+    sigdb_init(&db);
+    CHECK(sigdb_load_string(&db, "test", defs) == 0);
+    CHECK(sigdb_compile(&db) == 0);
+    CHECK(sigdb_subscribe(&db, "rpm", on_signal, &rpm) == 1);
+    CHECK(sigdb_subscribe(&db, "nibbles", on_field, fields) == 1);
+    CHECK(sigdb_subscribe(&db, "negative", on_field, fields) == 1);
+    CHECK(sigdb_subscribe(&db, "three_bytes", on_field, fields) == 1);
+    
+    //The source byte is a wildcard, any ECU's answer decodes
+    make_frame(&frame, 0, (const uint8_t[]){0x48, 0x6B, 0x10, 0x41, 0x0C, 0x1A, 0xF8}, 7);
+    CHECK(sigdb_decode(&db, &frame) == 1);
+    CHECK(rpm.count == 1 && strcmp(rpm.name, "rpm") == 0 && rpm.value == 0x1AF8 * 0.25);
+    frame.data[2] = 0x18;
+    CHECK(sigdb_decode(&db, &frame) == 1);
+    CHECK(rpm.count == 2);
+    
+    //Wrong bus, wrong PID, too short for the signal, or a bad CRC
+    frame.bus = 1;
+    CHECK(sigdb_decode(&db, &frame) == 0);
+    frame.bus = 0;
+    frame.data[4] = 0x0D;
+    CHECK(sigdb_decode(&db, &frame) == 0);
+    frame.data[4] = 0x0C;
+    frame.bytes = 7;
+    CHECK(sigdb_decode(&db, &frame) == 0);
+    frame.bytes = 8;
+    frame.flags = J1850_FRAME_CRC_ERR;
+    CHECK(sigdb_decode(&db, &frame) == 0);
+    CHECK(rpm.count == 2);
+    
+    //Signals that start and end part way through bytes
+    make_frame(&frame, 1, (const uint8_t[]){0xA0, 0x01, 0xAB, 0xCD, 0xEF}, 5);
+    CHECK(sigdb_decode(&db, &frame) == 1);
+    CHECK(fields[0].count == 1 && fields[0].value == 0xABC);
+    CHECK(fields[1].count == 1 && fields[1].value == -269);
+    CHECK(fields[2].count == 1 && fields[2].value == 0xAF37);
+    
+    sigdb_free(&db);
+}
+
+/*
+ * Enough keys that the perfect hash has to displace buckets, every one still
+ * has to find its own message and nothing else
+ */
+static void test_hash(void) {
+    char defs[HASH_MESSAGES * 80];
+    int len = 0;
+    int i;
+    
+    sigdb_init(&db);
+    for(i=0; i<HASH_MESSAGES; i++) {
+        len += snprintf(&defs[len], sizeof defs - len, "message m%i bus=%i match=%.2X,%.2X\n    signal v%i byte=2 len=8\n", i, i % 3, 0x20 + i % 7, i, i);
+    }
+    CHECK(sigdb_load_string(&db, "hash", defs) == 0);
+    CHECK(sigdb_compile(&db) == 0);
+    CHECK(db.ntables == 1);
+    
+    for(i=0; i<HASH_MESSAGES; i++) {
+        decoded_t decoded = {0};
+        j1850_frame_t frame;
+        char name[SIGDB_NAME_MAX];
+        
+        db.nhandlers = 0;
+        CHECK(sigdb_subscribe(&db, NULL, on_signal, &decoded) == 1);
+        make_frame(&frame, i % 3, (const uint8_t[]){0x20 + i % 7, i, i ^ 0x5A}, 3);
+        snprintf(name, sizeof name, "v%i", i);
+        
+        CHECK(sigdb_decode(&db, &frame) == 1);
+        CHECK(decoded.count == 1 && strcmp(decoded.name, name) == 0 && decoded.value == (i ^ 0x5A));
+        
+        //The bus is part of the key
+        frame.bus = (i + 1) % 3;
+        CHECK(sigdb_decode(&db, &frame) == 0);
+    }
+    
+    sigdb_free(&db);
+}
+
+static void test_headers(void) {
+    uint8_t headers[4] = {0x8D, 0x48};
+    
+    sigdb_init(&db);
+    CHECK(sigdb_load_string(&db, "test", defs) == 0);
+    CHECK(sigdb_add_headers(&db, headers, 2, 4) == 3);
+    CHECK(headers[2] == 0xA0);
+    CHECK(sigdb_add_headers(&db, headers, 3, 3) == 3);
+    CHECK(sigdb_add_headers(&db, headers, 2, 2) == -1);
+    
+    //Anything could start a message, so the board can't filter
+    CHECK(sigdb_load_string(&db, "test", "message any bus=0 match=*,12\n    signal x byte=2 len=8\n") == 0);
+    CHECK(sigdb_add_headers(&db, headers, 2, 4) == -1);
+    sigdb_free(&db);
+}
+
+int main(void) {
+    test_signals();
+    test_hash();
+    test_headers();
+    
+    return TEST_RESULT();
+}
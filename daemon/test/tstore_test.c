@@ -0,0 +1,155 @@
+/*
+ * tstore_test.c - Telemetry written out through the writer thread and read back
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+#include "j1850.h"
+#include "tstore.h"
+#include "test.h"
+
+#define SAMPLES 20000
+#define BATCH 2000
+#define COLUMNS 3
+//Realtime and monotonic can drift apart a little between chunks
+#define CLOCK_SLACK_US 1000
+
+typedef struct column_t column_t;
+
+struct column_t {
+    const char *name;
+    const char *unit;
+    double scale;
+    double offset;
+    int index;
+    
+    int count;
+    uint64_t times[SAMPLES];
+    double values[SAMPLES];
+};
+
+static tstore_t ts;
+static column_t columns[COLUMNS] = {
+    {"speed", "km/h", 0.5, 0},
+    {"coolant", "C", 0.1, -40},
+    //Deltas big enough to need most of a varint, and swinging both ways
+    {"extreme", "", 1, 0},
+};
+static uint64_t mono[SAMPLES];
+
+static double value_of(int column, int i) {
+    switch(column) {
+        case 0: return (i % 511) * 0.5;
+        case 1: return -40 + (i % 1650) * 0.1;
+        default: return (i & 1 ? -1 : 1) * (double)((1LL << 46) + i);
+    }
+}
+
+static void on_sample(const char *name, const char *unit, uint64_t time, double value, void *ctx) {
+    int i;
+    
+    for(i=0; i<COLUMNS; i++) {
+        column_t *c = &columns[i];
+        if(strcmp(c->name, name) != 0) continue;
+        
+        CHECK(strcmp(c->unit, unit) == 0);
+        if(c->count < SAMPLES) {
+            c->times[c->count] = time;
+            c->values[c->count] = value;
+        }
+        c->count ++;
+    }
+}
+
+static void reset_counts(void) {
+    int i;
+    
+    for(i=0; i<COLUMNS; i++) columns[i].count = 0;
+}
+
+static void remove_dir(const char *dir) {
+    struct dirent *entry;
+    DIR *d = opendir(dir);
+    char path[TSTORE_PATH_MAX + 256];
+    
+    while(d && (entry = readdir(d)) != NULL) {
+        if(entry->d_name[0] == '.') continue;
+        snprintf(path, sizeof path, "%s/%s", dir, entry->d_name);
+        unlink(path);
+    }
+    if(d) closedir(d);
+    rmdir(dir);
+}
+
+int main(void) {
+    char dir[] = "/tmp/tstore_testXXXXXX";
+    struct timespec now;
+    uint64_t wall;
+    uint64_t base;
+    int i, c;
+    
+    if(mkdtemp(dir) == NULL) return EXIT_FAILURE;
+    
+    CHECK(tstore_init(&ts, dir) == 0);
+    for(c=0; c<COLUMNS; c++) {
+        columns[c].index = tstore_add_column(&ts, columns[c].name, columns[c].unit, columns[c].scale, columns[c].offset);
+        CHECK(columns[c].index == c);
+    }
+    CHECK(tstore_start(&ts) == 0);
+    
+    //All in the past, a ms apart with the odd long gap
+    clock_gettime(CLOCK_REALTIME, &now);
+    wall = (uint64_t)now.tv_sec*1000000 + now.tv_nsec/1000;
+    base = j1850_now_us() - 60000000;
+    for(i=0; i<SAMPLES; i++) mono[i] = base + i*1000ULL + (i / 5000) * 3000000ULL;
+    
+    for(i=0; i<SAMPLES; i++) {
+        for(c=0; c<COLUMNS; c++) CHECK(tstore_append(&ts, c, mono[i], value_of(c, i)) == 0);
+        //Leave the writer room so nothing's dropped
+        if(i % (BATCH / COLUMNS) == 0) {
+            while(__atomic_load_n(&ts.tail, __ATOMIC_ACQUIRE) != ts.head) nanosleep((const struct timespec[]){{0, 10000000}}, NULL);
+        }
+    }
+    tstore_stop(&ts);
+    CHECK(ts.dropped == 0);
+    CHECK(ts.chunks > 1);
+    
+    CHECK(tstore_query(dir, 0, UINT64_MAX, NULL, on_sample, NULL) == 0);
+    for(c=0; c<COLUMNS; c++) {
+        column_t *col = &columns[c];
+        int wrong_value = 0;
+        int wrong_time = 0;
+        
+        CHECK(col->count == SAMPLES);
+        if(col->count != SAMPLES) continue;
+        
+        //Stored in wall clock time, the monotonic spacing kept
+        CHECK(llabs((int64_t)(col->times[0] - (wall - 60000000))) < 1000000);
+        for(i=0; i<SAMPLES; i++) {
+            if(fabs(col->values[i] - value_of(c, i)) > col->scale / 2) wrong_value ++;
+            if(llabs((int64_t)((col->times[i] - col->times[0]) - (mono[i] - mono[0]))) > CLOCK_SLACK_US) wrong_time ++;
+        }
+        CHECK(wrong_value == 0);
+        CHECK(wrong_time == 0);
+    }
+    
+    //Only the range asked for, of only the column asked for
+    reset_counts();
+    {
+        uint64_t from = columns[0].times[5000];
+        uint64_t to = columns[0].times[5999];
+        CHECK(tstore_query(dir, from, to, "speed", on_sample, NULL) == 0);
+        CHECK(columns[0].count == 1000 && columns[1].count == 0 && columns[2].count == 0);
+    }
+    
+    remove_dir(dir);
+    return TEST_RESULT();
+}
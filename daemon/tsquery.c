@@ -0,0 +1,62 @@
+/*
+ * tsquery.c - Reads decoded signals back out of the telemetry store
+ *
+ * Prints every sample between two times as CSV, only reading the chunks
+ * that overlap them.
+ *
+ * Usage: tsquery [-f from] [-t to] [-c signal] dir_or_file...
+ * Times are seconds since the epoch, or negative for seconds before now
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include <stdint.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "tstore.h"
+
+static uint64_t parse_time(const char *arg, uint64_t now) {
+    double seconds = strtod(arg, NULL);
+    
+    if(seconds < 0) return now + seconds * 1000000;
+    return seconds * 1000000;
+}
+
+static void print_sample(const char *column, const char *unit, uint64_t time, double value, void *ctx) {
+    printf("%llu.%06llu,%s,%.10g,%s\n", (unsigned long long)(time / 1000000), (unsigned long long)(time % 1000000), column, value, unit);
+}
+
+int main(int argc, char *argv[]) {
+    struct timespec ts;
+    uint64_t now;
+    uint64_t from = 0;
+    uint64_t to = UINT64_MAX;
+    const char *column = NULL;
+    int ret = 0;
+    int opt;
+    
+    clock_gettime(CLOCK_REALTIME, &ts);
+    now = (uint64_t)ts.tv_sec*1000000 + ts.tv_nsec/1000;
+    
+    while((opt = getopt(argc, argv, "f:t:c:")) != -1) {
+        switch(opt) {
+        case 'f': from = parse_time(optarg, now); break;
+        case 't': to = parse_time(optarg, now); break;
+        case 'c': column = optarg; break;
+        default:
+        usage:
+            fprintf(stderr, "Usage: %s [-f from] [-t to] [-c signal] dir_or_file...\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if(optind == argc) goto usage;
+    
+    printf("time,signal,value,unit\n");
+    for(; optind<argc; optind++) {
+        if(tstore_query(argv[optind], from, to, column, print_sample, NULL) < 0) ret = EXIT_FAILURE;
+    }
+    
+    return ret;
+}
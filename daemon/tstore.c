@@ -0,0 +1,549 @@
+/*
+ * tstore.c - Columnar telemetry store for decoded signals
+ *
+ * The daemon appends samples to a lock free ring and a writer thread takes
+ * them off into a column per signal. Every TSTORE_CHUNK_BYTES or
+ * TSTORE_CHUNK_US the columns go out as one chunk, each column compressed
+ * on its own, in a single write. Files are a magic then chunks:
+ *
+ *   bytes u32, ncolumns u16, first u64, last u64     chunk header
+ *   per column:
+ *     name_len u8, name, unit_len u8, unit
+ *     scale f64, offset f64, count u32, len u32, zlen u32, zlen bytes
+ *
+ * all little endian. Readers skip chunks outside the time range they want
+ * on the header alone, and columns they don't want without inflating them.
+ *
+ * Samples are taken on the monotonic clock and each column's time deltas
+ * start from the chunk's first. Only the header is in wall clock time, the
+ * offset taken when the chunk's written, so a clock NTP sets after boot
+ * is right from the next chunk on.
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <math.h>
+#include <dirent.h>
+#include <zlib.h>
+#include <sys/stat.h>
+#include "j1850.h"
+#include "tstore.h"
+
+#define TSTORE_HEADER_BYTES 22
+//Most a sample can take encoded, two 10 byte varints
+#define TSTORE_SAMPLE_MAX 20
+
+static void put_u16(uint8_t *p, uint16_t v) {
+    p[0] = v;
+    p[1] = v >> 8;
+}
+
+static void put_u32(uint8_t *p, uint32_t v) {
+    put_u16(p, v);
+    put_u16(p + 2, v >> 16);
+}
+
+static void put_u64(uint8_t *p, uint64_t v) {
+    put_u32(p, v);
+    put_u32(p + 4, v >> 32);
+}
+
+static uint16_t get_u16(const uint8_t *p) {
+    return p[0] | (p[1] << 8);
+}
+
+static uint32_t get_u32(const uint8_t *p) {
+    return get_u16(p) | ((uint32_t)get_u16(p + 2) << 16);
+}
+
+static uint64_t get_u64(const uint8_t *p) {
+    return get_u32(p) | ((uint64_t)get_u32(p + 4) << 32);
+}
+
+static void put_f64(uint8_t *p, double v) {
+    uint64_t bits;
+    
+    memcpy(&bits, &v, sizeof bits);
+    put_u64(p, bits);
+}
+
+static double get_f64(const uint8_t *p) {
+    uint64_t bits = get_u64(p);
+    double v;
+    
+    memcpy(&v, &bits, sizeof v);
+    return v;
+}
+
+static int put_varint(uint8_t *p, uint64_t v) {
+    int n = 0;
+    
+    while(v >= 0x80) {
+        p[n++] = v | 0x80;
+        v >>= 7;
+    }
+    p[n++] = v;
+    
+    return n;
+}
+
+static int get_varint(const uint8_t *p, const uint8_t *end, uint64_t *v) {
+    int n = 0;
+    int shift = 0;
+    
+    *v = 0;
+    while(p + n < end && shift < 64) {
+        *v |= (uint64_t)(p[n] & 0x7F) << shift;
+        if(!(p[n++] & 0x80)) return n;
+        shift += 7;
+    }
+    
+    return -1;
+}
+
+//Small differences either way become small varints
+static uint64_t zigzag(int64_t v) {
+    return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+static int64_t unzigzag(uint64_t v) {
+    return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+int tstore_init(tstore_t *ts, const char *dir) {
+    memset(ts, 0, sizeof *ts);
+    ts->fd = -1;
+    if(snprintf(ts->dir, sizeof ts->dir, "%s", dir) >= (int)sizeof ts->dir) return -1;
+    
+    if(mkdir(dir, 0755) < 0 && access(dir, W_OK) < 0) {
+        printf("Can't write telemetry to %s\n", dir);
+        return -1;
+    }
+    
+    return 0;
+}
+
+/*
+ * Adds a column for values that are whole numbers once offset is taken off
+ * and they're divided by scale, returns its index. Only before starting
+ */
+int tstore_add_column(tstore_t *ts, const char *name, const char *unit, double scale, double offset) {
+    tstore_column_t *column;
+    
+    if(ts->ncolumns == TSTORE_MAX_COLUMNS || scale == 0) return -1;
+    
+    column = &ts->columns[ts->ncolumns];
+    snprintf(column->name, sizeof column->name, "%s", name);
+    snprintf(column->unit, sizeof column->unit, "%s", unit);
+    column->scale = scale;
+    column->offset = offset;
+    
+    return ts->ncolumns++;
+}
+
+/*
+ * Queues a sample for the writer, timestamp is from j1850_now_us().
+ * Never blocks, when the writer's behind the sample is dropped
+ */
+int tstore_append(tstore_t *ts, int column, uint64_t timestamp, double value) {
+    tstore_sample_t *sample;
+    
+    if(column < 0 || column >= ts->ncolumns) return -1;
+    
+    if(ts->head - __atomic_load_n(&ts->tail, __ATOMIC_ACQUIRE) >= TSTORE_RING_SIZE) {
+        __atomic_fetch_add(&ts->dropped, 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+    
+    sample = &ts->ring[ts->head % TSTORE_RING_SIZE];
+    sample->time = timestamp;
+    sample->raw = llround((value - ts->columns[column].offset) / ts->columns[column].scale);
+    sample->column = column;
+    __atomic_store_n(&ts->head, ts->head + 1, __ATOMIC_RELEASE);
+    
+    return 0;
+}
+
+/*
+ * Wall clock us less j1850_now_us(), taken fresh for every chunk
+ */
+static int64_t clock_offset(void) {
+    struct timespec now;
+    
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (int64_t)((uint64_t)now.tv_sec*1000000 + now.tv_nsec/1000) - (int64_t)j1850_now_us();
+}
+
+/*
+ * Starts a new file, never one that's already there. Its chunks would be
+ * from another run or from before the clock stepped back, and readers count
+ * on a file's chunks being in time order
+ */
+static int open_file(tstore_t *ts, uint64_t first) {
+    char path[TSTORE_PATH_MAX + 32];
+    int i;
+    
+    if(ts->fd >= 0) close(ts->fd);
+    ts->fd = -1;
+    
+    ts->file_start = first;
+    for(i=0; i<TSTORE_FILE_SUFFIXES && ts->fd < 0; i++) {
+        if(i == 0) snprintf(path, sizeof path, "%s/%llu" TSTORE_FILE_EXT, ts->dir, (unsigned long long)(first / 1000000));
+        else snprintf(path, sizeof path, "%s/%llu-%i" TSTORE_FILE_EXT, ts->dir, (unsigned long long)(first / 1000000), i);
+        ts->fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+        if(ts->fd < 0 && errno != EEXIST) break;
+    }
+    if(ts->fd < 0) {
+        printf("Error opening telemetry file %s\n", path);
+        return -1;
+    }
+    
+    if(write(ts->fd, TSTORE_FILE_MAGIC, 4) != 4) {
+        close(ts->fd);
+        ts->fd = -1;
+        return -1;
+    }
+    
+    return 0;
+}
+
+/*
+ * Compresses every column with samples in it into one chunk and writes it out
+ */
+static int flush_chunk(tstore_t *ts) {
+    uint8_t *chunk;
+    unsigned int size = TSTORE_HEADER_BYTES;
+    unsigned int pos = TSTORE_HEADER_BYTES;
+    int64_t offset = clock_offset();
+    uint64_t first = ts->chunk_first + offset;
+    int ncolumns = 0;
+    int ret = 0;
+    int i;
+    
+    if(ts->chunk_bytes == 0) return 0;
+    
+    for(i=0; i<ts->ncolumns; i++) {
+        if(ts->columns[i].count) size += 2 + TSTORE_NAME_MAX + TSTORE_UNIT_MAX + 28 + compressBound(ts->columns[i].len);
+    }
+    
+    chunk = malloc(size);
+    if(chunk == NULL) return -1;
+    
+    for(i=0; i<ts->ncolumns; i++) {
+        tstore_column_t *column = &ts->columns[i];
+        int name_len = strlen(column->name);
+        int unit_len = strlen(column->unit);
+        uLongf zlen;
+        
+        if(column->count == 0) continue;
+        
+        chunk[pos++] = name_len;
+        memcpy(&chunk[pos], column->name, name_len);
+        pos += name_len;
+        chunk[pos++] = unit_len;
+        memcpy(&chunk[pos], column->unit, unit_len);
+        pos += unit_len;
+        put_f64(&chunk[pos], column->scale);
+        put_f64(&chunk[pos + 8], column->offset);
+        put_u32(&chunk[pos + 16], column->count);
+        put_u32(&chunk[pos + 20], column->len);
+        pos += 28;
+        
+        zlen = size - pos;
+        if(compress2(&chunk[pos], &zlen, column->buf, column->len, Z_BEST_COMPRESSION) != Z_OK) {
+            ret = -1;
+            break;
+        }
+        put_u32(&chunk[pos - 4], zlen);
+        pos += zlen;
+        ncolumns ++;
+    }
+    
+    //Each chunk's deltas start over so it can be read on its own
+    for(i=0; i<ts->ncolumns; i++) {
+        ts->columns[i].len = 0;
+        ts->columns[i].count = 0;
+        ts->columns[i].last_time = 0;
+        ts->columns[i].last_raw = 0;
+    }
+    
+    put_u32(&chunk[0], pos - TSTORE_HEADER_BYTES);
+    put_u16(&chunk[4], ncolumns);
+    put_u64(&chunk[6], first);
+    put_u64(&chunk[14], ts->chunk_last + offset);
+    
+    //A clock stepped back starts a new file too
+    if(ret == 0 && (ts->fd < 0 || first < ts->file_last || first - ts->file_start >= TSTORE_FILE_US)) ret = open_file(ts, first);
+    if(ret == 0) {
+        ts->file_last = ts->chunk_last + offset;
+        if(write(ts->fd, chunk, pos) != (ssize_t)pos) ret = -1;
+        //Once per chunk so a power cut loses at most the chunk being built
+        else fdatasync(ts->fd);
+    }
+    if(ret < 0) printf("Error writing telemetry chunk\n");
+    
+    ts->raw_bytes += ts->chunk_bytes;
+    ts->written_bytes += pos;
+    ts->chunks ++;
+    ts->chunk_bytes = 0;
+    free(chunk);
+    
+    return ret;
+}
+
+static int encode_sample(tstore_t *ts, const tstore_sample_t *sample) {
+    tstore_column_t *column = &ts->columns[sample->column];
+    int n;
+    
+    if(column->len + TSTORE_SAMPLE_MAX > column->size) {
+        unsigned int size = column->size ? column->size * 2 : 256;
+        uint8_t *buf = realloc(column->buf, size);
+        if(buf == NULL) return -1;
+        column->buf = buf;
+        column->size = size;
+    }
+    
+    if(ts->chunk_bytes == 0) ts->chunk_first = sample->time;
+    ts->chunk_last = sample->time;
+    
+    n = put_varint(&column->buf[column->len], zigzag(sample->time - (column->count ? column->last_time : ts->chunk_first)));
+    n += put_varint(&column->buf[column->len + n], zigzag(sample->raw - column->last_raw));
+    column->len += n;
+    column->count ++;
+    column->last_time = sample->time;
+    column->last_raw = sample->raw;
+    ts->chunk_bytes += n;
+    
+    return 0;
+}
+
+/*
+ * Takes everything the daemon has appended, chunks go out as they fill so
+ * the columns never hold much more than TSTORE_CHUNK_BYTES
+ */
+static void drain(tstore_t *ts) {
+    unsigned int head = __atomic_load_n(&ts->head, __ATOMIC_ACQUIRE);
+    
+    while(ts->tail != head) {
+        if(encode_sample(ts, &ts->ring[ts->tail % TSTORE_RING_SIZE]) < 0) __atomic_fetch_add(&ts->dropped, 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&ts->tail, ts->tail + 1, __ATOMIC_RELEASE);
+        
+        if(ts->chunk_bytes >= TSTORE_CHUNK_BYTES) flush_chunk(ts);
+    }
+}
+
+static void *tstore_main(void *arg) {
+    tstore_t *ts = arg;
+    
+    while(ts->running) {
+        drain(ts);
+        if(ts->chunk_bytes && j1850_now_us() - ts->chunk_first >= TSTORE_CHUNK_US) flush_chunk(ts);
+        
+        nanosleep((const struct timespec[]){{0, TSTORE_POLL_NS}}, NULL);
+    }
+    
+    drain(ts);
+    flush_chunk(ts);
+    
+    return NULL;
+}
+
+int tstore_start(tstore_t *ts) {
+    ts->running = 1;
+    if(pthread_create(&ts->thread, NULL, tstore_main, ts)) {
+        ts->running = 0;
+        return -1;
+    }
+    
+    return 0;
+}
+
+/*
+ * Writes out whatever's left and frees the columns
+ */
+void tstore_stop(tstore_t *ts) {
+    int i;
+    
+    if(ts->running) {
+        ts->running = 0;
+        pthread_join(ts->thread, NULL);
+    }
+    
+    if(ts->fd >= 0) close(ts->fd);
+    ts->fd = -1;
+    for(i=0; i<ts->ncolumns; i++) {
+        free(ts->columns[i].buf);
+        ts->columns[i].buf = NULL;
+        ts->columns[i].size = 0;
+    }
+}
+
+static int query_column(const uint8_t *p, const uint8_t *end, const char *name, const char *unit, uint64_t first, uint64_t from, uint64_t to, tstore_callback_t callback, void *ctx) {
+    double scale = get_f64(p);
+    double offset = get_f64(p + 8);
+    uint32_t count = get_u32(p + 16);
+    uLongf len = get_u32(p + 20);
+    uint32_t zlen = get_u32(p + 24);
+    uint8_t *buf;
+    uint64_t time = first;
+    int64_t raw = 0;
+    unsigned int pos = 0;
+    uint32_t i;
+    
+    if(p + 28 + zlen > end) return -1;
+    
+    buf = malloc(len ? len : 1);
+    if(buf == NULL) return -1;
+    if(uncompress(buf, &len, p + 28, zlen) != Z_OK) {
+        free(buf);
+        return -1;
+    }
+    
+    for(i=0; i<count; i++) {
+        uint64_t delta;
+        int n;
+        
+        n = get_varint(&buf[pos], buf + len, &delta);
+        if(n < 0) break;
+        time += unzigzag(delta);
+        pos += n;
+        n = get_varint(&buf[pos], buf + len, &delta);
+        if(n < 0) break;
+        raw += unzigzag(delta);
+        pos += n;
+        
+        if(time > to) break;
+        if(time >= from) callback(name, unit, time, raw * scale + offset, ctx);
+    }
+    
+    free(buf);
+    return i == count || time > to ? 0 : -1;
+}
+
+static int query_file(const char *path, uint64_t from, uint64_t to, const char *column, tstore_callback_t callback, void *ctx) {
+    uint8_t header[TSTORE_HEADER_BYTES];
+    uint8_t *chunk = NULL;
+    int ret = 0;
+    int fd;
+    
+    fd = open(path, O_RDONLY);
+    if(fd < 0) {
+        printf("Can't open %s\n", path);
+        return -1;
+    }
+    if(read(fd, header, 4) != 4 || memcmp(header, TSTORE_FILE_MAGIC, 4) != 0) {
+        printf("%s isn't a telemetry file\n", path);
+        close(fd);
+        return -1;
+    }
+    
+    while(read(fd, header, sizeof header) == sizeof header) {
+        uint32_t bytes = get_u32(&header[0]);
+        uint16_t ncolumns = get_u16(&header[4]);
+        const uint8_t *p;
+        const uint8_t *end;
+        int i;
+        
+        //Chunks are in time order, so past the end means done
+        if(get_u64(&header[6]) > to) break;
+        if(get_u64(&header[14]) < from) {
+            if(lseek(fd, bytes, SEEK_CUR) < 0) break;
+            continue;
+        }
+        
+        free(chunk);
+        chunk = malloc(bytes);
+        if(chunk == NULL || read(fd, chunk, bytes) != (ssize_t)bytes) {
+            ret = -1;
+            break;
+        }
+        
+        p = chunk;
+        end = chunk + bytes;
+        for(i=0; i<ncolumns && ret == 0; i++) {
+            char name[TSTORE_NAME_MAX];
+            char unit[TSTORE_UNIT_MAX];
+            int name_len = p[0];
+            int unit_len;
+            
+            if(name_len >= TSTORE_NAME_MAX || p + 1 + name_len >= end) ret = -1;
+            else {
+                memcpy(name, p + 1, name_len);
+                name[name_len] = '\0';
+                p += 1 + name_len;
+                unit_len = p[0];
+                if(unit_len >= TSTORE_UNIT_MAX || p + 1 + unit_len + 28 > end) ret = -1;
+                else {
+                    memcpy(unit, p + 1, unit_len);
+                    unit[unit_len] = '\0';
+                    p += 1 + unit_len;
+                    
+                    if(column == NULL || strcmp(column, name) == 0) ret = query_column(p, end, name, unit, get_u64(&header[6]), from, to, callback, ctx);
+                    p += 28 + get_u32(p + 24);
+                }
+            }
+        }
+        if(ret < 0) {
+            printf("Corrupt chunk in %s\n", path);
+            break;
+        }
+    }
+    
+    free(chunk);
+    close(fd);
+    return ret;
+}
+
+static int is_tstore_file(const struct dirent *entry) {
+    int len = strlen(entry->d_name);
+    int ext = strlen(TSTORE_FILE_EXT);
+    
+    return len > ext && strcmp(entry->d_name + len - ext, TSTORE_FILE_EXT) == 0;
+}
+
+/*
+ * Calls callback with every sample of column, or every column if NULL,
+ * from a file or a directory of them between from and to in wall clock us
+ */
+int tstore_query(const char *path, uint64_t from, uint64_t to, const char *column, tstore_callback_t callback, void *ctx) {
+    struct dirent **entries;
+    struct stat st;
+    int nentries;
+    int ret = 0;
+    int i;
+    
+    if(stat(path, &st) < 0) {
+        printf("Can't find %s\n", path);
+        return -1;
+    }
+    if(!S_ISDIR(st.st_mode)) return query_file(path, from, to, column, callback, ctx);
+    
+    //Names are the start time in seconds, all the same length for centuries
+    nentries = scandir(path, &entries, is_tstore_file, alphasort);
+    if(nentries < 0) return -1;
+    
+    for(i=0; i<nentries; i++) {
+        char file[TSTORE_PATH_MAX + 256];
+        uint64_t start = strtoull(entries[i]->d_name, NULL, 10) * 1000000;
+        
+        //After the clock's stepped back an earlier file can run on past the
+        //start of later ones, so only its start says anything. Chunks out of
+        //range are skipped on their headers
+        if(ret == 0 && start <= to) {
+            snprintf(file, sizeof file, "%s/%s", path, entries[i]->d_name);
+            ret = query_file(file, from, to, column, callback, ctx);
+        }
+        free(entries[i]);
+    }
+    free(entries);
+    
+    return ret;
+}
@@ -0,0 +1,109 @@
+/*
+ * tstore.h - Columnar telemetry store for decoded signals
+ */
+
+#ifndef __TSTORE_H__
+#define __TSTORE_H__
+
+#include <stdint.h>
+#include <pthread.h>
+
+#define TSTORE_MAX_COLUMNS 1024
+#define TSTORE_NAME_MAX 32
+#define TSTORE_UNIT_MAX 16
+#define TSTORE_PATH_MAX 256
+
+//Samples waiting for the writer, anything past this is dropped and counted
+#define TSTORE_RING_SIZE 4096
+//A chunk goes out once it has this many encoded bytes or is this old,
+//whichever is first. Big chunks mean few writes to the SD card
+#define TSTORE_CHUNK_BYTES (64*1024)
+#define TSTORE_CHUNK_US 60000000ULL
+//A new file is started this often, named by its first chunk's time, or
+//sooner if the clock steps back. Names already taken get -1, -2... added
+#define TSTORE_FILE_US 3600000000ULL
+#define TSTORE_FILE_SUFFIXES 100
+#define TSTORE_POLL_NS 100000000L
+
+#define TSTORE_FILE_MAGIC "TSC2"
+#define TSTORE_FILE_EXT ".tsc"
+
+typedef struct tstore_sample_t tstore_sample_t;
+typedef struct tstore_column_t tstore_column_t;
+typedef struct tstore_chunk_t tstore_chunk_t;
+typedef struct tstore_t tstore_t;
+
+typedef void (*tstore_callback_t)(const char *column, const char *unit, uint64_t time, double value, void *ctx);
+
+struct tstore_sample_t {
+    uint64_t time;
+    int64_t raw;
+    uint16_t column;
+};
+
+/*
+ * One signal's values, stored as whole numbers that scale and offset turn
+ * back into the value. Time and value are each the difference from the one
+ * before, zigzagged and as varints
+ */
+struct tstore_column_t {
+    char name[TSTORE_NAME_MAX];
+    char unit[TSTORE_UNIT_MAX];
+    double scale;
+    double offset;
+    
+    //Only touched by the writer once started
+    uint8_t *buf;
+    unsigned int len;
+    unsigned int size;
+    unsigned int count;
+    uint64_t last_time;
+    int64_t last_raw;
+};
+
+/*
+ * What's at the start of every chunk, enough to skip over it unread.
+ * bytes is everything after the header
+ */
+struct tstore_chunk_t {
+    uint32_t bytes;
+    uint16_t ncolumns;
+    uint64_t first;
+    uint64_t last;
+};
+
+struct tstore_t {
+    char dir[TSTORE_PATH_MAX];
+    pthread_t thread;
+    volatile int running;
+    
+    tstore_column_t columns[TSTORE_MAX_COLUMNS];
+    int ncolumns;
+    
+    //Single producer/single consumer, the daemon appends and the writer takes
+    tstore_sample_t ring[TSTORE_RING_SIZE];
+    unsigned int head;
+    unsigned int tail;
+    //Bumped by both the daemon and the writer
+    unsigned int dropped;
+    
+    //Only touched by the writer once started
+    int fd;
+    uint64_t file_start;
+    uint64_t file_last;
+    uint64_t chunk_first;
+    uint64_t chunk_last;
+    unsigned int chunk_bytes;
+    unsigned int chunks;
+    uint64_t raw_bytes;
+    uint64_t written_bytes;
+};
+
+int tstore_init(tstore_t *ts, const char *dir);
+int tstore_add_column(tstore_t *ts, const char *name, const char *unit, double scale, double offset);
+int tstore_start(tstore_t *ts);
+void tstore_stop(tstore_t *ts);
+int tstore_append(tstore_t *ts, int column, uint64_t timestamp, double value);
+int tstore_query(const char *path, uint64_t from, uint64_t to, const char *column, tstore_callback_t callback, void *ctx);
+
+#endif // __TSTORE_H__
@@ -0,0 +1,482 @@
+/*
+ * bench.c - Cycle accurate firmware benchmarks under simavr
+ *
+ * Runs the built firmware, drives VPW frames onto both bus inputs and plays
+ * the daemon's side of SPI against it at the same time, then reports interrupt
+ * latency, cycles spent per edge, CPU load and lost frames. Everything is
+ * seeded so two runs of the same firmware give the same numbers.
+ *
+ * Usage: bench [-b baseline] firmware.elf
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "sim_avr.h"
+#include "sim_elf.h"
+#include "sim_time.h"
+#include "sim_cycle_timers.h"
+#include "sim_interrupts.h"
+#include "avr_ioport.h"
+#include "avr_spi.h"
+
+#define BENCH_MCU "atmega328p"
+#define BENCH_FREQ 8000000
+
+//ATmega328P vectors and registers
+#define VEC_INT0 1
+#define VEC_INT1 2
+#define VEC_TIMER1_COMPA 11
+#define VEC_TIMER1_COMPB 12
+#define VEC_SPI_STC 17
+#define SPDR_ADDR 0x4E
+
+//Bus 0 receives on PD3, bus 1 on PD2
+#define BUS0_PIN 3
+#define BUS1_PIN 2
+
+//VPW symbol widths in us
+#define VPW_SHORT 64
+#define VPW_LONG 128
+#define VPW_SOF 200
+#define VPW_EOD 200
+#define VPW_IFS 300
+
+//Time for one byte over spidev including the per transfer overhead on the Pi
+#define SPI_BYTE_US 20
+//How often the daemon's SPI thread polls
+#define SPI_POLL_US 2000
+
+#define MAX_EDGES (2 + 11*8 + 2)
+#define MAX_METRICS 64
+
+typedef struct bus_gen_t bus_gen_t;
+typedef struct vec_stats_t vec_stats_t;
+typedef struct metric_t metric_t;
+
+//Plays frames onto one bus input back to back
+struct bus_gen_t {
+    avr_irq_t *pin;
+    uint32_t edges[MAX_EDGES];
+    int nedges;
+    int edge;
+    int level;
+    uint32_t seed;
+    int running;
+    unsigned int frames;
+    unsigned int bytes;
+};
+
+struct vec_stats_t {
+    const char *name;
+    int vector;
+    avr_cycle_count_t pending;
+    avr_cycle_count_t started;
+    unsigned int count;
+    uint64_t total;
+    uint64_t max_cycles;
+    uint64_t max_latency;
+};
+
+struct metric_t {
+    char name[48];
+    double value;
+};
+
+static avr_t *avr;
+static avr_irq_t *spi_in;
+static bus_gen_t gens[2];
+
+static vec_stats_t vecs[] = {
+    {.name = "int1_bus0", .vector = VEC_INT1},
+    {.name = "int0_bus1", .vector = VEC_INT0},
+    {.name = "ocr1a_bus0", .vector = VEC_TIMER1_COMPA},
+    {.name = "ocr1b_bus1", .vector = VEC_TIMER1_COMPB},
+    {.name = "spi_stc", .vector = VEC_SPI_STC},
+};
+#define NVECS (sizeof vecs / sizeof vecs[0])
+
+static uint64_t sleep_cycles;
+
+static metric_t metrics[MAX_METRICS];
+static int nmetrics;
+
+static unsigned int frames_got;
+static unsigned int frames_bad;
+
+static uint8_t crc(const uint8_t *msg_buf, int nbytes) {
+    uint8_t crc = 0xFF;
+    
+    while(nbytes--) {
+        crc ^= *msg_buf++;
+        int bit;
+        for(bit=0; bit<8; bit++) {
+            if(crc & 0x80) crc = (crc << 1) ^ 0x1D;
+            else crc <<= 1;
+        }
+    }
+    
+    return ~crc;
+}
+
+static uint32_t rnd(uint32_t *seed) {
+    *seed = *seed * 1103515245 + 12345;
+    return *seed >> 16;
+}
+
+/*
+ * Lays out the next frame as edge to edge widths, starting with SOF.
+ * Passive 1 and active 0 are long, passive 0 and active 1 are short
+ */
+static void gen_frame(bus_gen_t *gen) {
+    uint8_t frame[12];
+    int bytes = 4 + rnd(&gen->seed) % 7;
+    int i;
+    int bit;
+    int active = 0;
+    
+    frame[0] = 0x8D;
+    for(i=1; i<bytes; i++) frame[i] = rnd(&gen->seed);
+    frame[bytes] = crc(frame, bytes);
+    bytes ++;
+    
+    gen->nedges = 0;
+    gen->edges[gen->nedges++] = VPW_SOF;
+    for(i=0; i<bytes; i++) {
+        for(bit=7; bit>=0; bit--) {
+            int one = (frame[i] >> bit) & 1;
+            if(active) gen->edges[gen->nedges++] = one ? VPW_SHORT : VPW_LONG;
+            else gen->edges[gen->nedges++] = one ? VPW_LONG : VPW_SHORT;
+            active = !active;
+        }
+    }
+    //Bits always leave the bus passive, so this is EOD plus IFS before the next SOF
+    gen->edges[gen->nedges++] = VPW_EOD + VPW_IFS;
+    
+    gen->edge = 0;
+    gen->frames ++;
+    gen->bytes += bytes;
+}
+
+static avr_cycle_count_t gen_edge(avr_t *avr, avr_cycle_count_t when, void *param) {
+    bus_gen_t *gen = param;
+    
+    if(gen->edge == gen->nedges) {
+        if(!gen->running) {
+            avr_raise_irq(gen->pin, 0);
+            return 0;
+        }
+        gen_frame(gen);
+    }
+    
+    //Active is high on the receive pins
+    gen->level = !(gen->edge & 1);
+    avr_raise_irq(gen->pin, gen->level);
+    
+    return when + avr_usec_to_cycles(avr, gen->edges[gen->edge++]);
+}
+
+static void gen_start(bus_gen_t *gen, uint32_t seed) {
+    gen->seed = seed;
+    gen->running = 1;
+    gen->frames = 0;
+    gen->bytes = 0;
+    gen->edge = gen->nedges = 0;
+    avr_cycle_timer_register_usec(avr, VPW_IFS, gen_edge, gen);
+}
+
+static void vec_pending(struct avr_irq_t *irq, uint32_t value, void *param) {
+    vec_stats_t *vec = param;
+    
+    if(value) vec->pending = avr->cycle;
+}
+
+/*
+ * Cycles include anything that nests once the handler re-enables interrupts
+ */
+static void vec_running(struct avr_irq_t *irq, uint32_t value, void *param) {
+    vec_stats_t *vec = param;
+    
+    if(value) {
+        uint64_t latency = avr->cycle - vec->pending;
+        vec->started = avr->cycle;
+        if(latency > vec->max_latency) vec->max_latency = latency;
+    }
+    else {
+        uint64_t cycles = avr->cycle - vec->started;
+        vec->count ++;
+        vec->total += cycles;
+        if(cycles > vec->max_cycles) vec->max_cycles = cycles;
+    }
+}
+
+static void bench_sleep(avr_t *avr, avr_cycle_count_t how_long) {
+    sleep_cycles += how_long;
+}
+
+static void run_until(avr_cycle_count_t cycle) {
+    while(avr->cycle < cycle) {
+        int state = avr_run(avr);
+        if(state == cpu_Done || state == cpu_Crashed) {
+            fprintf(stderr, "Firmware stopped at cycle %llu\n", (unsigned long long)avr->cycle);
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+static void run_us(uint32_t us) {
+    run_until(avr->cycle + avr_usec_to_cycles(avr, us));
+}
+
+/*
+ * The byte shifted back is whatever the firmware left in SPDR
+ */
+static uint8_t xfer(uint8_t out) {
+    uint8_t in;
+    
+    run_us(SPI_BYTE_US);
+    in = avr->data[SPDR_ADDR];
+    avr_raise_irq(spi_in, out);
+    
+    return in;
+}
+
+/*
+ * The daemon's link layer, see daemon/spi.c
+ */
+static int send_data(const uint8_t *data, int len) {
+    int i;
+    
+    for(i=0; i<len; i++) {
+        xfer(0x02);
+        if(xfer(data[i]) != 0x02) return -1;
+        if(xfer(0x00) != data[i]) return -1;
+    }
+    
+    return 0;
+}
+
+static int get_data(uint8_t *buf, int size) {
+    int len = 0;
+    int more;
+    
+    xfer(0x00);
+    more = xfer(0x00);
+    while(more) {
+        xfer(0x01);
+        if(xfer(0x00) != 0x01) return -1;
+        
+        uint8_t byte = xfer(0x00);
+        if(len < size) buf[len] = byte;
+        len ++;
+        
+        more = xfer(0x00);
+    }
+    
+    if(len > size) return -1;
+    return len;
+}
+
+static int get_response(uint8_t *buf, int size) {
+    int ret;
+    int tries = 0;
+    
+    do {
+        ret = get_data(buf, size);
+        if(ret < 0) return ret;
+    } while(ret == 0 && ++tries < 1000);
+    
+    return ret;
+}
+
+static void flush(void) {
+    uint8_t buf[64];
+    
+    while(get_data(buf, sizeof buf) > 0);
+}
+
+static int command(const uint8_t *cmd, int len, uint8_t *reply, int size) {
+    flush();
+    if(send_data(cmd, len) < 0) return -1;
+    if(reply == NULL) return 0;
+    
+    return get_response(reply, size);
+}
+
+/*
+ * One pass of the daemon's SPI thread, snapshot then pop everything waiting
+ */
+static void poll_board(void) {
+    uint8_t status[12];
+    uint8_t frame[16];
+    int bus;
+    int n;
+    
+    if(command((const uint8_t[]){0x09}, 1, status, sizeof status) < 4) return;
+    
+    for(bus=0; bus<2 && bus<status[3]; bus++) {
+        for(n=status[4 + bus]; n>0; n--) {
+            int ret = command((const uint8_t[]){0x03 + bus}, 1, frame, sizeof frame);
+            if(ret <= 0 || frame[0] != 0x01) break;
+            command((const uint8_t[]){0x0E + bus}, 1, NULL, 0);
+            
+            //Present, age, then the frame with its CRC
+            frames_got ++;
+            if(ret < 5 || crc(&frame[3], ret - 4) != frame[ret - 1]) frames_bad ++;
+        }
+    }
+}
+
+static void metric(const char *name, double value) {
+    if(nmetrics == MAX_METRICS) return;
+    
+    snprintf(metrics[nmetrics].name, sizeof metrics[nmetrics].name, "%s", name);
+    metrics[nmetrics].value = value;
+    nmetrics ++;
+}
+
+static void reset_stats(void) {
+    unsigned int i;
+    
+    for(i=0; i<NVECS; i++) {
+        vecs[i].count = 0;
+        vecs[i].total = 0;
+        vecs[i].max_cycles = 0;
+        vecs[i].max_latency = 0;
+    }
+    sleep_cycles = 0;
+    frames_got = 0;
+    frames_bad = 0;
+}
+
+/*
+ * Runs for a while with the daemon polling, returns the share of cycles awake
+ */
+static double run_polling(uint32_t us) {
+    avr_cycle_count_t start = avr->cycle;
+    avr_cycle_count_t end = start + avr_usec_to_cycles(avr, us);
+    
+    while(avr->cycle < end) {
+        poll_board();
+        run_us(SPI_POLL_US);
+    }
+    
+    return 100.0 * (1.0 - (double)sleep_cycles / (avr->cycle - start));
+}
+
+static void print_metrics(const char *baseline) {
+    metric_t base[MAX_METRICS];
+    int nbase = 0;
+    int i;
+    int j;
+    
+    if(baseline) {
+        FILE *f = fopen(baseline, "r");
+        if(f == NULL) fprintf(stderr, "No baseline at %s\n", baseline);
+        else {
+            while(nbase < MAX_METRICS && fscanf(f, "%47s %lf", base[nbase].name, &base[nbase].value) == 2) nbase ++;
+            fclose(f);
+        }
+    }
+    
+    for(i=0; i<nmetrics; i++) {
+        printf("%-32s %12.2f", metrics[i].name, metrics[i].value);
+        for(j=0; j<nbase; j++) {
+            if(strcmp(base[j].name, metrics[i].name)) continue;
+            printf("   # baseline %.2f", base[j].value);
+            if(base[j].value != 0) printf(" (%+.1f%%)", 100.0 * (metrics[i].value - base[j].value) / base[j].value);
+            break;
+        }
+        printf("\n");
+    }
+}
+
+int main(int argc, char *argv[]) {
+    elf_firmware_t fw = {{0}};
+    const char *baseline = NULL;
+    char name[48];
+    unsigned int i;
+    int opt;
+    
+    while ((opt = getopt(argc, argv, "b:")) != -1) {
+        switch (opt) {
+        case 'b': baseline = optarg; break;
+        default:
+            fprintf(stderr, "Usage: %s [-b baseline] firmware.elf\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if(optind >= argc) {
+        fprintf(stderr, "Usage: %s [-b baseline] firmware.elf\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    
+    if(elf_read_firmware(argv[optind], &fw) < 0) {
+        fprintf(stderr, "Couldn't read %s\n", argv[optind]);
+        exit(EXIT_FAILURE);
+    }
+    if(fw.mmcu[0] == 0) strcpy(fw.mmcu, BENCH_MCU);
+    if(fw.frequency == 0) fw.frequency = BENCH_FREQ;
+    
+    avr = avr_make_mcu_by_name(fw.mmcu);
+    if(avr == NULL) {
+        fprintf(stderr, "Unknown MCU %s\n", fw.mmcu);
+        exit(EXIT_FAILURE);
+    }
+    avr_init(avr);
+    avr_load_firmware(avr, &fw);
+    
+    //Count sleep instead of waiting it out in real time
+    avr->sleep = bench_sleep;
+    
+    for(i=0; i<NVECS; i++) {
+        avr_irq_t *irq = avr_get_interrupt_irq(avr, vecs[i].vector);
+        if(irq == NULL) continue;
+        avr_irq_register_notify(irq + AVR_INT_IRQ_PENDING, vec_pending, &vecs[i]);
+        avr_irq_register_notify(irq + AVR_INT_IRQ_RUNNING, vec_running, &vecs[i]);
+    }
+    
+    gens[0].pin = avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('D'), BUS0_PIN);
+    gens[1].pin = avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('D'), BUS1_PIN);
+    spi_in = avr_io_getirq(avr, AVR_IOCTL_SPI_GETIRQ(0), SPI_IRQ_INPUT);
+    
+    //Let it boot, then take the satellite over and listen to everything
+    run_us(100000);
+    command((const uint8_t[]){0x0D, 0x01}, 2, NULL, 0);
+    command((const uint8_t[]){0x05}, 1, NULL, 0);
+    
+    //Quiet buses, just the daemon polling
+    reset_stats();
+    metric("load_idle_pct", run_polling(1000000));
+    
+    //Both buses flat out
+    reset_stats();
+    gen_start(&gens[0], 1);
+    gen_start(&gens[1], 2);
+    metric("load_busy_pct", run_polling(2000000));
+    
+    //Let the last frames in and drain them
+    gens[0].running = 0;
+    gens[1].running = 0;
+    run_polling(100000);
+    
+    for(i=0; i<NVECS; i++) {
+        snprintf(name, sizeof name, "%s_latency_max_cycles", vecs[i].name);
+        metric(name, vecs[i].max_latency);
+        snprintf(name, sizeof name, "%s_cycles_mean", vecs[i].name);
+        metric(name, vecs[i].count ? (double)vecs[i].total / vecs[i].count : 0);
+        snprintf(name, sizeof name, "%s_cycles_max", vecs[i].name);
+        metric(name, vecs[i].max_cycles);
+    }
+    
+    metric("frames_sent", gens[0].frames + gens[1].frames);
+    metric("frames_received", frames_got);
+    metric("frames_lost", (double)(gens[0].frames + gens[1].frames) - frames_got);
+    metric("frames_bad", frames_bad);
+    
+    print_metrics(baseline);
+    
+    return 0;
+}
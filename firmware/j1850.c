@@ -3,54 +3,144 @@
  */
 #include "j1850.h"
 
-static inline void set_ocr(j1850_bus_t *bus, uint8_t cnt) {
-    if(bus == &j1850_bus[0]) {
-        J1850_BUS0_OCR_REG = cnt;
-        J1850_BUS0_OCF_REG |= J1850_BUS0_OCF_MSK;
-        J1850_BUS0_OCIE_REG |= J1850_BUS0_OCIE_MSK;
+_Static_assert(sizeof(j1850_bus) <= J1850_BUS_RAM_MAX, "J1850 bus buffers don't fit, build with a smaller J1850_RX_RING_SIZE");
+
+static j1850_tx_report_t tx_reports[J1850_TX_REPORT_BUF_SIZE];
+static volatile uint8_t tx_report_start;
+static volatile uint8_t tx_report_end;
+
+/*
+ * Hardware helpers. bus is always a constant once these are inlined into the
+ * per bus interrupts, so each switch boils down to the one bus's registers
+ */
+#define SET_OCR(n) case n: \
+        J1850_BUS##n##_OCR_REG = cnt; \
+        J1850_BUS##n##_OCF_REG |= J1850_BUS##n##_OCF_MSK; \
+        J1850_BUS##n##_OCIE_REG |= J1850_BUS##n##_OCIE_MSK; \
+        break;
+#define STOP_OCR(n) case n: J1850_BUS##n##_OCIE_REG &= ~J1850_BUS##n##_OCIE_MSK; break;
+#define SET_PORT(n) case n: J1850_BUS##n##_PORT_REG |= J1850_BUS##n##_PORT_MSK; break;
+#define CLEAR_PORT(n) case n: J1850_BUS##n##_PORT_REG &= ~J1850_BUS##n##_PORT_MSK; break;
+#define TOGGLE_PORT(n) case n: J1850_BUS##n##_PORT_REG = J1850_BUS##n##_PORT_REG ^ J1850_BUS##n##_PORT_MSK; break;
+#define GET_PORT(n) case n: return J1850_BUS##n##_PORT_REG & J1850_BUS##n##_PORT_MSK;
+#define GET_PIN(n) case n: return J1850_BUS##n##_PIN_REG & J1850_BUS##n##_PIN_MSK;
+#define GET_TCNT(n) case n: return J1850_BUS##n##_TCNT_REG;
+
+/*
+ * OCRnx shares the high byte latch with TCNTn, so the write can't be split
+ * by a nested interrupt taking its own timestamp
+ */
+static inline __attribute__((always_inline)) void set_ocr(uint8_t bus, uint16_t cnt) {
+    uint8_t sreg = SREG;
+    cli();
+    
+    switch(bus) {
+        J1850_FOR_EACH_BUS(SET_OCR)
     }
-    else {
-        J1850_BUS1_OCR_REG = cnt;
-        J1850_BUS1_OCF_REG |= J1850_BUS1_OCF_MSK;
-        J1850_BUS1_OCIE_REG |= J1850_BUS1_OCIE_MSK;
+    
+    SREG = sreg;
+}
+
+static inline __attribute__((always_inline)) void stop_ocr(uint8_t bus) {
+    switch(bus) {
+        J1850_FOR_EACH_BUS(STOP_OCR)
     }
 }
 
-static inline void stop_ocr(j1850_bus_t *bus) {
-    if(bus == &j1850_bus[0]) J1850_BUS0_OCIE_REG &= ~J1850_BUS0_OCIE_MSK;
-    else J1850_BUS1_OCIE_REG &= ~J1850_BUS1_OCIE_MSK;
+static inline __attribute__((always_inline)) void set_port(uint8_t bus) {
+    switch(bus) {
+        J1850_FOR_EACH_BUS(SET_PORT)
+    }
 }
 
-static inline void set_port(j1850_bus_t *bus) {
-    if(bus == &j1850_bus[0]) J1850_BUS0_PORT_REG |= J1850_BUS0_PORT_MSK;
-    else J1850_BUS1_PORT_REG |= J1850_BUS1_PORT_MSK;
+static inline __attribute__((always_inline)) void clear_port(uint8_t bus) {
+    switch(bus) {
+        J1850_FOR_EACH_BUS(CLEAR_PORT)
+    }
 }
 
-static inline void clear_port(j1850_bus_t *bus) {
-    if(bus == &j1850_bus[0]) J1850_BUS0_PORT_REG &= ~J1850_BUS0_PORT_MSK;
-    else J1850_BUS1_PORT_REG &= ~J1850_BUS1_PORT_MSK;
+static inline __attribute__((always_inline)) void toggle_port(uint8_t bus) {
+    switch(bus) {
+        J1850_FOR_EACH_BUS(TOGGLE_PORT)
+    }
+}
+
+static inline __attribute__((always_inline)) uint8_t get_port(uint8_t bus) {
+    switch(bus) {
+        J1850_FOR_EACH_BUS(GET_PORT)
+    }
+    return 0;
+}
+
+static inline __attribute__((always_inline)) uint8_t get_pin(uint8_t bus) {
+    switch(bus) {
+        J1850_FOR_EACH_BUS(GET_PIN)
+    }
+    return 0;
 }
 
-static inline void toggle_port(j1850_bus_t *bus) {
-    if(bus == &j1850_bus[0]) J1850_BUS0_PORT_REG = J1850_BUS0_PORT_REG ^ J1850_BUS0_PORT_MSK;
-    else J1850_BUS1_PORT_REG = J1850_BUS1_PORT_REG ^ J1850_BUS1_PORT_MSK;
+static inline __attribute__((always_inline)) uint16_t get_tcnt(uint8_t bus) {
+    switch(bus) {
+        J1850_FOR_EACH_BUS(GET_TCNT)
+    }
+    return 0;
+}
+
+/*
+ * Reports how a frame went if the host gave it an id. Both bus interrupts and
+ * the main loop get here, so it's kept to itself
+ */
+static void tx_report(uint8_t bus, j1850_msg_buf_t *msg, uint8_t status) {
+    if(!msg->id) return;
+    
+    uint8_t sreg = SREG;
+    cli();
+    
+    uint8_t end = tx_report_end + 1;
+    if(end == J1850_TX_REPORT_BUF_SIZE) end = 0;
+    
+    //On overflow drop the newest report
+    if(end != tx_report_start) {
+        j1850_tx_report_t *report = &tx_reports[tx_report_end];
+        report->bus = bus;
+        report->id = msg->id;
+        report->status = status;
+        report->losses = msg->losses;
+        report->stamp = tmr_stamp();
+        tx_report_end = end;
+    }
+    
+    SREG = sreg;
 }
 
-static inline uint8_t get_port(j1850_bus_t *bus) {
-    if(bus == &j1850_bus[0]) return J1850_BUS0_PORT_REG & J1850_BUS0_PORT_MSK;
-    else return J1850_BUS1_PORT_REG & J1850_BUS1_PORT_MSK;
+/*
+ * Done with the oldest transmit message one way or another
+ */
+static inline __attribute__((always_inline)) void tx_finish(uint8_t n, uint8_t status) {
+    j1850_bus_t *bus = (j1850_bus_t *)&j1850_bus[n];
+    
+    tx_report(n, bus->tx_msg_start, status);
+    
+    bus->tx_msg_start++;
+    if(bus->tx_msg_start == &bus->tx_buf[J1850_MSG_BUF_SIZE_TX]) bus->tx_msg_start = bus->tx_buf;
+    bus->tx_count ++;
 }
 
-static inline uint8_t get_pin(j1850_bus_t *bus) {
-    if(bus == &j1850_bus[0]) return J1850_BUS0_PIN_REG & J1850_BUS0_PIN_MSK;
-    else return J1850_BUS1_PIN_REG & J1850_BUS1_PIN_MSK;
+/*
+ * Whether the frame coming in has space for another byte along with its header
+ */
+static inline uint8_t rx_room(j1850_bus_t *bus) {
+    uint8_t free = (uint8_t)(bus->rx_start - bus->rx_end - 1) & J1850_RX_RING_MASK;
+    return free > J1850_RX_HDR + bus->rx_bytes;
 }
 
-static inline void service_pcint(j1850_bus_t *bus, uint8_t pin, uint8_t tmr) {
+static inline __attribute__((always_inline)) void service_edge(uint8_t n, uint8_t pin, uint16_t tmr) {
+    j1850_bus_t *bus = (j1850_bus_t *)&j1850_bus[n];
+    
     if(!(pin ^ bus->last_pin)) return;
     bus->last_pin = pin;
     
-    uint8_t delta = tmr - bus->ltmr;
+    uint16_t delta = tmr - bus->ltmr;
     bus->ltmr = tmr;
     
     switch(bus->state) {
@@ -65,22 +155,22 @@ static inline void service_pcint(j1850_bus_t *bus, uint8_t pin, uint8_t tmr) {
             }
             else {
                 bus->state = 0x02;
-                bus->rx_msg_end->bytes = 0;
+                bus->rx_bytes = 0;
                 bus->bit_ptr = 0;
-                bus->byte_ptr = bus->rx_msg_end->buf;
+                bus->byte_ptr = &bus->rx_ring[(uint8_t)(bus->rx_end + J1850_RX_HDR) & J1850_RX_RING_MASK];
             }
             break;
         case 2:
             //Receive data bits
-            if(bus->byte_ptr == bus->rx_msg_end->buf + J1850_MSG_SIZE) {
-                //We've started the 13th byte or 
+            if(bus->rx_bytes == J1850_MSG_SIZE || (bus->bit_ptr == 0 && !rx_room(bus))) {
+                //We've started the 13th byte, there's no room left or 
                 //the pulse was too short/long, something went wrong
-                stop_ocr(bus);
+                stop_ocr(n);
                 bus->state = 0;
             }
             else if(delta > RX_SHORT_MIN && delta < RX_LONG_MAX) {
                 //Setup EOD interrupt
-                set_ocr(bus, tmr + RX_EOD_MIN);
+                set_ocr(n, tmr + RX_EOD_MIN);
                 
                 *bus->byte_ptr <<= 1;
                 if((pin && delta > RX_LONG_MIN) || (!pin && delta < RX_SHORT_MAX)) {
@@ -90,58 +180,68 @@ static inline void service_pcint(j1850_bus_t *bus, uint8_t pin, uint8_t tmr) {
                 bus->bit_ptr ++;
                 
                 if(bus->bit_ptr == 8) {
-                    bus->rx_msg_end->bytes ++;
+                    bus->rx_bytes ++;
                     bus->bit_ptr = 0;
                     bus->byte_ptr ++;
+                    if(bus->byte_ptr == &bus->rx_ring[J1850_RX_RING_SIZE]) bus->byte_ptr = bus->rx_ring;
                 }
             }
             break;
         case 11:
             //Pin changed while we were waiting for IFS, reset timer
-            set_ocr(bus, tmr + TX_IFS);
+            set_ocr(n, tmr + TX_IFS);
             break;
         case 12:
             //Sending bits, check that we're not getting overridden
-            if(!(pin) != !(get_port(bus))) {
-                stop_ocr(bus);
-                clear_port(bus);
+            if(!(pin) != !(get_port(n))) {
+                stop_ocr(n);
+                clear_port(n);
                 bus->state = 0;
+                
+                //Lost arbitration, it goes again from the start until it's out of retries
+                j1850_msg_buf_t *msg = bus->tx_msg_start;
+                if(msg->losses != 0xFF) msg->losses ++;
+                if(msg->retries != J1850_TX_RETRY_FOREVER) {
+                    if(msg->retries) msg->retries --;
+                    else tx_finish(n, J1850_TX_LOST);
+                }
             } 
             break;
     }
+    
+    //Back to idle, let the main loop pick up messages and start the next send
+    if(bus->state == 0) EVT_REG |= EVT_J1850;
 }
 
 /*
- * Service the pin change ISR and direct it to the proper bus
+ * Bus edge interrupts, one each so there's no working out which pin changed.
+ * On the ATmega328P these are INT0/1, the highest priority vectors, so the
+ * timestamp is taken as soon as anything can be
  */
-ISR(PCINT2_vect) {
-    uint8_t tmr = TCNT2;
-    sei();
-    
-    if(J1850_BUS0_PCINT_REG & J1850_BUS0_PCINT_MSK) {
-        service_pcint( (j1850_bus_t *)&j1850_bus[0], 
-                       get_pin((j1850_bus_t *)&j1850_bus[0]), 
-                       tmr );
+#define EDGE_ISR(n) \
+    ISR(J1850_BUS##n##_EDGE_VECT) { \
+        uint16_t tmr = J1850_BUS##n##_TCNT_REG; \
+        sei(); \
+        service_edge(n, get_pin(n), tmr); \
     }
-    
-    if(J1850_BUS1_PCINT_REG & J1850_BUS1_PCINT_MSK) {
-        service_pcint( (j1850_bus_t *)&j1850_bus[1], 
-                       get_pin((j1850_bus_t *)&j1850_bus[1]), 
-                       tmr );
-    }
-}
+J1850_FOR_EACH_BUS(EDGE_ISR)
 
-static inline void service_ocr(j1850_bus_t *bus, uint8_t tmr) {
+static inline __attribute__((always_inline)) void service_ocr(uint8_t n, uint16_t tmr) {
+    j1850_bus_t *bus = (j1850_bus_t *)&j1850_bus[n];
+    
     switch(bus->state) {
         case 2:
             //Received EOD
-            stop_ocr(bus);
+            stop_ocr(n);
+            
+            uint8_t end = bus->rx_end;
+            uint8_t header = bus->rx_ring[(uint8_t)(end + J1850_RX_HDR) & J1850_RX_RING_MASK];
             
             uint8_t match = 0;
             if(j1850_listen_bytes) {
                 uint8_t i;
                 for(i=0; i<j1850_listen_bytes; i++) {
-                    if(bus->rx_msg_end->buf[0] == j1850_listen_headers[i]) {
+                    if(header == j1850_listen_headers[i]) {
                         match = 1;
                         break;
                     }
@@ -149,11 +249,15 @@ static inline void service_ocr(j1850_bus_t *bus, uint8_t tmr) {
             }
             else match = 1;
             
-            if(match) {
-                j1850_msg_buf_t *prev_end = bus->rx_msg_end;
-                bus->rx_msg_end ++;
-                if(bus->rx_msg_end == &bus->rx_buf[J1850_MSG_BUF_SIZE_RX]) bus->rx_msg_end = bus->rx_buf;
-                if(bus->rx_msg_end == bus->rx_msg_start) bus->rx_msg_end = prev_end;
+            //The bytes already made sure there's room for the header
+            if(match && bus->rx_bytes) {
+                uint16_t stamp = tmr_stamp();
+                bus->rx_ring[end] = bus->rx_bytes;
+                bus->rx_ring[(uint8_t)(end + 1) & J1850_RX_RING_MASK] = stamp >> 8;
+                bus->rx_ring[(uint8_t)(end + 2) & J1850_RX_RING_MASK] = stamp;
+                
+                bus->rx_end = (uint8_t)(end + J1850_RX_HDR + bus->rx_bytes) & J1850_RX_RING_MASK;
+                bus->rx_count ++;
             }
             
             bus->state = 0;
@@ -162,31 +266,32 @@ static inline void service_ocr(j1850_bus_t *bus, uint8_t tmr) {
             //Try to send something
             bus->state = 11;
             bus->bit_ptr = 0;
+            bus->tx_left = bus->tx_msg_start->bytes;
             bus->byte_ptr = bus->tx_msg_start->buf - 1;
-            clear_port(bus);
-            set_ocr(bus, tmr + TX_IFS);
+            clear_port(n);
+            set_ocr(n, tmr + TX_IFS);
             break;
         case 11:
             //Waiting for IFS
             
-            if(get_pin(bus)) {
+            if(get_pin(n)) {
                 //Bus isn't passive
-                set_ocr(bus, tmr + TX_IFS);
+                set_ocr(n, tmr + TX_IFS);
             }
             else {
                 //Successfully waited for IFS
                 bus->state = 12;
-                set_port(bus);
-                set_ocr(bus, tmr + TX_SOF);
+                set_port(n);
+                set_ocr(n, tmr + TX_SOF);
             }
             break;
         case 12:
             //Sending bits
-            toggle_port(bus);
+            toggle_port(n);
             
             if(bus->bit_ptr) bus->bit_ptr --;
-            else if(bus->tx_msg_start->bytes) {
-                bus->tx_msg_start->bytes --;
+            else if(bus->tx_left) {
+                bus->tx_left --;
                 bus->byte_ptr ++;
                 bus->tx_byte = *bus->byte_ptr;
                 bus->bit_ptr = 7;
@@ -194,38 +299,32 @@ static inline void service_ocr(j1850_bus_t *bus, uint8_t tmr) {
             else {
                 //Done sending bits
                 bus->state = 0;
+                tx_finish(n, J1850_TX_SENT);
                 
-                bus->tx_msg_start++;
-                if(bus->tx_msg_start == &bus->tx_buf[J1850_MSG_BUF_SIZE_TX]) bus->tx_msg_start = bus->tx_buf;
-                
-                stop_ocr(bus);
+                stop_ocr(n);
                 break;
             }
             
-            if(!(bus->tx_byte & 0x80) != !get_port(bus)) set_ocr(bus, tmr + TX_LONG);
-            else set_ocr(bus, tmr + TX_SHORT);
+            if(!(bus->tx_byte & 0x80) != !get_port(n)) set_ocr(n, tmr + TX_LONG);
+            else set_ocr(n, tmr + TX_SHORT);
             
             bus->tx_byte <<= 1;
             break;
     }
+    
+    if(bus->state == 0) EVT_REG |= EVT_J1850;
 }
 
 /*
  * J1850 channel timer compare interrupts
  */
-ISR(TIMER2_COMPA_vect) {
-    uint8_t tmr = TCNT2;
-    sei();
-    
-    service_ocr((j1850_bus_t *)&j1850_bus[0], tmr);
-}
-
-ISR(TIMER2_COMPB_vect) {
-    uint8_t tmr = TCNT2;
-    sei();
-    
-    service_ocr((j1850_bus_t *)&j1850_bus[1], tmr);
-}
+#define OCR_ISR(n) \
+    ISR(J1850_BUS##n##_OCR_VECT) { \
+        uint16_t tmr = J1850_BUS##n##_TCNT_REG; \
+        sei(); \
+        service_ocr(n, tmr); \
+    }
+J1850_FOR_EACH_BUS(OCR_ISR)
 
 /*
  * Starts the interrupt system sending out the next message in the buffer
@@ -233,17 +332,7 @@ ISR(TIMER2_COMPB_vect) {
 void j1850_send_packet(uint8_t bus) {
     cli();
     j1850_bus[bus].state = 10;
-    
-    if(bus) {
-        J1850_BUS1_OCR_REG = TCNT2 + 1;
-        J1850_BUS1_OCF_REG |= J1850_BUS1_OCF_MSK;
-        J1850_BUS1_OCIE_REG |= J1850_BUS1_OCIE_MSK;
-    }
-    else {
-        J1850_BUS0_OCR_REG = TCNT2 + 1;
-        J1850_BUS0_OCF_REG |= J1850_BUS0_OCF_MSK;
-        J1850_BUS0_OCIE_REG |= J1850_BUS0_OCIE_MSK;
-    }
+    set_ocr(bus, get_tcnt(bus) + us2cnt(8));
     sei();
 }
 
@@ -279,17 +368,109 @@ uint8_t j1850_crc(uint8_t *msg_buf, int8_t nbytes) {
     return ~crc_reg;    // Return CRC
 }
 
+/*
+ * Number of received messages waiting to be read
+ */
+uint8_t j1850_rx_depth(uint8_t bus) {
+    return j1850_bus[bus].rx_count - j1850_bus[bus].rx_popped;
+}
+
+/*
+ * Drops the oldest received frame, taking the main loop's look ahead with it
+ * if it hadn't got past
+ */
+void j1850_rx_pop(uint8_t bus) {
+    volatile j1850_bus_t *b = &j1850_bus[bus];
+    uint8_t start = b->rx_start;
+    
+    if(start == b->rx_end) return;
+    
+    uint8_t next = j1850_rx_next(bus, start);
+    if(b->rx_peek == start) b->rx_peek = next;
+    b->rx_start = next;
+    b->rx_popped ++;
+}
+
+/*
+ * Number of transmit slots that can still be filled, one slot is always kept
+ * empty to tell a full buffer from an empty one
+ */
+uint8_t j1850_tx_free(uint8_t bus) {
+    cli();
+    int8_t depth = j1850_bus[bus].tx_msg_end - j1850_bus[bus].tx_msg_start;
+    sei();
+    
+    if(depth < 0) depth += J1850_MSG_BUF_SIZE_TX;
+    return J1850_MSG_BUF_SIZE_TX - 1 - depth;
+}
+
+/*
+ * Queues the message filled in at tx_msg_end, if there's no room it's
+ * reported straight back
+ */
+void j1850_tx_commit(uint8_t bus) {
+    volatile j1850_bus_t *b = &j1850_bus[bus];
+    j1850_msg_buf_t *msg = (j1850_msg_buf_t *)b->tx_msg_end;
+    j1850_msg_buf_t *next = msg + 1;
+    
+    if(next == &b->tx_buf[J1850_MSG_BUF_SIZE_TX]) next = (j1850_msg_buf_t *)b->tx_buf;
+    msg->queued = tmr_10ms;
+    msg->losses = 0;
+    
+    cli();
+    if(next != b->tx_msg_start) {
+        b->tx_msg_end = next;
+        sei();
+    }
+    else {
+        sei();
+        tx_report(bus, msg, J1850_TX_FULL);
+    }
+}
+
+/*
+ * Transmit reports waiting for the host
+ */
+uint8_t j1850_tx_report_count(void) {
+    int8_t count = tx_report_end - tx_report_start;
+    if(count < 0) count += J1850_TX_REPORT_BUF_SIZE;
+    return count;
+}
+
+uint8_t j1850_tx_report_pop(j1850_tx_report_t *report) {
+    if(tx_report_start == tx_report_end) return 0;
+    
+    *report = tx_reports[tx_report_start];
+    if(tx_report_start + 1 == J1850_TX_REPORT_BUF_SIZE) tx_report_start = 0;
+    else tx_report_start ++;
+    
+    return 1;
+}
+
 /*
  * Housekeeping
  */
 void j1850_process(void) {
     uint8_t bus;
-    for(bus=0; bus<2; bus++) {
+    for(bus=0; bus<J1850_BUS_COUNT; bus++) {
+        j1850_msg_buf_t *end = (j1850_msg_buf_t *)j1850_bus[bus].tx_msg_end;
+        
         cli();
         j1850_msg_buf_t *start = (j1850_msg_buf_t *)j1850_bus[bus].tx_msg_start;
         uint8_t state = j1850_bus[bus].state;
+        
+        //Give up on a message that's waited too long, unless it's already on the bus
+        if(start != end && state != 12 && start->timeout && (uint8_t)(tmr_10ms - start->queued) >= start->timeout) {
+            if(state == 10 || state == 11) {
+                stop_ocr(bus);
+                j1850_bus[bus].state = 0;
+            }
+            tx_finish(bus, J1850_TX_TIMEOUT);
+            
+            start = (j1850_msg_buf_t *)j1850_bus[bus].tx_msg_start;
+            state = j1850_bus[bus].state;
+        }
         sei();
-        j1850_msg_buf_t *end = (j1850_msg_buf_t *)j1850_bus[bus].tx_msg_end;
     
         if((start != end) && state == 0) {
             j1850_send_packet(bus);
@@ -301,27 +482,15 @@ void j1850_process(void) {
  * Initialize all the J1850 stuff
  */
 void j1850_init(void) {
-    j1850_bus[0].rx_msg_start = (j1850_msg_buf_t *)j1850_bus[0].rx_buf;
-    j1850_bus[0].rx_msg_end = j1850_bus[0].rx_msg_start;
-    j1850_bus[0].tx_msg_start = (j1850_msg_buf_t *)j1850_bus[0].tx_buf;
-    j1850_bus[0].tx_msg_end = j1850_bus[0].tx_msg_start;
-    j1850_bus[1].rx_msg_start = (j1850_msg_buf_t *)j1850_bus[1].rx_buf;
-    j1850_bus[1].rx_msg_end = j1850_bus[1].rx_msg_start;
-    j1850_bus[1].tx_msg_start = (j1850_msg_buf_t *)j1850_bus[1].tx_buf;
-    j1850_bus[1].tx_msg_end = j1850_bus[1].tx_msg_start;
-    
-    J1850_BUS0_DDRPORT_REG |= J1850_BUS0_PORT_MSK;
-    J1850_BUS0_DDRPIN_REG &= ~J1850_BUS0_PIN_MSK;
-    J1850_BUS0_PCINT_REG |= J1850_BUS0_PCINT_MSK;
-    
-    J1850_BUS1_DDRPORT_REG |= J1850_BUS1_PORT_MSK;
-    J1850_BUS1_DDRPIN_REG &= ~J1850_BUS1_PIN_MSK;
-    J1850_BUS1_PCINT_REG |= J1850_BUS1_PCINT_MSK;
-    
-    TCCR2A = 0;
-    //1/64 prescaler
-    TCCR2B = (1<<CS21) | (1<<CS20);
+    uint8_t bus;
+    for(bus=0; bus<J1850_BUS_COUNT; bus++) {
+        j1850_bus[bus].tx_msg_start = (j1850_msg_buf_t *)j1850_bus[bus].tx_buf;
+        j1850_bus[bus].tx_msg_end = j1850_bus[bus].tx_msg_start;
+    }
     
-    //Enable PCI
-    PCICR = (1<<PCIE2);
+#define INIT_BUS(n) \
+    J1850_BUS##n##_DDRPORT_REG |= J1850_BUS##n##_PORT_MSK; \
+    J1850_BUS##n##_DDRPIN_REG &= ~J1850_BUS##n##_PIN_MSK; \
+    J1850_BUS##n##_EDGE_INIT();
+    J1850_FOR_EACH_BUS(INIT_BUS)
 }
@@ -10,10 +10,17 @@
 #include "main.h"
 #include "j1850.h"
 
-#define J1850_MSG_BUF_SIZE_RX 17
 #define J1850_MSG_BUF_SIZE_TX 5
 #define J1850_MSG_SIZE 12
 
+//How frames queued with an id finished
+#define J1850_TX_SENT 0x00
+#define J1850_TX_LOST 0x01      //Lost arbitration more often than it was allowed to
+#define J1850_TX_TIMEOUT 0x02   //Didn't get onto the bus in time
+#define J1850_TX_FULL 0x03      //Transmit queue was full, never queued
+#define J1850_TX_RETRY_FOREVER 0xFF
+#define J1850_TX_REPORT_BUF_SIZE 16
+
 //J1850_OUT
 #define J1850_BUS0_PORT_REG PORTD
 #define J1850_BUS0_DDRPORT_REG DDRD
@@ -21,13 +28,15 @@
 #define J1850_BUS0_PIN_REG PIND
 #define J1850_BUS0_DDRPIN_REG DDRD
 #define J1850_BUS0_PIN_MSK (1<<PORTD3)
-#define J1850_BUS0_PCINT_REG PCMSK2
-#define J1850_BUS0_PCINT_MSK (1<<PCINT19)
-#define J1850_BUS0_OCR_REG OCR2A
-#define J1850_BUS0_OCF_REG TIFR2
-#define J1850_BUS0_OCF_MSK (1<<OCF2A)
-#define J1850_BUS0_OCIE_REG TIMSK2
-#define J1850_BUS0_OCIE_MSK (1<<OCIE2A)
+#define J1850_BUS0_EDGE_VECT INT1_vect
+#define J1850_BUS0_EDGE_INIT() do { EICRA |= (1<<ISC10); EIMSK |= (1<<INT1); } while(0)
+#define J1850_BUS0_TCNT_REG TCNT1
+#define J1850_BUS0_OCR_VECT TIMER1_COMPA_vect
+#define J1850_BUS0_OCR_REG OCR1A
+#define J1850_BUS0_OCF_REG TIFR1
+#define J1850_BUS0_OCF_MSK (1<<OCF1A)
+#define J1850_BUS0_OCIE_REG TIMSK1
+#define J1850_BUS0_OCIE_MSK (1<<OCIE1A)
 
 //J1850_IN
 #define J1850_BUS1_PORT_REG PORTB
@@ -36,52 +45,159 @@
 #define J1850_BUS1_PIN_REG PIND
 #define J1850_BUS1_DDRPIN_REG DDRD
 #define J1850_BUS1_PIN_MSK (1<<PORTD2)
-#define J1850_BUS1_PCINT_REG PCMSK2
-#define J1850_BUS1_PCINT_MSK (1<<PCINT18)
-#define J1850_BUS1_OCR_REG OCR2B
-#define J1850_BUS1_OCF_REG TIFR2
-#define J1850_BUS1_OCF_MSK (1<<OCF2B)
-#define J1850_BUS1_OCIE_REG TIMSK2
-#define J1850_BUS1_OCIE_MSK (1<<OCIE2B)
+#define J1850_BUS1_EDGE_VECT INT0_vect
+#define J1850_BUS1_EDGE_INIT() do { EICRA |= (1<<ISC00); EIMSK |= (1<<INT0); } while(0)
+#define J1850_BUS1_TCNT_REG TCNT1
+#define J1850_BUS1_OCR_VECT TIMER1_COMPB_vect
+#define J1850_BUS1_OCR_REG OCR1B
+#define J1850_BUS1_OCF_REG TIFR1
+#define J1850_BUS1_OCF_MSK (1<<OCF1B)
+#define J1850_BUS1_OCIE_REG TIMSK1
+#define J1850_BUS1_OCIE_MSK (1<<OCIE1B)
+
+//Number of buses is a build parameter. Boards with more than the two above
+//bring their own J1850_BUSn_* bindings for the rest through J1850_BOARD_H,
+//each bus needs its own edge and compare vectors on a 1us timer
+#ifndef J1850_BUS_COUNT
+#define J1850_BUS_COUNT 2
+#endif
+
+#ifdef J1850_BOARD_H
+#include J1850_BOARD_H
+#endif
+
+//Received frames are packed one after another into a byte ring per bus, each
+//as its length, a 16 bit timestamp, then the bytes. The size has to be a power
+//of two, 256 at most and enough for a few whole frames. It comes down as buses
+//are added so they all still fit in RAM, a build can set its own
+#ifndef J1850_RX_RING_SIZE
+#if J1850_BUS_COUNT <= 2
+#define J1850_RX_RING_SIZE 256
+#elif J1850_BUS_COUNT <= 4
+#define J1850_RX_RING_SIZE 128
+#else
+#define J1850_RX_RING_SIZE 64
+#endif
+#endif
+#define J1850_RX_RING_MASK (J1850_RX_RING_SIZE - 1)
+#define J1850_RX_HDR 3
+
+#if J1850_RX_RING_SIZE > 256 || J1850_RX_RING_SIZE < 64 || (J1850_RX_RING_SIZE & J1850_RX_RING_MASK)
+#error J1850_RX_RING_SIZE has to be a power of two from 64 to 256
+#endif
+
+//Most RAM the bus buffers can take, the other half of the 328P's 2KB is
+//the SPI buffers, switch events and a stack deep enough for nested ISRs
+#define J1850_BUS_RAM_MAX 1024
+
+//Expands X(n) for every bus, so code can be pasted out per bus at compile time
+#if J1850_BUS_COUNT == 1
+#define J1850_FOR_EACH_BUS(X) X(0)
+#elif J1850_BUS_COUNT == 2
+#define J1850_FOR_EACH_BUS(X) X(0) X(1)
+#elif J1850_BUS_COUNT == 3
+#define J1850_FOR_EACH_BUS(X) X(0) X(1) X(2)
+#elif J1850_BUS_COUNT == 4
+#define J1850_FOR_EACH_BUS(X) X(0) X(1) X(2) X(3)
+#else
+#error J1850_BUS_COUNT has to be 1 to 4
+#endif
+
+#if J1850_BUS_COUNT > 2 && !defined(J1850_BUS2_PORT_REG)
+#error J1850_BUS_COUNT > 2 needs J1850_BUS2_* bindings from J1850_BOARD_H
+#endif
+#if J1850_BUS_COUNT > 3 && !defined(J1850_BUS3_PORT_REG)
+#error J1850_BUS_COUNT > 3 needs J1850_BUS3_* bindings from J1850_BOARD_H
+#endif
 
 typedef struct j1850_bus_t j1850_bus_t;
 typedef struct j1850_msg_buf_t j1850_msg_buf_t;
 typedef struct j1850_event_t j1850_event_t;
+typedef struct j1850_tx_report_t j1850_tx_report_t;
 
 struct j1850_msg_buf_t {
     uint8_t buf[J1850_MSG_SIZE];
     uint8_t bytes;
+    //Host's id to report back with, 0 for no report
+    uint8_t id;
+    //Arbitration losses to retry after, or J1850_TX_RETRY_FOREVER
+    uint8_t retries;
+    //10ms ticks after queueing to give up if it hasn't gone out, 0 for never
+    uint8_t timeout;
+    uint8_t queued;
+    uint8_t losses;
+};
+
+struct j1850_tx_report_t {
+    uint8_t bus;
+    uint8_t id;
+    uint8_t status;
+    uint8_t losses;
+    uint16_t stamp;
 };
 
 struct j1850_bus_t {
     uint8_t last_pin;
     uint8_t state;
-    uint8_t ltmr;
-    j1850_msg_buf_t rx_buf[J1850_MSG_BUF_SIZE_RX];
-    j1850_msg_buf_t *rx_msg_start;
-    j1850_msg_buf_t *rx_msg_end;
+    uint16_t ltmr;
+    uint8_t rx_ring[J1850_RX_RING_SIZE];
+    uint8_t rx_start;
+    uint8_t rx_end;
+    //The main loop's place looking ahead of rx_start
+    uint8_t rx_peek;
+    uint8_t rx_bytes;
+    uint8_t rx_popped;
     j1850_msg_buf_t tx_buf[J1850_MSG_BUF_SIZE_TX];
     j1850_msg_buf_t *tx_msg_start;
     j1850_msg_buf_t *tx_msg_end;
     uint8_t *byte_ptr;
     uint8_t bit_ptr;
+    uint8_t tx_left;
     uint8_t tx_byte;
     uint8_t rx_byte;
+    uint8_t rx_count;
+    uint8_t tx_count;
 };
 
-volatile j1850_bus_t j1850_bus[2];
+volatile j1850_bus_t j1850_bus[J1850_BUS_COUNT];
 
-volatile uint8_t j1850_listen_headers[16];
+#define J1850_LISTEN_MAX 16
+volatile uint8_t j1850_listen_headers[J1850_LISTEN_MAX];
 volatile uint8_t j1850_listen_bytes;
 
 void j1850_init(void);
 void j1850_send_packet(uint8_t bus);
 void j1850_process(void);
 uint8_t j1850_crc(uint8_t *msg_buf, int8_t nbytes);
+uint8_t j1850_rx_depth(uint8_t bus);
+uint8_t j1850_tx_free(uint8_t bus);
+void j1850_tx_commit(uint8_t bus);
+uint8_t j1850_tx_report_count(void);
+uint8_t j1850_tx_report_pop(j1850_tx_report_t *report);
+void j1850_rx_pop(uint8_t bus);
+
+/*
+ * Received frames by their place in the ring, main loop only
+ */
+static inline uint8_t j1850_rx_len(uint8_t bus, uint8_t pos) {
+    return j1850_bus[bus].rx_ring[pos];
+}
+
+static inline uint16_t j1850_rx_stamp(uint8_t bus, uint8_t pos) {
+    return (j1850_bus[bus].rx_ring[(uint8_t)(pos + 1) & J1850_RX_RING_MASK] << 8) | j1850_bus[bus].rx_ring[(uint8_t)(pos + 2) & J1850_RX_RING_MASK];
+}
+
+static inline uint8_t j1850_rx_byte(uint8_t bus, uint8_t pos, uint8_t n) {
+    return j1850_bus[bus].rx_ring[(uint8_t)(pos + J1850_RX_HDR + n) & J1850_RX_RING_MASK];
+}
+
+static inline uint8_t j1850_rx_next(uint8_t bus, uint8_t pos) {
+    return (uint8_t)(pos + J1850_RX_HDR + j1850_bus[bus].rx_ring[pos]) & J1850_RX_RING_MASK;
+}
 
-// convert microseconds to counter values
+// convert microseconds to counter values, everything runs off Timer1
 #define ISR_LATENCY 0
-#define us2cnt(us) ((unsigned int)(((unsigned long)(us - ISR_LATENCY)) / ((1000000L*32L) / (float)((unsigned long)F_CPU / 1L))))
+#define us2cnt(us) ((unsigned int)(((unsigned long)(us - ISR_LATENCY)) / ((1000000L*TMR1_PRESCALE) / (float)((unsigned long)F_CPU / 1L))))
 
 // define J1850 VPW timing requirements in accordance with SAE J1850 standard
 // all pulse width times in us
@@ -12,16 +12,32 @@
 #include "j1850.h"
 
 static volatile uint8_t sw_adc[2];
-static volatile uint8_t sw_new;
+
+static const uint8_t sw_thresh_default[SW_THRESH_COUNT] = {SW_THRESH_0, SW_THRESH_1, SW_THRESH_2, SW_THRESH_3, SW_THRESH_4};
 
 static uint8_t last_sw_state;
 static uint8_t last_pwr_state;
 
-ISR(TIMER0_COMPA_vect) {
+static sw_event_t sw_events[SW_EVT_BUF_SIZE];
+static uint8_t sw_evt_start;
+static uint8_t sw_evt_end;
+
+//Per channel press tracking for long press and auto-repeat
+static uint16_t sw_press_stamp[2];
+static uint16_t sw_repeat_stamp[2];
+static uint8_t sw_long_sent[2];
+
+ISR(TIMER1_OVF_vect) {
+    tmr1_ovf ++;
+}
+
+//The housekeeping interrupts let bus edges in straight away
+ISR(TIMER0_COMPA_vect, ISR_NOBLOCK) {
     static uint8_t cnt_10ms;
     
     tmr_10ms ++;
     cnt_10ms ++;
+    EVT_REG |= EVT_TICK;
     
     if(cnt_10ms == 100) {
         cnt_10ms = 0;
@@ -29,16 +45,40 @@ ISR(TIMER0_COMPA_vect) {
     }
 }
 
-ISR(ADC_vect) {
-    //Are we on channel 1?
-    if(ADMUX & (1<<MUX0)) {
-        sw_adc[1] = ADCH;
-        sw_new = 1;
+static inline uint8_t median3(uint8_t a, uint8_t b, uint8_t c) {
+    uint8_t tmp;
+    
+    if(a > b) {
+        tmp = a;
+        a = b;
+        b = tmp;
     }
-    else sw_adc[0] = ADCH;
+    if(b > c) b = c;
+    if(a > b) b = a;
+    
+    return b;
+}
+
+ISR(ADC_vect, ISR_NOBLOCK) {
+    static uint8_t samples[SW_ADC_SAMPLES];
+    static uint8_t count;
+    static uint8_t ch;
+    
+    samples[count] = ADCH;
+    count ++;
+    
+    //The next conversion has already started on this channel,
+    //so move the mux one sample early
+    if(count == SW_ADC_SAMPLES - 1) ADMUX = ADMUX ^ (1<<MUX0);
+    
+    if(count == SW_ADC_SAMPLES) {
+        count = 0;
+        sw_adc[ch] = median3(samples[0], samples[1], samples[2]);
         
-    //Move channels and start the conversion
-    ADMUX = ADMUX ^ (1<<MUX0);
+        //Done both channels?
+        if(ch) EVT_REG |= EVT_SW;
+        ch ^= 1;
+    }
 }
 
 static void tmrs_init(void) {
@@ -51,6 +91,11 @@ static void tmrs_init(void) {
     TCCR0B = 0b00000101;
     OCR0A = 78;
     TIMSK0 |= (1<<OCIE0A);
+    
+    //J1850 timing and timestamps, normal mode with a x8 prescaler
+    TCCR1A = 0;
+    TCCR1B = (1<<CS11);
+    TIMSK1 |= (1<<TOIE1);
 }
 
 static void io_init(void) {
@@ -62,35 +107,132 @@ static void io_init(void) {
 }
 
 static void ad_init(void) {
+    uint8_t i;
+    
+    for(i=0; i<SW_THRESH_COUNT; i++) {
+        sw_thresh[0][i] = sw_thresh_default[i];
+        sw_thresh[1][i] = sw_thresh_default[i];
+    }
+    
     //Set result as left justified
     ADMUX |= (1<<ADLAR);
-    //Auto trigger on TC0 match
-    ADCSRB |= (1<<ADTS1) | (1<<ADTS0);
+    //Free running
+    ADCSRB &= ~((1<<ADTS2) | (1<<ADTS1) | (1<<ADTS0));
     //Disable digital on AN0, AN1
     DIDR0 |= (1<<ADC1D) | (1<<ADC0D);
-    //Enable, auto trigger, interrupt enabled, 1/16 clock rate
-    ADCSRA |= (1<<ADEN) | (1<<ADATE) | (1<<ADIE) | (1<<ADPS2);
+    //Enable, auto trigger, interrupt enabled, 1/128 clock rate, start
+    ADCSRA |= (1<<ADEN) | (1<<ADATE) | (1<<ADIE) | (1<<ADPS2) | (1<<ADPS1) | (1<<ADPS0);
+    ADCSRA |= (1<<ADSC);
+}
+
+/*
+ * Loads a channel's ladder, lowest threshold first. Ignored unless
+ * the thresholds go strictly up
+ */
+int8_t sw_set_thresh(uint8_t sw, const uint8_t *thresh) {
+    uint8_t i;
+    
+    if(sw > 1) return -1;
+    for(i=1; i<SW_THRESH_COUNT; i++) {
+        if(thresh[i] <= thresh[i-1]) return -1;
+    }
+    
+    for(i=0; i<SW_THRESH_COUNT; i++) sw_thresh[sw][i] = thresh[i];
+    
+    return 0;
+}
+
+static void sw_event_push(uint8_t sw, uint8_t type, uint16_t stamp) {
+    uint8_t end = sw_evt_end + 1;
+    if(end == SW_EVT_BUF_SIZE) end = 0;
+    
+    //On overflow drop the newest event
+    if(end == sw_evt_start) return;
+    
+    sw_events[sw_evt_end].sw = sw;
+    sw_events[sw_evt_end].type = type;
+    sw_events[sw_evt_end].stamp = stamp;
+    sw_evt_end = end;
+}
+
+uint8_t sw_event_count(void) {
+    int8_t count = sw_evt_end - sw_evt_start;
+    if(count < 0) count += SW_EVT_BUF_SIZE;
+    return count;
+}
+
+uint8_t sw_event_pop(sw_event_t *evt) {
+    if(sw_evt_start == sw_evt_end) return 0;
+    
+    *evt = sw_events[sw_evt_start];
+    sw_evt_start ++;
+    if(sw_evt_start == SW_EVT_BUF_SIZE) sw_evt_start = 0;
+    
+    return 1;
+}
+
+/*
+ * Turns debounced switch state changes into press/release events, and keeps
+ * an eye on held switches for long presses and auto-repeat
+ */
+static void update_sw_events(uint8_t last_state, uint8_t this_state) {
+    uint16_t stamp = tmr_stamp();
+    
+    uint8_t sw;
+    for(sw=0; sw<2; sw++) {
+        uint8_t mask = 0x0F;
+        if(sw) mask = 0xF0;
+        
+        uint8_t last = last_state & mask;
+        uint8_t this = this_state & mask;
+        
+        if(this != last) {
+            if(last) sw_event_push(last, SW_EVT_RELEASE, stamp);
+            if(this) {
+                sw_event_push(this, SW_EVT_PRESS, stamp);
+                sw_press_stamp[sw] = stamp;
+                sw_repeat_stamp[sw] = stamp + SW_REPEAT_DELAY;
+                sw_long_sent[sw] = 0;
+            }
+        }
+        else if(this) {
+            if(!sw_long_sent[sw] && (uint16_t)(stamp - sw_press_stamp[sw]) >= SW_LONG_PRESS) {
+                sw_event_push(this, SW_EVT_LONG, stamp);
+                sw_long_sent[sw] = 1;
+            }
+            if((int16_t)(stamp - sw_repeat_stamp[sw]) >= 0) {
+                sw_event_push(this, SW_EVT_REPEAT, stamp);
+                sw_repeat_stamp[sw] += SW_REPEAT_RATE;
+            }
+        }
+    }
 }
 
-static void read_input_state(void) {
+static void read_sw_state(void) {
     uint8_t this_sw_state = 0;
-    uint8_t this_pwr_state = 0;
     
     uint8_t sw;
     for(sw=0; sw<2; sw++) {
         uint8_t rot = 0;
         if(sw) rot = 4;
         
-        if(sw_adc[sw] > SW_THRESH_4) this_sw_state |= 0x01<<rot;
-        else if(sw_adc[sw] > SW_THRESH_3) this_sw_state |= 0x02<<rot;
-        else if(sw_adc[sw] > SW_THRESH_2) this_sw_state |= 0x03<<rot;
-        else if(sw_adc[sw] > SW_THRESH_1) this_sw_state |= 0x04<<rot;
-        else if(sw_adc[sw] > SW_THRESH_0) this_sw_state |= 0x05<<rot;
+        //Highest threshold is switch 1, lowest is switch 5
+        uint8_t level;
+        for(level=0; level<SW_THRESH_COUNT; level++) {
+            if(sw_adc[sw] > sw_thresh[sw][SW_THRESH_COUNT - 1 - level]) break;
+        }
+        if(level < SW_THRESH_COUNT) this_sw_state |= (level + 1)<<rot;
     }
     
     //Do a little debouncing
+    uint8_t prev_sw_state = sw_state;
     if(this_sw_state == last_sw_state) sw_state = this_sw_state;
     last_sw_state = this_sw_state;
+    update_sw_events(prev_sw_state, sw_state);
+}
+
+static void read_pwr_state(void) {
+    uint8_t this_pwr_state = 0;
     
     if(ACC_REG & ACC_MSK) this_pwr_state |= 0x01;
     if(PI_REG & PI_MSK) this_pwr_state |= 0x02;
@@ -100,16 +242,64 @@ static void read_input_state(void) {
     last_pwr_state = this_pwr_state;
 }
 
+static void emulate_reply(uint8_t active) {
+    j1850_msg_buf_t *end = (j1850_msg_buf_t *)j1850_bus[0].tx_msg_end;
+    
+    end->buf[0] = 0x8D;
+    end->buf[1] = 0x22;
+    if(active) {
+        end->buf[2] = 0x11;
+        end->buf[3] = 0x01;
+    }
+    else {
+        end->buf[2] = 0x10;
+        end->buf[3] = 0x00;
+    }
+    end->buf[4] = 0x01;
+    end->buf[5] = j1850_crc(end->buf, 5);
+    end->bytes = 6;
+    end->id = 0;
+    end->retries = J1850_TX_RETRY_FOREVER;
+    end->timeout = 0;
+    
+    //On overflow drop the last message
+    j1850_tx_commit(0);
+}
+
+/*
+ * Follows satellite queries on bus 0 so the radio's state is always known here,
+ * and answers them until the Pi says it has taken over. Messages are only
+ * cleared out when the Pi isn't there to read them itself
+ */
+static void emulate_satellite(void) {
+    uint8_t end = j1850_bus[0].rx_end;
+    
+    //Popping frames over SPI drags rx_peek along, so it's never behind rx_start
+    while(j1850_bus[0].rx_peek != end) {
+        uint8_t pos = j1850_bus[0].rx_peek;
+        
+        if(j1850_rx_byte(0, pos, 0) == 0x8D && j1850_rx_byte(0, pos, 1) == 0x0F) {
+            sat_active = j1850_rx_byte(0, pos, 2) == 0x26;
+            if(!(handoff & HANDOFF_SAT)) emulate_reply(sat_active);
+        }
+        
+        j1850_bus[0].rx_peek = j1850_rx_next(0, pos);
+    }
+    
+    while(!spi_active && j1850_bus[0].rx_start != j1850_bus[0].rx_peek) j1850_rx_pop(0);
+}
+
 int main(void) {
-    //Reset and turn off WDT
-    wdt_reset();
-    MCUSR &= ~(1<<WDRF);
-    WDTCSR |= (1<<WDCE) | (1<<WDE);
-    WDTCSR = 0x00;
+    //Keep what reset us for the Pi, then start the watchdog. It's only fed
+    //from the tick, so a stuck main loop or a dead timer both end in a reset
+    reset_flags = MCUSR;
+    MCUSR = 0;
+    wdt_enable(WDT_TIMEOUT);
     
     uint8_t waiting = 1;
     uint8_t shutdown_tmr = 0;
-
+    uint8_t pwr_tmr = 0;
+    
     //Timers
     tmrs_init();
     
@@ -122,80 +312,60 @@ int main(void) {
     j1850_listen_bytes = 1;
     j1850_listen_headers[0] = 0x8D;
     
+    set_sleep_mode(SLEEP_MODE_IDLE);
     sei();
     
     for (;;)
     {
-        //Do power handling
-        if(waiting && tmr_1s > 40) waiting = 0;
-		if(!waiting) {
-			if(PI_REG & PI_MSK) {
-				POWER_HOLD_PORT |= POWER_HOLD_MSK;
-				shutdown_tmr = tmr_10ms;
-			}
-			else {
-				if((uint8_t)(tmr_10ms - shutdown_tmr) > 20) {
-					POWER_HOLD_PORT &= ~POWER_HOLD_PORT;
-				}
-			}
-        }
-
-        //Check for AD results, convert to switch states, check other inputs
-        if(sw_new) {
-            sw_new = 0;
-            read_input_state();
-        }
-        
-        //Do SPI
-        spi_process(tmr_10ms);
-        
-        //Do J1850
-        j1850_process();
-        
-        //If the pi hasn't started yet, do the minimum to pretend to be a satellite module
-        //and remove messages from the buffer as they come in
-        if(!spi_active) {
-            j1850_msg_buf_t *start = (j1850_msg_buf_t *)j1850_bus[0].rx_msg_start;
-            cli();
-            j1850_msg_buf_t *end = (j1850_msg_buf_t *)j1850_bus[0].rx_msg_end;
+        //Sleep until an interrupt leaves something to do. The instruction after sei()
+        //always runs first, so a flag can't slip in between checking and sleeping
+        cli();
+        if(!EVT_REG) {
+            sleep_enable();
             sei();
+            sleep_cpu();
+            sleep_disable();
+        }
+        cli();
+        uint8_t evt = EVT_REG;
+        EVT_REG = 0;
+        sei();
         
-            if(start != end) {
-                if(start->buf[0] == 0x8D && start->buf[1] == 0x0F) {
-                    j1850_msg_buf_t *end = (j1850_msg_buf_t *)j1850_bus[0].tx_msg_end;
-                    if(start->buf[2] == 0x26) {
-                        end->buf[0] = 0x8D;
-                        end->buf[1] = 0x22;
-                        end->buf[2] = 0x11;
-                        end->buf[3] = 0x01;
-                        end->buf[4] = 0x01;
-                        end->buf[5] = j1850_crc(end->buf, 5);
-                        end->bytes = 6;
-                    }
-                    else {
-                        end->buf[0] = 0x8D;
-                        end->buf[1] = 0x22;
-                        end->buf[2] = 0x10;
-                        end->buf[3] = 0x00;
-                        end->buf[4] = 0x01;
-                        end->buf[5] = j1850_crc(end->buf, 5);
-                        end->bytes = 6;
-                    }
-                    
-                    end ++;
-                    if(end == &j1850_bus[0].tx_buf[J1850_MSG_BUF_SIZE_TX]) end = (j1850_msg_buf_t *)j1850_bus[0].tx_buf;
-                    //On overflow drop the last message
-                    cli();
-                    if(end != j1850_bus[0].tx_msg_start) {
-                        j1850_bus[0].tx_msg_end = end;
+        if(evt & EVT_TICK) {
+            //Do power handling
+            if(waiting && tmr_1s > 40) waiting = 0;
+            if(!waiting) {
+                if(PI_REG & PI_MSK) {
+                    POWER_HOLD_PORT |= POWER_HOLD_MSK;
+                    shutdown_tmr = tmr_10ms;
+                }
+                else {
+                    if((uint8_t)(tmr_10ms - shutdown_tmr) > 20) {
+                        POWER_HOLD_PORT &= ~POWER_HOLD_PORT;
                     }
-                    sei();
                 }
-                
-                j1850_bus[0].rx_msg_start ++;
-                if(j1850_bus[0].rx_msg_start == &j1850_bus[0].rx_buf[J1850_MSG_BUF_SIZE_RX]) j1850_bus[0].rx_msg_start = (j1850_msg_buf_t *)j1850_bus[0].rx_buf;
+            }
+            
+            //Power pins don't need anything like as often as switches
+            if((uint8_t)(tmr_10ms - pwr_tmr) >= 2) {
+                pwr_tmr = tmr_10ms;
+                read_pwr_state();
             }
         }
+        
+        //Convert AD results to switch states
+        if(evt & EVT_SW) read_sw_state();
+        
+        //Do SPI, the tick is needed too to notice the Pi going quiet.
+        //Then cover for the Pi if needed and start any messages that were queued
+        if(evt & (EVT_TICK | EVT_SPI | EVT_J1850)) {
+            spi_process(tmr_10ms);
+            emulate_satellite();
+            j1850_process();
+        }
+        
+        //Made it all the way round on a tick
+        if(evt & EVT_TICK) wdt_reset();
     }
     return (0);
 }
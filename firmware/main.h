@@ -8,9 +8,31 @@
 volatile uint8_t tmr_10ms;
 volatile uint8_t tmr_1s;
 
+//Work waiting for the main loop, flagged from interrupts. GPIOR0 is bit addressable
+//so setting a flag is a single sbi, safe even from the ISRs that re-enable interrupts
+#define EVT_REG GPIOR0
+#define EVT_TICK (1<<0)
+#define EVT_SW (1<<1)
+#define EVT_SPI (1<<2)
+#define EVT_J1850 (1<<3)
+
 uint8_t sw_state;
 uint8_t pwr_state;
 
+//Jobs the Pi has taken over from the firmware, the rest are still done here.
+//Cleared when the Pi goes quiet so nothing is left unanswered
+#define HANDOFF_SAT 0x01
+//Reported along with the handoff flags, the last satellite state the radio asked for
+#define HANDOFF_SAT_ACTIVE 0x80
+uint8_t handoff;
+uint8_t sat_active;
+
+//MCUSR from the last reset, handed to the Pi with the first heartbeat after it
+uint8_t reset_flags;
+
+//Only fed from the main loop's tick, which runs every 10ms
+#define WDT_TIMEOUT WDTO_250MS
+
 #define set0 PORTC |= (1<<PORTC2);
 #define clr0 PORTC &= ~(1<<PORTC2);
 #define set1 PORTC |= (1<<PORTC3);
@@ -18,6 +40,26 @@ uint8_t pwr_state;
 
 #define F_CPU 8000000L
 
+//Free running Timer1 at 1/8, one count is 1us. J1850 edges are timed straight off it
+#define TMR1_PRESCALE 8
+
+//Timestamps are Timer1's high byte plus its overflows, one count is 256us
+//and they wrap every 16.7s
+#define TMR_STAMP_US 256
+volatile uint8_t tmr1_ovf;
+static inline uint16_t tmr_stamp(void) {
+    uint8_t sreg = SREG;
+    cli();
+    
+    uint8_t ovf = tmr1_ovf;
+    uint16_t cnt = TCNT1;
+    //Wrapped but not counted yet
+    if((TIFR1 & (1<<TOV1)) && cnt < 0x8000) ovf ++;
+    
+    SREG = sreg;
+    return (ovf << 8) | (cnt >> 8);
+}
+
 #define ACC_REG PINB
 #define ACC_MSK (1<<PINB0)
 #define PI_REG PINC
@@ -28,10 +70,42 @@ uint8_t pwr_state;
 #define POWER_HOLD_DDR DDRD
 #define POWER_HOLD_MSK (1<<PORTD4)
 
+//Default resistor ladder, the daemon can load others per channel over SPI
 #define SW_THRESH_0 27
 #define SW_THRESH_1 75
 #define SW_THRESH_2 119
 #define SW_THRESH_3 169
 #define SW_THRESH_4 213
+#define SW_THRESH_COUNT 5
+
+uint8_t sw_thresh[2][SW_THRESH_COUNT];
+int8_t sw_set_thresh(uint8_t sw, const uint8_t *thresh);
+
+//Conversions per channel, the median is used. The ADC free runs at 1/128,
+//one conversion is 208us so both channels are done every 1.25ms
+#define SW_ADC_SAMPLES 3
+
+//Switch events, sw is in the same format as sw_state
+#define SW_EVT_PRESS 0x01
+#define SW_EVT_RELEASE 0x02
+#define SW_EVT_LONG 0x03
+#define SW_EVT_REPEAT 0x04
+
+#define SW_EVT_BUF_SIZE 8
+//In timestamp counts
+#define SW_LONG_PRESS (1000000L/TMR_STAMP_US)
+#define SW_REPEAT_DELAY (500000L/TMR_STAMP_US)
+#define SW_REPEAT_RATE (150000L/TMR_STAMP_US)
+
+typedef struct sw_event_t sw_event_t;
+
+struct sw_event_t {
+    uint8_t sw;
+    uint8_t type;
+    uint16_t stamp;
+};
+
+uint8_t sw_event_count(void);
+uint8_t sw_event_pop(sw_event_t *evt);
 
 #endif // __MAIN_H__
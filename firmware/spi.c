@@ -19,15 +19,44 @@ struct ringbuf_t {
 static ringbuf_t rx_buf;
 static ringbuf_t tx_buf;
 
+//Frame being sent straight out of a J1850 RX ring once tx_buf runs dry.
+//It stays in the ring until the host acknowledges it
+static volatile uint8_t *stream_ring;
+static volatile uint8_t stream_pos;
+static volatile uint8_t stream_left;
+
 static uint8_t spi_status;
 static uint8_t spi_cmd_status;
 static uint8_t last_tmr_10ms;
 
+//Set by the link on a resync request, cleared once the main loop has dropped
+//everything it was in the middle of
+static volatile uint8_t spi_resync;
+static uint8_t spi_resyncs;
+
+//Values reported by the last status snapshot
+static uint8_t snap_sw_state;
+static uint8_t snap_pwr_state;
+static uint8_t snap_handoff;
+static uint8_t snap_rx_count[J1850_BUS_COUNT];
+static uint8_t snap_tx_count[J1850_BUS_COUNT];
+
 ISR(SPI_STC_vect) {
     uint8_t byte = SPDR;
     
     switch(spi_status) {
         case 0x01:
+            if(tx_buf.start == tx_buf.end && stream_left) {
+                SPDR = stream_ring[stream_pos];
+                sei();
+                
+                stream_pos = (uint8_t)(stream_pos + 1) & J1850_RX_RING_MASK;
+                stream_left --;
+                
+                spi_status = 0x00;
+                break;
+            }
+            
             SPDR = *tx_buf.start;
             sei();
             
@@ -50,11 +79,26 @@ ISR(SPI_STC_vect) {
             if(end == &rx_buf.buf[SPI_BUF_SIZE]) end = (uint8_t *)rx_buf.buf;
             //On overflow just keep dropping the last byte
             if(end != rx_buf.start) rx_buf.end = end;
+            EVT_REG |= EVT_SPI;
             
+            spi_status = 0x00;
+            break;
+        case 0x03:
+            //Link probe, answer with the inverted byte so a stuck or floating
+            //MISO can't pass as a good echo
+            SPDR = ~byte;
+            sei();
             spi_status = 0x00;
             break;
         default:
-            if(byte == 0) SPDR = tx_buf.start != tx_buf.end;
+            if(byte == 0) SPDR = tx_buf.start != tx_buf.end || stream_left;
+            //Resync, whatever the main loop's halfway through gets dropped
+            else if(byte == 0x04) {
+                spi_resync = 1;
+                EVT_REG |= EVT_SPI;
+            }
+            //Resync check, only acknowledged once it's done
+            else if(byte == 0x05) SPDR = spi_resync ? 0x00 : SPI_SYNC_ACK;
             sei();
             spi_status = byte;
     }
@@ -78,29 +122,158 @@ inline int8_t spi_tx_push(uint8_t byte) {
     return 0;
 }
 
-static inline void pop_j1850_to_spi(volatile j1850_bus_t *bus) {
-    j1850_msg_buf_t *start = bus->rx_msg_start;
-    cli(); 
-    j1850_msg_buf_t *end = bus->rx_msg_end;
-    sei();
+/*
+ * Sends the oldest received frame on a bus, the bytes go straight from the
+ * ring. Asking again before acknowledging it sends the same frame again.
+ * Tagged, its place in the ring goes first so the ack can name it
+ */
+static inline void send_j1850_to_spi(uint8_t bus, uint8_t tagged) {
+    if(bus >= J1850_BUS_COUNT) {
+        spi_tx_push(0x00);
+        return;
+    }
     
-    if(start != end) {
-        //Let the requester know there's data
+    uint8_t start = j1850_bus[bus].rx_start;
+    
+    if(start != j1850_bus[bus].rx_end) {
+        //Let the requester know there's data and how long ago it finished arriving
+        uint16_t age = tmr_stamp() - j1850_rx_stamp(bus, start);
         spi_tx_push(0x01);
+        if(tagged) spi_tx_push(start);
+        spi_tx_push(age >> 8);
+        spi_tx_push(age);
         
-        uint8_t i;
-        for(i=0; i<start->bytes; i++) {
-            spi_tx_push(start->buf[i]);
-        }
-        
-        bus->rx_msg_start ++;
-        if(bus->rx_msg_start == &bus->rx_buf[J1850_MSG_BUF_SIZE_RX]) bus->rx_msg_start = (j1850_msg_buf_t *)bus->rx_buf;
+        //The host can't clock the header out in the few cycles before this
+        cli();
+        stream_ring = j1850_bus[bus].rx_ring;
+        stream_pos = (uint8_t)(start + J1850_RX_HDR) & J1850_RX_RING_MASK;
+        stream_left = j1850_rx_len(bus, start);
+        sei();
     }
     //Let the requester know there's no data
     else spi_tx_push(0x00);
 }
 
+/*
+ * The host has the frame, let the ring have its space back
+ */
+static inline void ack_j1850(uint8_t bus) {
+    if(bus >= J1850_BUS_COUNT) return;
+    
+    stream_left = 0;
+    j1850_rx_pop(bus);
+}
+
+/*
+ * Only lets the frame go if it's still the one the host was sent, an ack
+ * repeated after a link error can't take the next one with it
+ */
+static inline void ack_j1850_at(uint8_t bus, uint8_t pos) {
+    if(bus >= J1850_BUS_COUNT) return;
+    if(j1850_bus[bus].rx_start != pos || j1850_bus[bus].rx_start == j1850_bus[bus].rx_end) return;
+    
+    ack_j1850(bus);
+}
+
+/*
+ * Sends the number of transmit reports, then each one's bus, id, status,
+ * arbitration losses and age. Only as many as fit go out at once
+ */
+static inline void push_tx_reports(void) {
+    j1850_tx_report_t report;
+    uint16_t now = tmr_stamp();
+    uint8_t count = j1850_tx_report_count();
+    
+    if(count > SPI_TX_REPORT_MAX) count = SPI_TX_REPORT_MAX;
+    spi_tx_push(count);
+    while(count && j1850_tx_report_pop(&report)) {
+        uint16_t age = now - report.stamp;
+        spi_tx_push(report.bus);
+        spi_tx_push(report.id);
+        spi_tx_push(report.status);
+        spi_tx_push(report.losses);
+        spi_tx_push(age >> 8);
+        spi_tx_push(age);
+        count --;
+    }
+}
+
+/*
+ * Sends switch state, power state, change flags since the last snapshot,
+ * the bus count and then the RX depth and TX free slots of each bus
+ */
+static inline void push_status_snapshot(void) {
+    uint8_t changed = 0;
+    uint8_t bus;
+    
+    if(sw_state != snap_sw_state) changed |= SPI_SNAP_SW;
+    if(sw_event_count()) changed |= SPI_SNAP_SW_EVT;
+    if(pwr_state != snap_pwr_state) changed |= SPI_SNAP_PWR;
+    if(handoff != snap_handoff) changed |= SPI_SNAP_HANDOFF;
+    snap_sw_state = sw_state;
+    snap_pwr_state = pwr_state;
+    snap_handoff = handoff;
+    
+    for(bus=0; bus<J1850_BUS_COUNT; bus++) {
+        cli();
+        uint8_t rx_count = j1850_bus[bus].rx_count;
+        uint8_t tx_count = j1850_bus[bus].tx_count;
+        sei();
+        
+        //Only the first two buses have change flags, the rest go by their depth
+        if(bus < 2) {
+            if(rx_count != snap_rx_count[bus]) changed |= SPI_SNAP_RX0<<bus;
+            if(tx_count != snap_tx_count[bus]) changed |= SPI_SNAP_TX0<<bus;
+        }
+        snap_rx_count[bus] = rx_count;
+        snap_tx_count[bus] = tx_count;
+    }
+    
+    spi_tx_push(snap_sw_state);
+    spi_tx_push(snap_pwr_state);
+    spi_tx_push(changed);
+    spi_tx_push(J1850_BUS_COUNT);
+    for(bus=0; bus<J1850_BUS_COUNT; bus++) spi_tx_push(j1850_rx_depth(bus));
+    for(bus=0; bus<J1850_BUS_COUNT; bus++) spi_tx_push(j1850_tx_free(bus));
+}
+
+/*
+ * Sends the number of queued switch events followed by each one's switch,
+ * type and age
+ */
+static inline void push_sw_events(void) {
+    sw_event_t evt;
+    uint16_t now = tmr_stamp();
+    
+    spi_tx_push(sw_event_count());
+    while(sw_event_pop(&evt)) {
+        uint16_t age = now - evt.stamp;
+        spi_tx_push(evt.sw);
+        spi_tx_push(evt.type);
+        spi_tx_push(age >> 8);
+        spi_tx_push(age);
+    }
+}
+
+/*
+ * Throws away any half received command and anything still waiting to go
+ * out, so the next byte from the Pi starts a fresh command
+ */
+static inline void spi_do_resync(void) {
+    cli();
+    rx_buf.start = rx_buf.end;
+    tx_buf.start = tx_buf.end;
+    stream_left = 0;
+    spi_resync = 0;
+    sei();
+    
+    spi_cmd_status = 0x00;
+    spi_resyncs ++;
+}
+
 void spi_process(uint8_t tmr_10ms) {
+    if(spi_resync) spi_do_resync();
+    
     uint8_t *start = (uint8_t *)rx_buf.start;
     cli();
     uint8_t *end = (uint8_t *)rx_buf.end;
@@ -110,15 +283,30 @@ void spi_process(uint8_t tmr_10ms) {
     if((uint8_t)(tmr_10ms - last_tmr_10ms) > 10) {
         last_tmr_10ms = tmr_10ms;
         spi_active = 0;
+        handoff = 0;
+        stream_left = 0;
     }
     
-    if(start != end) {
+    //Work through everything that's come in so whole commands get done in one go
+    while(start != end) {
         spi_active = 1;
         last_tmr_10ms = tmr_10ms;
         
         switch(spi_cmd_status) {
-            j1850_msg_buf_t *msg;
+            //A send is built up here and only copied into the bus's queue once it's
+            //all in. It can take more than one pass, and the satellite emulator
+            //queues replies on bus 0 in between
+            static j1850_msg_buf_t msg;
             static uint8_t *byte;
+            static uint8_t thresh[SW_THRESH_COUNT];
+            static uint8_t thresh_sw;
+            static uint8_t thresh_count;
+            static uint8_t tx_bus;
+            static uint8_t tx_id;
+            static uint8_t tx_retries;
+            static uint8_t tx_timeout;
+            static uint8_t discard;
+            static uint8_t ack_bus;
             case 0x00:
                 switch(*start) {
                     case 0x01:
@@ -128,10 +316,10 @@ void spi_process(uint8_t tmr_10ms) {
                         spi_tx_push(pwr_state);
                         break;
                     case 0x03:
-                        pop_j1850_to_spi(&j1850_bus[0]);
+                        send_j1850_to_spi(0, 0);
                         break;
                     case 0x04:
-                        pop_j1850_to_spi(&j1850_bus[1]);
+                        send_j1850_to_spi(1, 0);
                         break;
                     case 0x05:
                         j1850_listen_bytes = 0;
@@ -140,72 +328,174 @@ void spi_process(uint8_t tmr_10ms) {
                         spi_cmd_status = 0x01;
                         break;
                     case 0x07:
+                    case 0x08:
+                        tx_bus = *start - 0x07;
+                        tx_id = 0;
+                        tx_retries = J1850_TX_RETRY_FOREVER;
+                        tx_timeout = 0;
                         spi_cmd_status = 0x02;
                         break;
-                    case 0x08:
-                        spi_cmd_status = 0x03;
+                    case 0x09:
+                        push_status_snapshot();
+                        break;
+                    case 0x0A:
+                        push_sw_events();
+                        break;
+                    case 0x0B:
+                        spi_cmd_status = 0x06;
+                        break;
+                    case 0x0C:
+                        if(sat_active) spi_tx_push(handoff | HANDOFF_SAT_ACTIVE);
+                        else spi_tx_push(handoff);
+                        break;
+                    case 0x0D:
+                        spi_cmd_status = 0x08;
+                        break;
+                    case 0x0E:
+                        ack_j1850(0);
+                        break;
+                    case 0x0F:
+                        ack_j1850(1);
+                        break;
+                    case 0x10:
+                        spi_cmd_status = 0x09;
+                        break;
+                    case 0x11:
+                        spi_cmd_status = 0x0A;
+                        break;
+                    case 0x12:
+                        tx_id = 0;
+                        tx_retries = J1850_TX_RETRY_FOREVER;
+                        tx_timeout = 0;
+                        spi_cmd_status = 0x0B;
+                        break;
+                    case 0x13:
+                        spi_cmd_status = 0x0C;
+                        break;
+                    case 0x14:
+                        push_tx_reports();
+                        break;
+                    case 0x15:
+                        spi_cmd_status = 0x10;
+                        break;
+                    case 0x16:
+                        spi_cmd_status = 0x11;
+                        break;
+                    case 0x17:
+                        spi_cmd_status = 0x12;
                         break;
                 }
                 break;
             case 0x01:
-                j1850_listen_headers[j1850_listen_bytes] = *start;
-                j1850_listen_bytes ++;
+                //Any more than fit are dropped
+                if(j1850_listen_bytes < J1850_LISTEN_MAX) {
+                    j1850_listen_headers[j1850_listen_bytes] = *start;
+                    j1850_listen_bytes ++;
+                }
                 spi_cmd_status = 0;
                 break;
             case 0x02:
-                j1850_bus[0].tx_msg_end->bytes = *start;
-                byte = j1850_bus[0].tx_msg_end->buf;
+                //A bus this build doesn't have or a length that won't fit
+                //with its CRC, throw the frame away
+                if(tx_bus >= J1850_BUS_COUNT || *start == 0 || *start > J1850_MSG_SIZE - 1) {
+                    discard = *start;
+                    spi_cmd_status = discard ? 0x05 : 0x00;
+                    break;
+                }
+                
+                msg.bytes = *start;
+                msg.id = tx_id;
+                msg.retries = tx_retries;
+                msg.timeout = tx_timeout;
+                byte = msg.buf;
                 spi_cmd_status = 0x04;
                 break;
-            case 0x03:
-                j1850_bus[1].tx_msg_end->bytes = *start;
-                byte = j1850_bus[1].tx_msg_end->buf;
-                spi_cmd_status = 0x05;
-                break;
             case 0x04:
-                msg = (j1850_msg_buf_t *)j1850_bus[0].tx_msg_end;
-                
                 *byte = *start;
                 byte ++;
                 
-                if(byte == &msg->buf[msg->bytes]) {
-                    *byte = j1850_crc(msg->buf, msg->bytes);
-                    msg->bytes ++;
+                if(byte == &msg.buf[msg.bytes]) {
+                    *byte = j1850_crc(msg.buf, msg.bytes);
+                    msg.bytes ++;
+                    *(j1850_msg_buf_t *)j1850_bus[tx_bus].tx_msg_end = msg;
                     
-                    msg ++;
-                    if(msg == &j1850_bus[0].tx_buf[J1850_MSG_BUF_SIZE_TX]) msg = (j1850_msg_buf_t *)j1850_bus[0].tx_buf;
                     //On overflow drop the last message
-                    cli();
-                    if(msg != j1850_bus[0].tx_msg_start) {
-                        j1850_bus[0].tx_msg_end = msg;
-                    }
-                    sei();
+                    j1850_tx_commit(tx_bus);
                     
                     spi_cmd_status = 0x00;
                 }
                 break;
-            case 0x05:
-                msg = (j1850_msg_buf_t *)j1850_bus[1].tx_msg_end;
-                
-                *byte = *start;
-                byte ++;
+            case 0x06:
+                thresh_sw = *start;
+                thresh_count = 0;
+                spi_cmd_status = 0x07;
+                break;
+            case 0x07:
+                thresh[thresh_count] = *start;
+                thresh_count ++;
                 
-                if(byte == &msg->buf[msg->bytes]) {
-                    *byte = j1850_crc(msg->buf, msg->bytes);
-                    msg->bytes ++;
-                    
-                    msg ++;
-                    if(msg == &j1850_bus[1].tx_buf[J1850_MSG_BUF_SIZE_TX]) msg = (j1850_msg_buf_t *)j1850_bus[1].tx_buf;
-                    //On overflow drop the last message
-                    cli();
-                    if(msg != j1850_bus[1].tx_msg_start) {
-                        j1850_bus[1].tx_msg_end = msg;
-                    }
-                    sei();
-        
+                if(thresh_count == SW_THRESH_COUNT) {
+                    sw_set_thresh(thresh_sw, thresh);
                     spi_cmd_status = 0x00;
                 }
                 break;
+            case 0x08:
+                handoff = *start & HANDOFF_SAT;
+                spi_cmd_status = 0x00;
+                break;
+            case 0x05:
+                discard --;
+                if(!discard) spi_cmd_status = 0x00;
+                break;
+            case 0x09:
+                send_j1850_to_spi(*start, 0);
+                spi_cmd_status = 0x00;
+                break;
+            case 0x0A:
+                ack_j1850(*start);
+                spi_cmd_status = 0x00;
+                break;
+            case 0x0B:
+                tx_bus = *start;
+                spi_cmd_status = 0x02;
+                break;
+            case 0x0C:
+                tx_bus = *start;
+                spi_cmd_status = 0x0D;
+                break;
+            case 0x0D:
+                tx_id = *start;
+                spi_cmd_status = 0x0E;
+                break;
+            case 0x0E:
+                tx_retries = *start;
+                spi_cmd_status = 0x0F;
+                break;
+            case 0x0F:
+                tx_timeout = *start;
+                spi_cmd_status = 0x02;
+                break;
+            case 0x10:
+                //Heartbeat, echo the Pi's sequence number along with what's
+                //reset us and how many resyncs have been done
+                spi_tx_push(*start);
+                spi_tx_push(reset_flags);
+                spi_tx_push(spi_resyncs);
+                reset_flags = 0;
+                spi_cmd_status = 0x00;
+                break;
+            case 0x11:
+                send_j1850_to_spi(*start, 1);
+                spi_cmd_status = 0x00;
+                break;
+            case 0x12:
+                ack_bus = *start;
+                spi_cmd_status = 0x13;
+                break;
+            case 0x13:
+                ack_j1850_at(ack_bus, *start);
+                spi_cmd_status = 0x00;
+                break;
         }
         
         start ++;
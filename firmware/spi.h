@@ -15,6 +15,22 @@ inline int8_t spi_tx_push(uint8_t byte);
 
 #define SPI_BUF_SIZE 65
 
+//Answer to a resync check once everything half done has been thrown away
+#define SPI_SYNC_ACK 0xA5
+
+//Transmit reports sent per request, each is 6 bytes
+#define SPI_TX_REPORT_MAX 8
+
+//Status snapshot change flags
+#define SPI_SNAP_SW 0x01
+#define SPI_SNAP_PWR 0x02
+#define SPI_SNAP_RX0 0x04
+#define SPI_SNAP_RX1 0x08
+#define SPI_SNAP_TX0 0x10
+#define SPI_SNAP_TX1 0x20
+#define SPI_SNAP_SW_EVT 0x40
+#define SPI_SNAP_HANDOFF 0x80
+
 #define MISO_DDR DDRB 
 #define MISO_MSK (1<<PINB4)
 